@@ -0,0 +1,150 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "server.h"
+
+/*
+ * Reconnect storm benchmark.
+ * Many clients connect to a TCP listener at once, as agents do
+ * when the server restarts. Measures how long the server takes to
+ * accept them all, and how many polls that takes, for several
+ * listen() backlogs. A connection that finds the backlog full has
+ * its handshake retried by the client's kernel a second or more
+ * later. Gives up on a backlog after TIMEOUT seconds.
+ *
+ *   usage: bench-accept
+ */
+
+#define NCLIENTS	1000
+#define TIMEOUT		5
+
+static const int backlogs[] = { 5, 128, SOMAXCONN };
+#define NBACKLOGS (sizeof backlogs / sizeof backlogs[0])
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned int naccepted;
+
+static void *
+on_accept(struct server *s, int fd, struct listener *l)
+{
+	naccepted++;
+	return NULL;
+}
+
+static int
+on_ready(struct server *s, void *client, int fd)
+{
+	char buf[64];
+
+	return read(fd, buf, sizeof buf);
+}
+
+static const struct server_context context = {
+	.on_accept = on_accept,
+	.on_ready = on_ready,
+};
+
+static void
+bench(int backlog)
+{
+	static struct listener listener = { "bench" };
+	static int clients[NCLIENTS];
+	struct server *server;
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof sin;
+	unsigned int i, npolls = 0;
+	double t0, t;
+	int fd;
+
+	server = server_new(&context);
+	if (!server) {
+		perror("server_new");
+		exit(1);
+	}
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1) {
+		perror("socket");
+		exit(1);
+	}
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(fd, (struct sockaddr *)&sin, sizeof sin) == -1 ||
+	    getsockname(fd, (struct sockaddr *)&sin, &sinlen) == -1 ||
+	    listen(fd, backlog) == -1 ||
+	    server_add_listener(server, fd, &listener) == -1)
+	{
+		perror("listener");
+		exit(1);
+	}
+
+	/* Everyone connects at once */
+	naccepted = 0;
+	t0 = now();
+	for (i = 0; i < NCLIENTS; i++) {
+		clients[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		if (clients[i] == -1) {
+			perror("socket");
+			exit(1);
+		}
+		if (connect(clients[i], (struct sockaddr *)&sin,
+		    sizeof sin) == -1 && errno != EINPROGRESS)
+		{
+			perror("connect");
+			exit(1);
+		}
+	}
+	while (naccepted < NCLIENTS && now() - t0 < TIMEOUT) {
+		if (server_poll(server, 100) == -1) {
+			perror("server_poll");
+			exit(1);
+		}
+		npolls++;
+	}
+	t = now() - t0;
+
+	if (naccepted < NCLIENTS)
+		printf("backlog %4d %10s %6u polls, %u/%u accepted\n",
+			backlog, "timeout", npolls, naccepted, NCLIENTS);
+	else
+		printf("backlog %4d %7.0f ms %6u polls\n",
+			backlog, t * 1e3, npolls);
+
+	server_free(server);
+	for (i = 0; i < NCLIENTS; i++)
+		close(clients[i]);
+}
+
+int
+main(void)
+{
+	struct rlimit rl;
+	unsigned int k;
+
+	/* Allow as many fds as we may */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		(void) setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+	printf("%u clients connecting at once\n", NCLIENTS);
+	for (k = 0; k < NBACKLOGS; k++)
+		bench(backlogs[k]);
+	return 0;
+}
@@ -0,0 +1,94 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "match.h"
+
+/*
+ * Pattern matching benchmarks.
+ * Compares match(), which parses the pattern on every call, against
+ * match_prog() running the pattern compiled once.
+ *
+ *   usage: bench-match
+ */
+
+#define NKEYS	4096
+#define ROUNDS	256
+
+static const char *patterns[] = {
+	"iface.eth0.stat7.rx_bytes",
+	"iface.eth1*",
+	"iface.eth*.stat*.rx_bytes",
+	"iface.(eth|wlan)?.*",
+	"*.(rx|tx)_(bytes|packets)",
+	"sys.*",
+	"*.status",
+	"dc1.*.status",
+	"*_bytes",
+	"*#",
+	"dc1.rack01.node001.iface.eth*",
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+main(void)
+{
+	static char keys[NKEYS][64];
+	static const char *stats[] = { "rx_bytes", "tx_bytes", "rx_packets" };
+	unsigned int i, j, p, hits;
+	double t0, t_match, t_prog;
+	char prog[1024];
+
+	/* Short interface keys, and longer status keys */
+	for (i = 0; i < NKEYS; i++)
+		if (i % 2)
+			snprintf(keys[i], sizeof keys[i],
+				"dc%u.rack%02u.node%03u.iface.%s%u.link.status",
+				i % 3, i % 40, i % 200,
+				i % 5 ? "eth" : "wlan", i % 7);
+		else
+			snprintf(keys[i], sizeof keys[i], "iface.%s%u.stat%u.%s",
+				i % 5 ? "eth" : "wlan", i % 7, i % 13,
+				stats[i % 3]);
+
+	printf("%-28s %10s %10s %8s\n", "pattern", "match ns", "prog ns",
+		"hits");
+	for (p = 0; p < sizeof patterns / sizeof patterns[0]; p++) {
+		if (match_compile(patterns[p], prog, sizeof prog) >
+		    sizeof prog) {
+			fprintf(stderr, "%s: too big\n", patterns[p]);
+			exit(1);
+		}
+
+		hits = 0;
+		t0 = now();
+		for (j = 0; j < ROUNDS; j++)
+			for (i = 0; i < NKEYS; i++)
+				hits += match(patterns[p], keys[i]);
+		t_match = now() - t0;
+
+		t0 = now();
+		for (j = 0; j < ROUNDS; j++)
+			for (i = 0; i < NKEYS; i++)
+				hits -= match_prog(prog, keys[i]);
+		t_prog = now() - t0;
+
+		if (hits) {
+			fprintf(stderr, "%s: results differ\n", patterns[p]);
+			exit(1);
+		}
+		for (i = 0; i < NKEYS; i++)
+			hits += match_prog(prog, keys[i]);
+		printf("%-28s %10.1f %10.1f %8u\n", patterns[p],
+			t_match * 1e9 / (ROUNDS * NKEYS),
+			t_prog * 1e9 / (ROUNDS * NKEYS), hits);
+	}
+	return 0;
+}
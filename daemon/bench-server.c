@@ -0,0 +1,143 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+
+#include "server.h"
+
+/*
+ * Server dispatch benchmark.
+ * One client sends a byte at a time while many others stay idle.
+ * Measures the cost of each server_poll() that delivers the byte,
+ * as the number of idle connections grows. The idle connections
+ * are dup()s of one socket, so that each costs only one fd.
+ *
+ *   usage: bench-server       (epoll, where available)
+ *          bench-server-poll  (poll)
+ */
+
+#define ROUNDS		10000
+
+static const unsigned int nidle[] = { 10, 1000, 10000 };
+#define NSIZES (sizeof nidle / sizeof nidle[0])
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static unsigned long nready;
+
+static int
+on_ready(struct server *s, void *client, int fd)
+{
+	char ch;
+
+	nready++;
+	return read(fd, &ch, 1);
+}
+
+static const struct server_context context = {
+	.on_ready = on_ready,
+};
+
+/* Returns the seconds taken for ROUNDS events, or -1 if
+ * there were not enough fds */
+static double
+bench(unsigned int n)
+{
+	struct server *server;
+	int active[2], idle[2];
+	unsigned int i, j;
+	double t0, t;
+
+	server = server_new(&context);
+	if (!server) {
+		perror("server_new");
+		exit(1);
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, active) == -1 ||
+	    socketpair(AF_UNIX, SOCK_STREAM, 0, idle) == -1)
+	{
+		perror("socketpair");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		int fd = dup(idle[0]);
+
+		if (fd == -1)
+			break;
+		if (server_add_fd(server, fd, NULL) == -1) {
+			perror("server_add_fd");
+			exit(1);
+		}
+	}
+	if (server_add_fd(server, active[0], NULL) == -1) {
+		perror("server_add_fd");
+		exit(1);
+	}
+
+	t = -1;
+	if (i == n) {
+		nready = 0;
+		t0 = now();
+		for (j = 0; j < ROUNDS; j++) {
+			if (write(active[1], "x", 1) != 1) {
+				perror("write");
+				exit(1);
+			}
+			if (server_poll(server, -1) != 1) {
+				perror("server_poll");
+				exit(1);
+			}
+		}
+		t = now() - t0;
+		if (nready != ROUNDS) {
+			fprintf(stderr, "%lu ready, expected %u\n",
+				nready, ROUNDS);
+			exit(1);
+		}
+	}
+
+	server_free(server);
+	close(active[1]);
+	close(idle[0]);
+	close(idle[1]);
+	return t;
+}
+
+int
+main(void)
+{
+	struct rlimit rl;
+	unsigned int k;
+
+	/* Allow as many fds as we may */
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		(void) setrlimit(RLIMIT_NOFILE, &rl);
+	}
+
+#ifdef SERVER_EPOLL
+	printf("epoll, %u events\n", ROUNDS);
+#else
+	printf("poll, %u events\n", ROUNDS);
+#endif
+	for (k = 0; k < NSIZES; k++) {
+		double t = bench(nidle[k]);
+
+		if (t < 0)
+			printf("%6u idle %14s\n", nidle[k], "(too few fds)");
+		else
+			printf("%6u idle %10.2f us/event\n", nidle[k],
+				t * 1e6 / ROUNDS);
+	}
+	return 0;
+}
@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "store.h"
+
+/*
+ * Store benchmarks.
+ * Prints the average cost of store operations as the keyset grows.
+ *
+ *   usage: bench-store [storefile]
+ */
+
+#define MAXKEYS (512 * 1024)
+#define LOOKUPS (256 * 1024)
+#define CHURNS  (1024 * 1024)
+#define OPENKEYS (1024 * 1024)
+#define SEEKS   (64 * 1024)
+
+/* A tiny deterministic PRNG */
+static unsigned int
+rnd(unsigned int n)
+{
+	static unsigned long long seed = 1;
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (seed >> 33) % n;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Composes a dotted hierarchical key and value for the i'th key */
+static unsigned int
+make_keyvalue(char *buf, size_t bufsz, unsigned int i)
+{
+	int keylen = snprintf(buf, bufsz, "iface.eth%u.stat%u.rx_bytes",
+		i % 1021, i);
+	int vallen = snprintf(buf + keylen + 1, bufsz - keylen - 1, "%u", i);
+	return keylen + 1 + vallen;
+}
+
+/* Inserts keys in a random order, reporting the mean insert cost
+ * each time the store doubles in size */
+static void
+bench_insert(const char *path)
+{
+	struct store *store;
+	unsigned int *order;
+	unsigned int i, next_report, last_report;
+	double t0;
+	char kv[256];
+
+	order = malloc(MAXKEYS * sizeof *order);
+	if (!order) {
+		perror("malloc");
+		exit(1);
+	}
+	for (i = 0; i < MAXKEYS; i++)
+		order[i] = i;
+	for (i = MAXKEYS - 1; i > 0; i--) {
+		unsigned int j = rnd(i + 1);
+		unsigned int t = order[i];
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	unlink(path);
+	store = store_open(path);
+	if (!store) {
+		perror(path);
+		exit(1);
+	}
+	printf("%-24s %10s %12s\n", "insert", "keys", "ns/op");
+	last_report = 0;
+	next_report = 1024;
+	t0 = now();
+	for (i = 0; i < MAXKEYS; i++) {
+		unsigned int sz = make_keyvalue(kv, sizeof kv, order[i]);
+		if (store_put(store, sz, kv) == -1) {
+			perror("store_put");
+			exit(1);
+		}
+		if (i + 1 == next_report) {
+			double t1 = now();
+			printf("%-24s %10u %12.1f\n", "", i + 1,
+				(t1 - t0) * 1e9 / (i + 1 - last_report));
+			last_report = i + 1;
+			next_report *= 2;
+			t0 = t1;
+		}
+	}
+	store_close(store);
+	unlink(path);
+	free(order);
+}
+
+/* Looks up random present keys, reporting the mean lookup cost
+ * each time the store doubles in size */
+static void
+bench_get(const char *path)
+{
+	struct store *store;
+	unsigned int i, j, n;
+	double t0;
+	char kv[256];
+
+	unlink(path);
+	store = store_open(path);
+	if (!store) {
+		perror(path);
+		exit(1);
+	}
+	printf("%-24s %10s %12s\n", "get", "keys", "ns/op");
+	n = 0;
+	for (i = 1024; i <= MAXKEYS; i *= 2) {
+		for (; n < i; n++) {
+			unsigned int sz = make_keyvalue(kv, sizeof kv, n);
+			if (store_put(store, sz, kv) == -1) {
+				perror("store_put");
+				exit(1);
+			}
+		}
+		t0 = now();
+		for (j = 0; j < LOOKUPS; j++) {
+			make_keyvalue(kv, sizeof kv, rnd(n));
+			if (!store_get(store, kv)) {
+				fprintf(stderr, "store_get: missing %s\n", kv);
+				exit(1);
+			}
+		}
+		printf("%-24s %10u %12.1f\n", "", n,
+			(now() - t0) * 1e9 / LOOKUPS);
+	}
+	store_close(store);
+	unlink(path);
+}
+
+/* Replaces random keys with values of varying length, which leaves
+ * gaps behind, reporting the mean and the worst single put */
+static void
+bench_churn(const char *path)
+{
+	struct store *store;
+	struct store_stats stats;
+	unsigned int i, n = MAXKEYS / 2;
+	double t0, t1, start, worst = 0;
+	char kv[256];
+
+	unlink(path);
+	store = store_open(path);
+	if (!store) {
+		perror(path);
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		unsigned int sz = make_keyvalue(kv, sizeof kv, i);
+		if (store_put(store, sz, kv) == -1) {
+			perror("store_put");
+			exit(1);
+		}
+	}
+	start = now();
+	for (i = 0; i < CHURNS; i++) {
+		unsigned int k = rnd(n);
+		unsigned int vallen = 1 + rnd(100);
+		int keylen;
+
+		keylen = snprintf(kv, sizeof kv,
+			"iface.eth%u.stat%u.rx_bytes", k % 1021, k);
+		memset(kv + keylen + 1, 'a' + rnd(26), vallen);
+		t0 = now();
+		if (store_put(store, keylen + 1 + vallen, kv) == -1) {
+			perror("store_put");
+			exit(1);
+		}
+		t1 = now();
+		if (t1 - t0 > worst)
+			worst = t1 - t0;
+	}
+	store_get_stats(store, &stats);
+	printf("%-24s %10s %12s %12s\n", "churn", "keys", "ns/op",
+		"worst ns");
+	printf("%-24s %10u %12.1f %12.0f\n", "", n,
+		(now() - start) * 1e9 / CHURNS, worst * 1e9);
+	printf("  %lu compactions, %lu repacks, %lu grows, max pause %.0f ns,"
+		" %u/%u bytes live/file\n",
+		stats.compactions, stats.repacks, stats.grows,
+		(double)stats.max_pause_ns,
+		(unsigned)stats.live, (unsigned)stats.filesz);
+	store_close(store);
+	unlink(path);
+}
+
+/* Times re-opening a store holding many keys, first from a checkpointed
+ * index sidecar and then by rebuilding the index from a full scan */
+static void
+bench_open(const char *path)
+{
+	struct store *store;
+	unsigned int i;
+	double t0;
+	char kv[256];
+	char idxpath[1024];
+
+	unlink(path);
+	store = store_open(path);
+	if (!store) {
+		perror(path);
+		exit(1);
+	}
+	for (i = 0; i < OPENKEYS; i++) {
+		unsigned int sz = make_keyvalue(kv, sizeof kv, i);
+		if (store_put(store, sz, kv) == -1) {
+			perror("store_put");
+			exit(1);
+		}
+	}
+	if (store_checkpoint(store) == -1) {
+		perror("store_checkpoint");
+		exit(1);
+	}
+	store_close(store);
+
+	printf("%-24s %10s %12s\n", "open", "keys", "ms");
+	t0 = now();
+	store = store_open(path);
+	if (!store) {
+		perror(path);
+		exit(1);
+	}
+	printf("%-24s %10u %12.1f\n", "  sidecar", OPENKEYS,
+		(now() - t0) * 1e3);
+	store_close(store);
+
+	snprintf(idxpath, sizeof idxpath, "%s.idx", path);
+	unlink(idxpath);
+	t0 = now();
+	store = store_open(path);
+	if (!store) {
+		perror(path);
+		exit(1);
+	}
+	printf("%-24s %10u %12.1f\n", "  scan", OPENKEYS, (now() - t0) * 1e3);
+	store_close(store);
+	unlink(path);
+}
+
+/* Compares visiting the keys with a given prefix by seeking to
+ * the prefix, against scanning the whole store */
+static void
+bench_seek(const char *path)
+{
+	struct store *store;
+	struct store_index ix;
+	const struct info *info;
+	unsigned int i, j, n = MAXKEYS / 2, seen = 0;
+	double t0, seek_ns, scan_ns;
+	char kv[256], prefix[32];
+	size_t prefixlen;
+
+	unlink(path);
+	store = store_open(path);
+	if (!store) {
+		perror(path);
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		unsigned int sz = make_keyvalue(kv, sizeof kv, i);
+		if (store_put(store, sz, kv) == -1) {
+			perror("store_put");
+			exit(1);
+		}
+	}
+
+	t0 = now();
+	for (j = 0; j < SEEKS; j++) {
+		prefixlen = snprintf(prefix, sizeof prefix, "iface.eth%u.",
+			rnd(1021));
+		for (info = store_seek(store, prefix, &ix);
+		     info && strncmp(info->keyvalue, prefix, prefixlen) == 0;
+		     info = store_get_next(store, &ix))
+			seen++;
+	}
+	seek_ns = (now() - t0) * 1e9 / SEEKS;
+
+	t0 = now();
+	for (j = 0; j < SEEKS / 64; j++) {
+		prefixlen = snprintf(prefix, sizeof prefix, "iface.eth%u.",
+			rnd(1021));
+		for (info = store_get_first(store, &ix); info;
+		     info = store_get_next(store, &ix))
+			if (strncmp(info->keyvalue, prefix, prefixlen) == 0)
+				seen++;
+	}
+	scan_ns = (now() - t0) * 1e9 / (SEEKS / 64);
+
+	printf("%-24s %10s %12s %12s\n", "prefix", "keys", "seek ns",
+		"scan ns");
+	printf("%-24s %10u %12.1f %12.1f\n", "", n, seek_ns, scan_ns);
+	if (!seen)
+		printf("  (no keys seen?)\n");
+	store_close(store);
+	unlink(path);
+}
+
+/* Compares the cost of puts with and without checksums, and of
+ * verifying them when opening a store */
+static void
+bench_checksum(const char *path)
+{
+	static const struct {
+		const char *name;
+		unsigned int flags;
+	} modes[] = {
+		{ "  none", 0 },
+		{ "  crc32c", STORE_CRC },
+		{ "  crc32c lazy", STORE_CRC | STORE_LAZY },
+	};
+	struct store *store;
+	unsigned int i, m, n = MAXKEYS / 2;
+	double t0, put_ns, open_ms;
+	char kv[256];
+
+	printf("%-24s %10s %12s %12s\n", "checksum", "keys", "put ns/op",
+		"open ms");
+	for (m = 0; m < sizeof modes / sizeof modes[0]; m++) {
+		unlink(path);
+		store = store_open_flags(path, modes[m].flags);
+		if (!store) {
+			perror(path);
+			exit(1);
+		}
+		t0 = now();
+		for (i = 0; i < n; i++) {
+			unsigned int sz = make_keyvalue(kv, sizeof kv, i);
+			if (store_put(store, sz, kv) == -1) {
+				perror("store_put");
+				exit(1);
+			}
+		}
+		put_ns = (now() - t0) * 1e9 / n;
+		store_close(store);
+
+		t0 = now();
+		store = store_open_flags(path, modes[m].flags);
+		if (!store) {
+			perror(path);
+			exit(1);
+		}
+		open_ms = (now() - t0) * 1e3;
+		printf("%-24s %10u %12.1f %12.1f\n", modes[m].name, n,
+			put_ns, open_ms);
+		store_close(store);
+	}
+	unlink(path);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1] : "/tmp/bench-store.dat";
+
+	bench_insert(path);
+	bench_get(path);
+	bench_churn(path);
+	bench_open(path);
+	bench_seek(path);
+	bench_checksum(path);
+	return 0;
+}
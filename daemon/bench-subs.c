@@ -0,0 +1,147 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "subs.h"
+
+/*
+ * Subscription index benchmarks.
+ * Many clients subscribe to the same few patterns. Compares testing
+ * every subscription against each written key, as a server without
+ * an index would, against subs_match(), which tests each distinct
+ * pattern once and fans out to its subscribers. Then a few hot keys
+ * are matched repeatedly, as when counters are written often.
+ *
+ *   usage: bench-subs
+ */
+
+#define NCLIENTS	1000
+#define NKEYS		4096
+#define ROUNDS		16
+#define NHOT		16
+
+static const char *patterns[] = {
+	"alarm.*",
+	"alarm.fire.zone?",
+	"iface.eth0.*",
+	"iface.(eth|wlan)?.stat*.rx_bytes",
+	"iface.eth1.stat7.tx_bytes",
+	"sys.load",
+	"sys.mem.*",
+	"*.rx_packets",
+	"power.(mains|battery)",
+	"door.*.open",
+};
+#define NPATTERNS (sizeof patterns / sizeof patterns[0])
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+main(void)
+{
+	static struct subscriber clients[NCLIENTS];
+	static struct sub *subs_of[NCLIENTS][NPATTERNS];
+	static char keys[NKEYS][64];
+	static const char *stats[] = { "rx_bytes", "tx_bytes", "rx_packets" };
+	struct subscriber *const *result;
+	struct subs *subs;
+	unsigned int i, j, c, p;
+	unsigned long found_each = 0, found_index = 0;
+	double t0, t_each, t_index, t_hot;
+	int n;
+
+	for (i = 0; i < NKEYS; i++)
+		switch (i % 4) {
+		case 0:
+			snprintf(keys[i], sizeof keys[i], "iface.%s%u.stat%u.%s",
+				i % 5 ? "eth" : "wlan", i % 7, i % 13,
+				stats[i % 3]);
+			break;
+		case 1:
+			snprintf(keys[i], sizeof keys[i], "alarm.%s.zone%u",
+				i % 3 ? "fire" : "flood", i % 10);
+			break;
+		case 2:
+			snprintf(keys[i], sizeof keys[i], "sys.mem.%u", i);
+			break;
+		default:
+			snprintf(keys[i], sizeof keys[i], "door.%u.open", i % 50);
+			break;
+		}
+
+	/* Every client subscribes to every pattern */
+	subs = subs_new();
+	if (!subs) {
+		perror("subs_new");
+		exit(1);
+	}
+	for (c = 0; c < NCLIENTS; c++)
+		for (p = 0; p < NPATTERNS; p++) {
+			subs_of[c][p] = subs_add(subs, &clients[c],
+				patterns[p]);
+			if (!subs_of[c][p]) {
+				perror(patterns[p]);
+				exit(1);
+			}
+		}
+
+	/* Each client tests each of its subscriptions */
+	t0 = now();
+	for (j = 0; j < ROUNDS; j++)
+		for (i = 0; i < NKEYS; i++)
+			for (c = 0; c < NCLIENTS; c++)
+				for (p = 0; p < NPATTERNS; p++)
+					if (subs_test(subs_of[c][p], keys[i])) {
+						found_each++;
+						break;
+					}
+	t_each = now() - t0;
+
+	t0 = now();
+	for (j = 0; j < ROUNDS; j++)
+		for (i = 0; i < NKEYS; i++) {
+			n = subs_match(subs, keys[i], &result);
+			if (n == -1) {
+				perror("subs_match");
+				exit(1);
+			}
+			found_index += n;
+		}
+	t_index = now() - t0;
+
+	t0 = now();
+	for (j = 0; j < ROUNDS; j++)
+		for (i = 0; i < NKEYS; i++)
+			if (subs_match(subs, keys[i % NHOT], &result) == -1) {
+				perror("subs_match");
+				exit(1);
+			}
+	t_hot = now() - t0;
+
+	if (found_each != found_index) {
+		fprintf(stderr, "results differ: %lu vs %lu\n",
+			found_each, found_index);
+		exit(1);
+	}
+
+	printf("%u clients x %u patterns, %lu deliveries per round\n",
+		NCLIENTS, (unsigned)NPATTERNS, found_index / ROUNDS);
+	printf("%-20s %10.2f us/key\n", "each subscription",
+		t_each * 1e6 / (ROUNDS * NKEYS));
+	printf("%-20s %10.2f us/key\n", "subs_match",
+		t_index * 1e6 / (ROUNDS * NKEYS));
+	printf("%-20s %10.2f us/key\n", "subs_match, hot",
+		t_hot * 1e6 / (ROUNDS * NKEYS));
+
+	for (c = 0; c < NCLIENTS; c++)
+		for (p = 0; p < NPATTERNS; p++)
+			subs_remove(subs, subs_of[c][p]);
+	subs_free(subs);
+	return 0;
+}
@@ -0,0 +1,96 @@
+#include <string.h>
+#include "crc32c.h"
+
+#define POLY	0x82f63b78	/* Castagnoli polynomial, reversed */
+
+/* table[k][b] is the CRC of byte b followed by k zero bytes */
+static uint32_t table[8][256];
+
+static void
+table_init(void)
+{
+	uint32_t b, crc;
+	unsigned int k, i;
+
+	for (b = 0; b < 256; b++) {
+		crc = b;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (POLY & -(crc & 1));
+		table[0][b] = crc;
+	}
+	for (b = 0; b < 256; b++)
+		for (k = 1; k < 8; k++)
+			table[k][b] = (table[k - 1][b] >> 8) ^
+				table[0][table[k - 1][b] & 0xff];
+}
+
+/* Slicing-by-8: eight table lookups per 8 bytes of input */
+uint32_t
+crc32c_sw(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+
+	if (!table[0][1])
+		table_init();
+	crc = ~crc;
+	while (len >= 8) {
+		uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 |
+			(uint32_t)p[3] << 24);
+		crc = table[7][lo & 0xff] ^
+		      table[6][(lo >> 8) & 0xff] ^
+		      table[5][(lo >> 16) & 0xff] ^
+		      table[4][lo >> 24] ^
+		      table[3][p[4]] ^
+		      table[2][p[5]] ^
+		      table[1][p[6]] ^
+		      table[0][p[7]];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	return ~crc;
+}
+
+#if defined __x86_64__ && defined __GNUC__
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	unsigned long long c = ~crc;
+
+	while (len >= 8) {
+		unsigned long long v;
+
+		memcpy(&v, p, 8);
+		c = __builtin_ia32_crc32di(c, v);
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		c = __builtin_ia32_crc32qi(c, *p++);
+	return ~(uint32_t)c;
+}
+#endif
+
+static uint32_t crc32c_init(uint32_t, const void *, size_t);
+static uint32_t (*crc32c_impl)(uint32_t, const void *, size_t) = crc32c_init;
+
+/* Chooses an implementation on first use */
+static uint32_t
+crc32c_init(uint32_t crc, const void *buf, size_t len)
+{
+	crc32c_impl = crc32c_sw;
+#if defined __x86_64__ && defined __GNUC__
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c_impl = crc32c_sse42;
+#endif
+	return crc32c_impl(crc, buf, len);
+}
+
+uint32_t
+crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	return crc32c_impl(crc, buf, len);
+}
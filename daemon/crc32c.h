@@ -0,0 +1,15 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C (Castagnoli), as used by iSCSI and ext4.
+ * Uses the SSE4.2 CRC32 instruction where the CPU has it.
+ *
+ * Pass 0 as the initial crc. Checksums may be continued:
+ * crc32c(crc32c(0, a, alen), b, blen) is the checksum of a then b.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* The portable, table-driven implementation. For testing. */
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
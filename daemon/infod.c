@@ -4,17 +4,24 @@
  * Client transactions permit coherent views.
  */
 
+#define _GNU_SOURCE	/* recvmmsg() */
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
 #include <syslog.h>
 #include <netdb.h>
 #include <signal.h>
 
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/uio.h>
 
@@ -25,10 +32,32 @@
 #include "storepath.h"
 #include "store.h"
 #include "match.h"
+#include "subs.h"
+#include "outq.h"
+#include "throttle.h"
 #include "list.h"
 
-#define MAX_SUBS	16		/* Maximum subscriptions per client */
+#ifndef MAX_SUBS
+#define MAX_SUBS	16		/* Default subscriptions per client */
+#endif
+#ifndef MAX_QUEUE
+#define MAX_QUEUE	(1024*1024)	/* Default output bytes held per client */
+#endif
+#ifndef MAX_SOCKETS
+#define MAX_SOCKETS	1024		/* Default limit on open sockets */
+#endif
+#define FD_RESERVE	16		/* fds kept for other than sockets */
+#ifndef BACKLOG
+#define BACKLOG		SOMAXCONN	/* Default connections awaiting accept */
+#endif
 #define MAX_BUFCMDS	32		/* Maximum cmds in a transaction */
+#define READ_MAXMSG	16		/* packets from one recvmmsg() */
+#define READ_ROUNDS	4		/* reads of a client per wakeup */
+#define BATCH_MAXSIZE	(256*1024)	/* output gathered before writing */
+#define PROTO_VERSION	1		/* Highest protocol version spoken */
+#define MAX_INTERVAL	3600000		/* Longest SUB interval, in ms */
+#define CHECKPOINT	60		/* Default seconds between checkpoints */
+#define MAX_CHECKPOINT	86400		/* Longest -k period, in seconds */
 
 static struct options {
 #ifndef SMALL
@@ -41,31 +70,54 @@ static struct options {
 # define VERBOSE 0
 #endif
 	unsigned char syslog;		/* -s */
+	unsigned char checksums;	/* -c */
 	const char *store_path;		/* -f */
+	unsigned int max_subs;		/* -m */
+	unsigned long max_queue;	/* -q */
+	unsigned int max_sockets;	/* -n */
+	int backlog;			/* -b */
+	unsigned int checkpoint;	/* -k */
 } options;
 
 /* global store */
 static struct store *the_store;
+static struct subs *the_subs;	/* index of all clients' subscriptions */
+
+/* During each turn of the main loop, clients' output is gathered here */
+static int batching;
+static struct client *batched_clients;
 
 /* pre-framed unix listener */
 static struct listener unix_listener = { "unix", NULL };
+#ifndef SMALL
+static struct listener tcp_listener = { "tcp", tcp_peername };
+#endif
 
 /* Client connection record */
 struct client {
 	LINK(struct client);
 	int fd;			/* accepted socket */
 	struct proto *proto;	/* protocol state */
+	struct server *server;
+	struct outq *outq;	/* output the socket has yet to take */
+	unsigned char packets;	/* socket keeps message boundaries */
+	struct client *batch_next, **batch_prevp; /* in batched_clients */
+	unsigned char batched;	/* output is being gathered */
+	unsigned char backlogged; /* had output queued when batched */
 
 	unsigned int nsubs;
+	unsigned int nthrottled;	/* subs with an interval */
 	unsigned int nbufcmds;
 	unsigned int begins;
+	unsigned char version;	/* negotiated by HELLO */
+
+	/* Active subscriptions, held in the_subs. Each sub's
+	 * udata is its interval in ms, or 0 */
+	struct subscriber subscriber;
 
-	/* Active subscripotions */
-	struct subscription {
-		LINK(struct subscription);
-		unsigned int pattern_len;
-		char pattern[];	/* pattern for match() */
-	} *subs;
+	/* Keys held back by subscription intervals */
+	struct throttle *throttle;
+	struct server_timer throttle_timer;
 
 	/* A buffered command held during unclosed BEGIN */
 	struct bufcmd {
@@ -116,25 +168,6 @@ log_perror(const char *msg)
 	fprintf(stderr, "%s: %s\n", msg, estr);
 }
 
-struct subscription *
-subscription_new(const char *pattern, unsigned int pattern_len)
-{
-	struct subscription *sub = malloc(sizeof *sub + pattern_len + 1);
-	if (sub) {
-		sub->pattern_len = pattern_len;
-		memcpy(sub->pattern, pattern, pattern_len);
-		sub->pattern[pattern_len] = '\0';
-	}
-	return sub;
-}
-
-static void
-subscription_free(struct subscription *sub)
-{
-	free(sub);
-}
-
-
 struct bufcmd *
 bufcmd_new(unsigned char msg, const char *data, unsigned int datalen)
 {
@@ -156,15 +189,14 @@ bufcmd_free(struct bufcmd *bcmd)
 static void
 client_free(struct client *client)
 {
-	struct subscription *sub;
 	struct bufcmd *bcmd;
 
 	proto_free(client->proto);
+	outq_free(client->outq);
+	server_timer_stop(&client->throttle_timer);
+	throttle_free(client->throttle);
 
-	while ((sub = client->subs)) {
-		REMOVE(sub);
-		subscription_free(sub);
-	}
+	subs_remove_all(the_subs, &client->subscriber);
 	while ((bcmd = client->bufcmds)) {
 		REMOVE(bcmd);
 		bufcmd_free(bcmd);
@@ -173,10 +205,11 @@ client_free(struct client *client)
 }
 
 static struct client *
-client_new(int fd)
+client_new(int fd, int packets)
 {
 	struct client *client;
 	struct proto *proto;
+	struct outq *outq;
 
 	client = malloc(sizeof *client);
 	if (!client)
@@ -187,11 +220,25 @@ client_new(int fd)
 		free(client);
 		return NULL;
 	}
+	outq = outq_new(packets);
+	if (!outq) {
+		proto_free(proto);
+		free(client);
+		return NULL;
+	}
 
 	client->proto = proto;
+	client->outq = outq;
+	client->packets = packets;
+	client->batched = 0;
 	client->fd = fd;
-	client->subs = NULL;
 	client->nsubs = 0;
+	client->nthrottled = 0;
+	client->version = 0;
+	client->throttle = NULL;
+	memset(&client->throttle_timer, 0, sizeof client->throttle_timer);
+	memset(&client->subscriber, 0, sizeof client->subscriber);
+	client->subscriber.udata = client;
 	client->begins = 0;
 	client->bufcmds = NULL;
 	client->nbufcmds = 0;
@@ -203,19 +250,6 @@ client_new(int fd)
 	return client;
 }
 
-/* Find the subscription record for the client, or NULL */
-static struct subscription *
-client_find_subscription(struct client *client, const char *pattern,
-	unsigned int pattern_len)
-{
-	struct subscription *sub;
-	for (sub = client->subs; sub; sub = NEXT(sub))
-		if (sub->pattern_len == pattern_len &&
-		    memcmp(pattern, sub->pattern, pattern_len) == 0)
-			break;
-	return sub;
-}
-
 /* This is called just after a client's fd is closed */
 static void
 on_net_close(struct server *s, void *c, struct listener *l)
@@ -228,6 +262,11 @@ on_net_close(struct server *s, void *c, struct listener *l)
 				namebuf, sizeof namebuf));
 	}
 	REMOVE(client);
+	if (client->batched) {
+		*client->batch_prevp = client->batch_next;
+		if (client->batch_next)
+			client->batch_next->batch_prevp = client->batch_prevp;
+	}
 	client_free(client);
 }
 
@@ -243,31 +282,244 @@ on_net_error(struct server *s, const char *msg)
 	log_msg(LOG_WARNING, msg);
 }
 
+/* Reads a stream until a short read shows it is drained, or until
+ * READ_ROUNDS reads, so that other clients get their turn */
 static int
-on_net_ready(struct server *s, void *c, int fd)
+read_stream(struct client *client, int fd)
 {
 	/* Read network data into a buffer on the stack, and
 	 * deliver the buffer to the protocol decoder. */
-	struct client *client = c;
 	char buf[PROTO_RECVSZ + 1];
-	int len = read(fd, buf, sizeof buf - 1);
-	if (len < 0)
+	int ret = 1;
+	int k;
+
+	for (k = 0; k < READ_ROUNDS; k++) {
+		int len = read(fd, buf, sizeof buf - 1);
+		if (len < 0) {
+			/* Later reads may find nothing more */
+			if (k && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			return -1;
+		}
+		buf[len] = '\0';
+		ret = proto_recv(client->proto, buf, len);
+		if (ret <= 0 || len < (int)sizeof buf - 1)
+			break;
+	}
+	return ret;
+}
+
+#ifdef __linux__
+/* Reads many packets with each recvmmsg(), until fewer arrive than
+ * were asked for, or until READ_ROUNDS calls */
+static int
+read_packets(struct client *client, int fd)
+{
+	/* Only the pages that packets reach become resident */
+	static char bufs[READ_MAXMSG][PROTO_RECVSZ + 1];
+	struct mmsghdr msgs[READ_MAXMSG];
+	struct iovec iov[READ_MAXMSG];
+	int ret = 1;
+	int i, k, n;
+
+	for (k = 0; k < READ_ROUNDS; k++) {
+		memset(msgs, 0, sizeof msgs);
+		for (i = 0; i < READ_MAXMSG; i++) {
+			iov[i].iov_base = bufs[i];
+			iov[i].iov_len = PROTO_RECVSZ;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+		n = recvmmsg(fd, msgs, READ_MAXMSG, MSG_DONTWAIT, NULL);
+		if (n == -1) {
+			if (k && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			if (!k && errno == ENOSYS)
+				return read_stream(client, fd);
+			return -1;
+		}
+		/* An empty packet means the peer has closed */
+		for (i = 0; i < n; i++) {
+			unsigned int len = msgs[i].msg_len;
+
+			bufs[i][len] = '\0';
+			ret = proto_recv(client->proto, bufs[i], len);
+			if (ret <= 0)
+				return ret;
+		}
+		if (n < READ_MAXMSG)
+			break;
+	}
+	return ret;
+}
+#endif
+
+static int
+on_net_ready(struct server *s, void *c, int fd)
+{
+	struct client *client = c;
+
+#ifdef __linux__
+	if (client->packets)
+		return read_packets(client, fd);
+#endif
+	return read_stream(client, fd);
+}
+
+/* Sends the held data of a conflated INFO */
+static int
+emit_info(void *arg, const char *data, unsigned int datalen)
+{
+	struct client *client = arg;
+
+	return proto_output(client->proto, MSG_INFO, "%*s", datalen, data);
+}
+
+/* Tests if the client's output is queued behind a slow socket */
+static int
+client_backlogged(const struct client *client)
+{
+	return client->batched ? client->backlogged
+			       : !outq_isempty(client->outq);
+}
+
+/* Fails with ENOBUFS if the client is holding too much output */
+static int
+check_queue(struct client *client)
+{
+	if (outq_size(client->outq) > options.max_queue) {
+		errno = ENOBUFS;
 		return -1;
-	buf[len] = '\0';
-	return proto_recv(client->proto, buf, len);
+	}
+	return 0;
 }
 
 static int
 on_net_sendv(struct proto *p, const struct iovec *iovs, int niovs)
 {
-	/* Pass protocol network output straight to socket */
+	/* Pass protocol network output to the socket, queueing
+	 * what it cannot yet take. */
 	struct client *client = proto_get_udata(p);
+	ssize_t n = 0;
+	size_t len = 0;
+	int i;
+
 	if (!client)
 		return 0;
-	/* If there is no buffer space available, this will
-	 * return -1/EAGAIN and the server will drop
-	 * the connection. */
-	return writev(client->fd, iovs, niovs);
+	for (i = 0; i < niovs; i++)
+		len += iovs[i].iov_len;
+
+	/* Held INFOs were due before this output */
+	if (outq_flush_conflated(client->outq, emit_info, client) == -1)
+		return -1;
+
+	if (batching) {
+		/* Gather it, to write with the rest at batch_end() */
+		if (!client->batched) {
+			client->batched = 1;
+			client->backlogged = !outq_isempty(client->outq);
+			client->batch_next = batched_clients;
+			if (batched_clients)
+				batched_clients->batch_prevp =
+					&client->batch_next;
+			client->batch_prevp = &batched_clients;
+			batched_clients = client;
+		}
+	} else if (outq_isempty(client->outq)) {
+		n = writev(client->fd, iovs, niovs);
+		if (n == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return -1;
+			n = 0;
+		}
+		if (n == len)
+			return n;
+	}
+	/* If the queue grows too large, the caller will
+	 * drop the connection. */
+	if (outq_append(client->outq, iovs, niovs, n) == -1)
+		return -1;
+	if (client->batched && !client->backlogged &&
+	    outq_size(client->outq) >= BATCH_MAXSIZE)
+	{
+		/* Enough has been gathered to write now. What the
+		 * socket cannot take is then left for on_net_writable().
+		 * This bounds the writes, not the memory: the rest of a
+		 * SUB reply is still made in this turn, and is held
+		 * (conflated) against the client's maxqueue. */
+		int ret = outq_write(client->outq, client->fd);
+
+		if (ret == -1)
+			return -1;
+		if (ret == 1) {
+			client->backlogged = 1;
+			if (server_want_write(client->server, client->fd,
+			    1) == -1)
+				return -1;
+		}
+	}
+	if (client_backlogged(client) && check_queue(client) == -1)
+		return -1;
+	if (!client->batched &&
+	    server_want_write(client->server, client->fd, 1) == -1)
+		return -1;
+	return len;
+}
+
+/* Starts gathering all clients' output */
+static void
+batch_begin(void)
+{
+	batching = 1;
+}
+
+/* Writes each client's output gathered since batch_begin(),
+ * with as few system calls as its socket allows */
+static void
+batch_end(void)
+{
+	struct client *c;
+	int ret;
+
+	batching = 0;
+	while ((c = batched_clients)) {
+		batched_clients = c->batch_next;
+		if (batched_clients)
+			batched_clients->batch_prevp = &batched_clients;
+		c->batched = 0;
+		if (c->backlogged)
+			continue;	/* on_net_writable() will write it */
+		ret = outq_write(c->outq, c->fd);
+		if (ret == 1)
+			ret = server_want_write(c->server, c->fd, 1);
+		if (ret == -1) {
+#ifndef SMALL
+			char namebuf[PEERNAMESZ];
+			log_msgf(LOG_ERR, "[%s] dropped: %m",
+			    listener_peername(c->listener, c->fd,
+			    namebuf, sizeof namebuf));
+#endif
+			(void)shutdown_read(c->fd);
+		}
+	}
+}
+
+static int
+on_net_writable(struct server *s, void *c, int fd)
+{
+	struct client *client = c;
+	int ret;
+
+	ret = outq_write(client->outq, fd);
+	if (ret == -1)
+		return -1;
+	/* Once the queue drains, send the held INFOs */
+	if (ret == 0 && outq_flush_conflated(client->outq,
+			emit_info, client) == -1)
+		return -1;
+	if (outq_isempty(client->outq))
+		(void) server_want_write(s, fd, 0);
+	return 1;
 }
 
 /* Tests if data[] contains NUL; ie could not be a C string */
@@ -306,16 +558,16 @@ buffer_command(struct client *client, unsigned char msg,
 	if (msg == CMD_COMMIT) {
 		if (--client->begins) /* pop a nested BEGIN */
 			return 1;
-		/* playback all the buffered cmds in order */
-		while ((bcmd = client->bufcmds)) {
+		/* playback all the buffered cmds in order; the output
+		 * is gathered so that each client receives it at once */
+		ret = 1;
+		while (ret > 0 && (bcmd = client->bufcmds)) {
 			REMOVE(bcmd);
 			ret = on_app_input(p, bcmd->msg, bcmd->data,
 				bcmd->datalen);
 			bufcmd_free(bcmd);
-			if (ret <= 0)
-				return ret;
 		}
-		return 1;
+		return ret;
 	}
 	if (client->nbufcmds >= MAX_BUFCMDS)
 		return proto_output_error(p, PROTO_ERROR_TOO_BIG,
@@ -365,6 +617,158 @@ log_input_verbose(struct client *client, unsigned char msg,
 }
 #endif
 
+/* Sends an INFO to a subscribed client. While output is queued
+ * for the client, only the latest INFO for each key is held,
+ * except that ephemeral events are all sent. */
+static int
+send_info(struct client *c, struct proto_msg *m)
+{
+	if (!client_backlogged(c) || is_ephemeral(m->data, m->datalen))
+		return proto_output_msg(c->proto, m);
+	if (outq_conflate(c->outq, m->data, m->datalen) == -1)
+		return -1;
+	return check_queue(c);
+}
+
+/* Sends an INFO of key\0value data, as send_info() does */
+static int
+send_info_data(void *arg, const char *data, unsigned int datalen)
+{
+	struct client *c = arg;
+	struct proto_msg m;
+	int ret;
+
+	proto_msg_init(&m, MSG_INFO, data, datalen);
+	ret = send_info(c, &m);
+	proto_msg_fini(&m);
+	return ret;
+}
+
+/* Sets the client's timer for when its next held key is due */
+static void
+throttle_rearm(struct client *c)
+{
+	uint64_t next = throttle_next(c->throttle);
+	uint64_t now;
+
+	if (!next) {
+		server_timer_stop(&c->throttle_timer);
+		return;
+	}
+	now = server_now();
+	server_timer_start(c->server, &c->throttle_timer,
+		next > now ? next - now : 0);
+}
+
+static void
+on_throttle_timeout(struct server *s, struct server_timer *t)
+{
+	struct client *c = (struct client *)((char *)t -
+		offsetof(struct client, throttle_timer));
+
+	if (throttle_expire(c->throttle, server_now(),
+	    send_info_data, c) == -1)
+	{
+#ifndef SMALL
+		char namebuf[PEERNAMESZ];
+		log_msgf(LOG_ERR, "[%s] dropped: %m",
+		    listener_peername(c->listener, c->fd,
+		    namebuf, sizeof namebuf));
+#endif
+		(void)shutdown_read(c->fd);
+	}
+	throttle_rearm(c);
+}
+
+/* Returns the shortest interval of the client's subscriptions
+ * that match the key; 0 if one without an interval matches */
+static unsigned int
+sub_interval(const struct client *c, const char *key)
+{
+	const struct sub *sub = NULL;
+	unsigned int interval = 0;
+
+	while ((sub = subs_next(&c->subscriber, sub))) {
+		unsigned int subint = subs_get_udata(sub);
+
+		if ((!interval || subint < interval) &&
+		    subs_test(sub, key)) {
+			interval = subint;
+			if (!interval)
+				break;
+		}
+	}
+	return interval;
+}
+
+/* Notifies a subscribed client of a change, unless its subscription
+ * asks for the key to be held back */
+static int
+notify(struct client *c, struct proto_msg *m)
+{
+	unsigned int interval;
+	int ret;
+
+	if (!c->nthrottled || is_ephemeral(m->data, m->datalen))
+		return send_info(c, m);
+	interval = sub_interval(c, m->data);
+	if (!interval) {
+		/* Sent now, so any change held for the key is stale */
+		if (c->throttle)
+			throttle_forget(c->throttle, m->data, m->datalen);
+		return send_info(c, m);
+	}
+	if (!c->throttle) {
+		c->throttle = throttle_new();
+		if (!c->throttle)
+			return -1;
+		c->throttle_timer.on_timeout = on_throttle_timeout;
+	}
+	ret = throttle_check(c->throttle, m->data, m->datalen,
+		interval, server_now());
+	if (ret != 1)
+		return ret;
+	throttle_rearm(c);
+	return send_info(c, m);
+}
+
+/* Tests if a key is still held back by one of the client's
+ * subscriptions */
+static int
+still_throttled(void *arg, const char *key)
+{
+	return sub_interval(arg, key) != 0;
+}
+
+/* Sends a stored key's current value in reply to a SUB. Any change
+ * held back for the key would only repeat it, so it is dropped. */
+static int
+send_current(struct client *c, const struct info *info)
+{
+	if (c->throttle)
+		throttle_forget(c->throttle, info->keyvalue, info->sz);
+	return send_info_data(c, info->keyvalue, info->sz);
+}
+
+/* Parses a SUB interval of decimal milliseconds, at most MAX_INTERVAL */
+static int
+parse_interval(const char *s, unsigned int len, unsigned int *interval_ret)
+{
+	unsigned long interval = 0;
+
+	if (!len)
+		return -1;
+	while (len--) {
+		if (*s < '0' || *s > '9')
+			return -1;
+		interval = interval * 10 + (*s++ - '0');
+		if (interval > MAX_INTERVAL)
+			return -1;
+	}
+	*interval_ret = interval;
+	return 0;
+}
+
 /* This is called when a protocol message has been decoded
  * from the client. That is, we've received a valid
  * command message from the client. */
@@ -374,9 +778,15 @@ on_app_input(struct proto *p, unsigned char msg,
 {
 	struct client *client = proto_get_udata(p);
 	struct client *c;
-	struct subscription *sub;
+	struct sub *sub;
 	const struct info *info;
 	struct store_index ix;
+	char prefix[256];
+	size_t prefixlen;
+	struct subscriber *const *subscribers;
+	int nsubscribers, i;
+	struct proto_msg info_msg;
+	unsigned int interval;
 
 #ifndef SMALL
 	if (VERBOSE > 1)
@@ -391,37 +801,81 @@ on_app_input(struct proto *p, unsigned char msg,
 
 	switch (msg) {
 	case CMD_HELLO:
-		return proto_output(p, MSG_VERSION, "%c%s", 0, "infod3");
+		client->version = 0;
+		if (datalen)
+			client->version = (unsigned char)data[0] < PROTO_VERSION
+					? data[0] : PROTO_VERSION;
+		proto_set_version(p, client->version);
+		return proto_output(p, MSG_VERSION, "%c%s", client->version,
+			"infod3");
 	case CMD_SUB:
-		if (client->nsubs > MAX_SUBS)
+		if (client->nsubs >= options.max_subs)
 			return proto_output_error(p, PROTO_ERROR_TOO_BIG,
 				"sub: too many subscriptions");
+		interval = 0;
+		if (client->version >= 1 && contains_nul(data, datalen)) {
+			/* Version 1 allows <pattern> 0 <interval> */
+			unsigned int patlen = strlen(data);
+
+			if (parse_interval(data + patlen + 1,
+			    datalen - patlen - 1, &interval) == -1)
+				return proto_output_error(p,
+					PROTO_ERROR_BAD_ARG,
+					"sub: invalid interval");
+			datalen = patlen;
+		}
 		if (contains_nul(data, datalen) || !match_isvalid(data))
 			return proto_output_error(p, PROTO_ERROR_BAD_ARG,
 				"sub: invalid pattern");
-		sub = subscription_new(data, datalen);
+		sub = subs_add(the_subs, &client->subscriber, data);
 		if (!sub)
 			return proto_output_error(p, PROTO_ERROR_INTERNAL,
 				"sub: %s", strerror(errno));
-		INSERT(sub, &client->subs);
 		client->nsubs++;
-		for (info = store_get_first(the_store, &ix);
-		     info;
+		if (interval) {
+			subs_set_udata(sub, interval);
+			client->nthrottled++;
+		}
+		prefixlen = match_prefix(data, prefix, sizeof prefix);
+		if (match_isliteral(data) && prefixlen < sizeof prefix - 1) {
+			/* An exact key needs only a lookup */
+			info = store_get(the_store, prefix);
+			if (info && send_current(client, info) == -1)
+				return -1;
+			return 1;
+		}
+		/* Only visit the keys starting with the literal prefix.
+		 * Once the client is backlogged, the rest of a large dump
+		 * is held conflated, as changes are. */
+		for (info = store_seek(the_store, prefix, &ix);
+		     info && strncmp(info->keyvalue, prefix, prefixlen) == 0;
 		     info = store_get_next(the_store, &ix))
 		{
-			if (match(data, info->keyvalue))
-				if (proto_output(p, MSG_INFO, "%*s",
-				    info->sz, info->keyvalue) == -1)
-					return -1;
+			if (subs_test(sub, info->keyvalue) &&
+			    send_current(client, info) == -1)
+				return -1;
 		}
 		return 1;
 	case CMD_UNSUB:
-		sub = client_find_subscription(client, data, datalen);
+		if (contains_nul(data, datalen))
+			return 1;
+		sub = subs_find(&client->subscriber, data);
 		if (!sub)
 			return 1;
-		REMOVE(sub);
+		if (subs_get_udata(sub))
+			client->nthrottled--;
+		subs_remove(the_subs, sub);
 		client->nsubs--;
-		subscription_free(sub);
+		/* Drop the changes held for keys no longer held back */
+		if (client->throttle && !client->nthrottled) {
+			server_timer_stop(&client->throttle_timer);
+			throttle_free(client->throttle);
+			client->throttle = NULL;
+		} else if (client->throttle) {
+			throttle_keep_if(client->throttle, still_throttled,
+				client);
+			throttle_rearm(client);
+		}
 		return 1;
 	case CMD_READ:
 		if (contains_nul(data, datalen))
@@ -453,23 +907,27 @@ on_app_input(struct proto *p, unsigned char msg,
 					PROTO_ERROR_INTERNAL, "write: %s",
 					strerror(errno));
 		}
-		/* notify all subscribers */
-		for (c = all_clients; c; c = NEXT(c))
-			for (sub = c->subs; sub; sub = NEXT(sub))
-				if (match(sub->pattern, data))
-					if (proto_output(c->proto, MSG_INFO,
-					    "%*s", datalen, data) == -1)
-					{
+		/* notify all subscribers, once each, encoding the
+		 * INFO only once per wire mode */
+		nsubscribers = subs_match(the_subs, data, &subscribers);
+		if (nsubscribers == -1)
+			return proto_output_error(p, PROTO_ERROR_INTERNAL,
+				"notify: %s", strerror(errno));
+		proto_msg_init(&info_msg, MSG_INFO, data, datalen);
+		for (i = 0; i < nsubscribers; i++) {
+			c = subscribers[i]->udata;
+			if (notify(c, &info_msg) == -1)
+			{
 #ifndef SMALL
-						char namebuf[PEERNAMESZ];
-						log_msgf(LOG_ERR,
-						    "[%s] dropped: %m",
-						    listener_peername(
-						    c->listener, c->fd,
-						    namebuf, sizeof namebuf));
+				char namebuf[PEERNAMESZ];
+				log_msgf(LOG_ERR, "[%s] dropped: %m",
+				    listener_peername(c->listener, c->fd,
+				    namebuf, sizeof namebuf));
 #endif
-						(void)shutdown_read(c->fd);
-					}
+				(void)shutdown_read(c->fd);
+			}
+		}
+		proto_msg_fini(&info_msg);
 		return 1;
 	case CMD_PING:
 		return proto_output(p, MSG_PONG, "%*s", datalen, data);
@@ -501,7 +959,7 @@ on_net_accept(struct server *s, int fd, struct listener *l)
 		log_msgf(LOG_INFO, "[%s] connected",
 			listener_peername(l, fd, namebuf, sizeof namebuf));
 
-	client = client_new(fd);
+	client = client_new(fd, l == &unix_listener);
 	if (!client) { /* failed to allocate */
 		const char *estr = strerror(errno);
 		log_msgf(LOG_WARNING, "[%s] client_new(): %s",
@@ -512,11 +970,21 @@ on_net_accept(struct server *s, int fd, struct listener *l)
 	}
 
 	INSERT(client, &all_clients);
+	client->server = s;
 #ifndef SMALL
 	client->listener = l;
 #endif
 	if (l == &unix_listener)
 		proto_set_mode(client->proto, PROTO_MODE_FRAMED);
+#ifndef SMALL
+	/* Output is written in batches, which Nagle would only delay */
+	if (l == &tcp_listener) {
+		int one = 1;
+
+		(void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+			&one, sizeof one);
+	}
+#endif
 
 	proto_set_on_error(client->proto, on_proto_error);
 	proto_set_on_sendv(client->proto, on_net_sendv);
@@ -537,7 +1005,7 @@ basename(const char *name)
 static void
 add_unix_listener(struct server *server)
 {
-	int fd = sockunix_listen();
+	int fd = sockunix_listen(options.backlog);
 
 	if (server_add_listener(server, fd, &unix_listener) == -1) {
 		log_perror("unix listener");
@@ -560,7 +1028,6 @@ add_stdin_listener(struct server *server)
 static void
 add_tcp_listeners(struct server *server)
 {
-	static struct listener tcp_listener = { "tcp", tcp_peername };
 	struct addrinfo *ais = NULL;
 	struct addrinfo *ai;
 	int count = 0;
@@ -599,7 +1066,7 @@ add_tcp_listeners(struct server *server)
 			close(fd);
 			continue;
 		}
-		if (listen(fd, 5) == -1) {
+		if (listen(fd, options.backlog) == -1) {
 			log_msgf(LOG_ERR, "listen: %s", strerror(errno));
 			close(fd);
 			continue;
@@ -617,6 +1084,83 @@ add_tcp_listeners(struct server *server)
 }
 #endif /* !SMALL */
 
+/* Raises the soft limit on open fds to fit the sockets wanted,
+ * or lowers options.max_sockets to fit the hard limit. This keeps
+ * accept() from failing with EMFILE while the listeners are ready. */
+static void
+fit_fd_limit(void)
+{
+	struct rlimit rl;
+	rlim_t want = (rlim_t)options.max_sockets + FD_RESERVE;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) == -1) {
+		log_perror("getrlimit");
+		return;
+	}
+	if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur >= want)
+		return;
+	if (rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= want) {
+		struct rlimit raised = rl;
+
+		raised.rlim_cur = want;
+		if (setrlimit(RLIMIT_NOFILE, &raised) == 0)
+			return;
+		log_perror("setrlimit");
+	} else if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+			log_perror("setrlimit");
+			(void) getrlimit(RLIMIT_NOFILE, &rl);
+		}
+	}
+	options.max_sockets = rl.rlim_cur > FD_RESERVE + 1 ?
+		rl.rlim_cur - FD_RESERVE : 1;
+	log_msgf(LOG_WARNING, "fd limit allows only %u sockets",
+		options.max_sockets);
+}
+
+/* Polls once, gathering the output of the whole turn so that
+ * each client's share of it is written together at the end */
+static int
+poll_batched(struct server *server)
+{
+	int ret;
+
+	batch_begin();
+	ret = server_poll(server, -1);
+	batch_end();
+	return ret;
+}
+
+/* Saves the store's index now and then, so that a restart after
+ * a crash seldom has to rebuild it */
+static void
+on_checkpoint_timeout(struct server *s, struct server_timer *t)
+{
+	if (store_checkpoint(the_store) == -1)
+		log_perror("store_checkpoint");
+	server_timer_start(s, t, options.checkpoint * 1000);
+}
+
+/* Parses an option's unsigned decimal number, no greater than max.
+ * Unlike strtoul() alone, refuses a sign, space or trailing junk.
+ * Returns -1 if the text is not such a number. */
+static int
+parse_ulong(const char *s, unsigned long max, unsigned long *ret)
+{
+	unsigned long n;
+	char *end;
+
+	if (*s < '0' || *s > '9')
+		return -1;
+	errno = 0;
+	n = strtoul(s, &end, 10);
+	if (errno || *end || n > max)
+		return -1;
+	*ret = n;
+	return 0;
+}
+
 static int terminated;	/* True when a SIGTERM was received */
 static void
 on_sigterm(int sig)
@@ -629,11 +1173,19 @@ main(int argc, char *argv[])
 {
 	struct server_context server_context;
 	struct server *server;
+	struct server_timer checkpoint_timer;
 	int ret;
 	int error = 0;
 	int ch;
+	unsigned long n;
 	static const char *option_flags =
+		"b:"
+		"c"
 		"f:"
+		"k:"
+		"m:"
+		"n:"
+		"q:"
 		"s"
 #ifndef SMALL
 		"p:"
@@ -642,12 +1194,56 @@ main(int argc, char *argv[])
 #endif /* !SMALL */
 		;
 	options.store_path = STORE_PATH;
+	options.max_subs = MAX_SUBS;
+	options.max_queue = MAX_QUEUE;
+	options.max_sockets = MAX_SOCKETS;
+	options.backlog = BACKLOG;
+	options.checkpoint = CHECKPOINT;
 
 	while ((ch = getopt(argc, argv, option_flags)) != -1)
 		switch (ch) {
+		case 'b':
+			if (sscanf(optarg, "%d", &options.backlog) != 1 ||
+			    options.backlog <= 0)
+			{
+				fprintf(stderr, "invalid backlog\n");
+				error = 2;
+			}
+			break;
+		case 'c':
+			options.checksums = 1;
+			break;
 		case 'f':
 			options.store_path = optarg;
 			break;
+		case 'k':
+			if (parse_ulong(optarg, MAX_CHECKPOINT, &n) == -1) {
+				fprintf(stderr, "invalid checkpoint\n");
+				error = 2;
+			} else
+				options.checkpoint = n;
+			break;
+		case 'm':
+			if (parse_ulong(optarg, UINT_MAX, &n) == -1) {
+				fprintf(stderr, "invalid maxsubs\n");
+				error = 2;
+			} else
+				options.max_subs = n;
+			break;
+		case 'n':
+			if (parse_ulong(optarg, INT_MAX, &n) == -1 || !n) {
+				fprintf(stderr, "invalid maxsockets\n");
+				error = 2;
+			} else
+				options.max_sockets = n;
+			break;
+		case 'q':
+			if (parse_ulong(optarg, SSIZE_MAX, &n) == -1) {
+				fprintf(stderr, "invalid maxqueue\n");
+				error = 2;
+			} else
+				options.max_queue = n;
+			break;
 		case 's':
 			options.syslog = 1;
 			break;
@@ -673,11 +1269,13 @@ main(int argc, char *argv[])
 		if (error == 2) {
 			fprintf(stderr, "usage: %s"
 #ifdef SMALL
-						" [-s]"
+						" [-cs]"
 #else /* !SMALL */
-						" [-siv] [-p port]"
+						" [-csiv] [-p port]"
 #endif /* !SMALL */
-						" [-f db]"
+						" [-b backlog] [-f db] [-k secs]"
+						" [-m maxsubs] [-n maxsockets]"
+						" [-q maxqueue]"
 				"\n",
 				argv[0]);
 		}
@@ -687,17 +1285,25 @@ main(int argc, char *argv[])
 	if (options.syslog)
 		openlog(basename(argv[0]), LOG_CONS | LOG_PERROR, LOG_DAEMON);
 
-	the_store = store_open(options.store_path);
+	the_store = store_open_flags(options.store_path,
+		options.checksums ? STORE_CRC | STORE_LAZY : 0);
 	if (!the_store) {
 		log_msgf(LOG_ERR, "store_open: %s: %s", options.store_path,
 			strerror(errno));
 		exit(1);
 	}
+	the_subs = subs_new();
+	if (!the_subs) {
+		log_perror("subs_new");
+		exit(1);
+	}
 
+	fit_fd_limit();
 	memset(&server_context, 0, sizeof server_context);
-	server_context.max_sockets = 64;
+	server_context.max_sockets = options.max_sockets;
 	server_context.on_accept = on_net_accept;
 	server_context.on_ready = on_net_ready;
+	server_context.on_writable = on_net_writable;
 	server_context.on_close = on_net_close;
 	server_context.on_error = on_net_error;
 
@@ -714,6 +1320,12 @@ main(int argc, char *argv[])
 #endif /* !SMALL */
 	add_unix_listener(server);
 
+	memset(&checkpoint_timer, 0, sizeof checkpoint_timer);
+	checkpoint_timer.on_timeout = on_checkpoint_timeout;
+	if (options.checkpoint)
+		server_timer_start(server, &checkpoint_timer,
+			options.checkpoint * 1000);
+
 	/* handle clean termination signals */
 	if (signal(SIGTERM, on_sigterm) == SIG_ERR) {
 		log_perror("signal SIGTERM");
@@ -723,9 +1335,14 @@ main(int argc, char *argv[])
 		log_perror("signal SIGINT");
 		exit(1);
 	}
+	/* a peer's close is seen as EPIPE from write */
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		log_perror("signal SIGPIPE");
+		exit(1);
+	}
 
 	/* main loop */
-	while ((ret = server_poll(server, -1)) > 0) {
+	while ((ret = poll_batched(server)) > 0) {
 		if (ret == -1) {
 			if (!(errno == EINTR && terminated))
 				log_perror("poll");
@@ -738,7 +1355,22 @@ main(int argc, char *argv[])
 
 	if (!terminated || VERBOSE)
 		log_msg(LOG_ERR, "terminating");
+	if (VERBOSE) {
+		struct store_stats stats;
+
+		store_get_stats(the_store, &stats);
+		log_msgf(LOG_INFO, "store: %u keys, %" PRIu32 "/%" PRIu32
+			"/%" PRIu32 " bytes live/used/file, %lu compactions,"
+			" %lu repacks, %lu grows, max pause %" PRIu64 " us,"
+			" %lu corrupt",
+			stats.keys, stats.live, stats.used, stats.filesz,
+			stats.compactions, stats.repacks, stats.grows,
+			stats.max_pause_ns / 1000, stats.corrupt);
+	}
 	server_free(server);
+	subs_free(the_subs);
+	if (terminated && store_checkpoint(the_store) == -1)
+		log_perror("store_checkpoint");
 	store_close(the_store);
 	exit(terminated);
 }
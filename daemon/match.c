@@ -1,7 +1,9 @@
 #include <stdlib.h>
+#include <string.h>
 #include "match.h"
 
 #define MAX_PAREN 4
+#define LIT_INLINE 16	/* shorter literals are compared bytewise */
 
 char CHECK[] = "";
 
@@ -61,12 +63,13 @@ do_match(const char *pattern, const char *string)
 			} else if (n == '?') {
 				/* pattern *? is equivalent to ? */
 			} else {
+				const char *c = pattern;
 				if (n == '\\') {	/* '*\n' */
-					if (!(n = pattern[1]))
+					if (!(n = *++c))
 						return -1; /* \ at end */
 				}
 				if (string != CHECK)
-				    while (*string && !utf8eq(string, pattern))
+				    while (*string && !utf8eq(string, c))
 					utf8inc(&string); /* greedy forward */
 			}
 		} else if (p == '(') {
@@ -148,3 +151,315 @@ match_isvalid(const char *pattern)
 {
 	return do_match(pattern, CHECK) == 1;
 }
+
+size_t
+match_prefix(const char *pattern, char *buf, size_t bufsz)
+{
+	size_t len = 0;
+	char p;
+
+	if (!bufsz)
+		return 0;
+	while (len < bufsz - 1 && (p = *pattern++)) {
+		if (p == '*' || p == '?' || p == '(' || p == '|' || p == ')')
+			break;
+		if (p == '\\' && !(p = *pattern++))
+			break;
+		buf[len++] = p;
+	}
+	buf[len] = '\0';
+	return len;
+}
+
+int
+match_isliteral(const char *pattern)
+{
+	char p;
+
+	while ((p = *pattern++)) {
+		if (p == '*' || p == '?' || p == '(' || p == '|' || p == ')')
+			return 0;
+		if (p == '\\' && !*pattern++)
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Compiled patterns
+ *
+ * A program is a sequence of byte-coded instructions, ending with
+ * OP_END. Jump targets are 4-byte big-endian program offsets.
+ *
+ *   OP_LIT n c1..cn     match n literal bytes
+ *   OP_ANY              match any one character (?)
+ *   OP_SKIPTO n c1..cn  advance to the next UTF-8 character c (*c)
+ *   OP_REST             match the rest of the string (* at the end)
+ *   OP_OPEN next        start a group; next is the first | or )
+ *   OP_ALT next close   an alternative succeeded, so go to close;
+ *                       or it failed, so try the one up to next
+ *   OP_CLOSE            end a group
+ *   OP_END              succeed if the string is exhausted
+ *
+ * Matching a group takes its first alternative that succeeds,
+ * with no backtracking, just as match() does.
+ */
+#define OP_END		0
+#define OP_LIT		1
+#define OP_ANY		2
+#define OP_SKIPTO	3
+#define OP_REST		4
+#define OP_OPEN		5
+#define OP_ALT		6
+#define OP_CLOSE	7
+
+#define ADDRSZ		4	/* size of a jump target */
+
+/* A program under construction. Only the first progsz bytes are
+ * stored, but len counts them all. */
+struct prog {
+	char *buf;
+	size_t progsz;
+	size_t len;
+};
+
+static void
+emit(struct prog *prog, unsigned char byte)
+{
+	if (prog->len < prog->progsz)
+		prog->buf[prog->len] = byte;
+	prog->len++;
+}
+
+static void
+put_addr(struct prog *prog, size_t at, size_t addr)
+{
+	unsigned int i;
+
+	for (i = 0; i < ADDRSZ; i++)
+		if (at + i < prog->progsz)
+			prog->buf[at + i] = addr >> (8 * (ADDRSZ - 1 - i));
+}
+
+static size_t
+get_addr(const char *p)
+{
+	const unsigned char *u = (const unsigned char *)p;
+
+	return (size_t)u[0] << 24 | u[1] << 16 | u[2] << 8 | u[3];
+}
+
+/* Emits a jump target to be filled in later, returning its offset */
+static size_t
+emit_addr(struct prog *prog)
+{
+	size_t at = prog->len;
+	unsigned int i;
+
+	for (i = 0; i < ADDRSZ; i++)
+		emit(prog, 0);
+	return at;
+}
+
+size_t
+match_compile(const char *pattern, char *buf, size_t progsz)
+{
+	struct prog prog;
+	struct {
+		size_t next;	/* target to patch at the next | or ) */
+		size_t closes;	/* OP_ALT close targets to patch at ) */
+		int nalts;
+	} groups[MAX_PAREN], *group = groups - 1;
+	size_t lit = 0;		/* offset of current OP_LIT's length */
+	unsigned int i, len;
+	char p;
+
+	if (!match_isvalid(pattern))
+		return 0;
+	prog.buf = buf;
+	prog.progsz = progsz;
+	prog.len = 0;
+
+	while ((p = *pattern++)) {
+		if (p == '*') {
+			char n = *pattern;
+			const char *c = pattern;
+
+			lit = 0;
+			if (!n || n == '|' || n == ')') {
+				emit(&prog, OP_REST);
+				continue;
+			}
+			if (n == '?')
+				continue;	/* *? is the same as ? */
+			if (n == '\\')
+				c++;
+			/* Copy the whole UTF-8 character at c */
+			len = 1;
+			if ((*c & 0xc0) == 0xc0)
+				while ((c[len] & 0xc0) == 0x80)
+					len++;
+			emit(&prog, OP_SKIPTO);
+			emit(&prog, len);
+			for (i = 0; i < len; i++)
+				emit(&prog, c[i]);
+		} else if (p == '(') {
+			lit = 0;
+			group++;
+			emit(&prog, OP_OPEN);
+			group->next = emit_addr(&prog);
+			group->closes = 0;
+			group->nalts = 0;
+		} else if (p == '|' || p == ')') {
+			size_t here = prog.len;
+
+			lit = 0;
+			put_addr(&prog, group->next, here);
+			if (p == '|') {
+				emit(&prog, OP_ALT);
+				group->next = emit_addr(&prog);
+				/* Chain the close targets through themselves */
+				put_addr(&prog, emit_addr(&prog),
+					group->nalts ? group->closes : 0);
+				group->closes = prog.len - ADDRSZ;
+				group->nalts++;
+			} else {
+				emit(&prog, OP_CLOSE);
+				while (group->nalts--) {
+					size_t at = group->closes;
+					group->closes = at + ADDRSZ <= prog.progsz
+						? get_addr(prog.buf + at) : 0;
+					put_addr(&prog, at, here);
+				}
+				group--;
+			}
+		} else if (p == '?') {
+			lit = 0;
+			emit(&prog, OP_ANY);
+		} else {
+			if (p == '\\')
+				p = *pattern++;
+			if (!lit || prog.len - lit > 255) {
+				emit(&prog, OP_LIT);
+				lit = prog.len;
+				emit(&prog, 0);
+			}
+			emit(&prog, p);
+			if (lit < prog.progsz)
+				prog.buf[lit] = prog.len - lit - 1;
+		}
+	}
+	emit(&prog, OP_END);
+	return prog.len;
+}
+
+/*
+ * Finds the first UTF-8 character c in a string at or after s,
+ * the way that *c advances, or returns NULL.
+ * Characters never start with a continuation byte, so a search for
+ * c's first byte can use strchr(), which C libraries vectorise.
+ */
+static const char *
+utf8find(const char *s, const char *c)
+{
+	if ((*c & 0xc0) == 0x80) {
+		/* A stray continuation byte; only match at char starts */
+		while (*s && !utf8eq(s, c))
+			utf8inc(&s);
+		return *s ? s : NULL;
+	}
+	while ((s = strchr(s, *c))) {
+		if (utf8eq(s, c))
+			return s;
+		utf8inc(&s);
+	}
+	return NULL;
+}
+
+int
+match_prog(const char *prog, const char *string)
+{
+	struct {
+		const char *start;	/* string position at ( */
+		size_t next;		/* the current alternative's end */
+	} groups[MAX_PAREN], *group = groups - 1;
+	const char *pc = prog;
+	const char *end = NULL;	/* the string's end, once found */
+	const char *found;
+	unsigned int len;
+
+	for (;;) {
+		switch (*pc) {
+		case OP_END:
+			return *string == '\0';
+		case OP_LIT:
+			len = (unsigned char)pc[1];
+			if (len < LIT_INLINE) {
+				/* (A literal never matches the string's NUL) */
+				for (pc += 2; len--; string++, pc++)
+					if (*string != *pc)
+						goto fail;
+				break;
+			}
+			/* Long runs are compared with memcmp(), once the
+			 * string is known to be long enough */
+			if (*string != pc[2])
+				goto fail;
+			if (!end)
+				end = string + strlen(string);
+			if ((size_t)(end - string) < len ||
+			    memcmp(string, pc + 2, len) != 0)
+				goto fail;
+			string += len;
+			pc += 2 + len;
+			break;
+		case OP_ANY:
+			if (!*string)
+				goto fail;
+			utf8inc(&string);
+			pc++;
+			break;
+		case OP_SKIPTO:
+			found = utf8find(string, pc + 2);
+			if (found)
+				string = found;
+			else
+				string = end ? end : string + strlen(string);
+			pc += 2 + (unsigned char)pc[1];
+			break;
+		case OP_REST:
+			string = end ? end : string + strlen(string);
+			pc++;
+			break;
+		case OP_OPEN:
+			group++;
+			group->start = string;
+			group->next = get_addr(pc + 1);
+			pc += 1 + ADDRSZ;
+			break;
+		case OP_ALT:
+			/* The alternative matched; skip the rest */
+			pc = prog + get_addr(pc + 1 + ADDRSZ);
+			/* FALLTHROUGH */
+		case OP_CLOSE:
+			group--;
+			pc++;
+			break;
+		}
+		continue;
+	fail:
+		/* Try the group's next alternative, if it has one */
+		for (;;) {
+			if (group < groups)
+				return 0;
+			pc = prog + group->next;
+			string = group->start;
+			if (*pc == OP_ALT) {
+				group->next = get_addr(pc + 1);
+				pc += 1 + 2 * ADDRSZ;
+				break;
+			}
+			group--;	/* no alternative matched */
+		}
+	}
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <stddef.h>
 
 /*
  * A string matcher using simplified glob-like patterns.
@@ -15,3 +16,33 @@ int match(const char *pattern, const char *string);
  * Returns 0 if the pattern is invalid, and would match nothing.
  */
 int match_isvalid(const char *pattern);
+
+/*
+ * Copies the literal prefix of a valid pattern into buf as a
+ * NUL-terminated string. Every string the pattern matches starts
+ * with this prefix. The prefix ends at the pattern's first
+ * metacharacter, or is cut short to fit in bufsz bytes.
+ * Returns the length of the prefix copied.
+ */
+size_t match_prefix(const char *pattern, char *buf, size_t bufsz);
+
+/*
+ * Tests if a valid pattern has no metacharacters, and so matches
+ * only its own literal prefix.
+ */
+int match_isliteral(const char *pattern);
+
+/*
+ * Compiles a pattern into a program for match_prog(), so that it
+ * need not be parsed again on every match. At most progsz bytes of
+ * the program are stored into prog; pass 0 to learn the size needed.
+ * Returns the size of the whole program.
+ * Returns 0 if the pattern is invalid.
+ */
+size_t match_compile(const char *pattern, char *prog, size_t progsz);
+
+/*
+ * Matches a string against a compiled pattern, with the same
+ * result as match() would give for the pattern.
+ */
+int match_prog(const char *prog, const char *string);
@@ -0,0 +1,374 @@
+#define _GNU_SOURCE	/* sendmmsg() */
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "outq.h"
+
+#define CHUNK_MINSIZE	4096	/* a stream's chunks are at least this big */
+#define CHUNK_MAXGROW	65536	/* later chunks double, up to this big */
+#define PENDING_MINSIZE	16	/* pending table's minimum size */
+#define WRITE_MAXIOV	16	/* chunks passed to one writev() */
+#define WRITE_MAXMSG	64	/* packets passed to one sendmmsg() */
+
+/* A run of queued bytes */
+struct chunk {
+	struct chunk *next;
+	size_t len;			/* bytes in data[] */
+	size_t off;			/* bytes already written */
+	size_t max;			/* allocated size of data[] */
+	char data[];
+};
+
+/* The latest data of a conflated notification */
+struct pending {
+	struct pending *next;		/* in arrival order */
+	struct pending *hnext;		/* next in the same bucket */
+	uint32_t hash;			/* hash of key */
+	unsigned int keylen;
+	unsigned int datalen;
+	char *data;			/* key, then the rest */
+};
+
+struct outq {
+	int packets;			/* keep each message whole */
+	int flushing;			/* in outq_flush_conflated() */
+	size_t size;			/* bytes held */
+
+	struct chunk *head, *tail;
+
+	struct pending *pending, **pending_tail;
+	struct pending **table;		/* pending, by key */
+	unsigned int tablesize;		/* a power of 2 */
+	unsigned int npending;
+};
+
+/* FNV-1a hash of a key */
+static uint32_t
+key_hash(const char *key, unsigned int len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*key++) * 16777619u;
+	return h;
+}
+
+struct outq *
+outq_new(int packets)
+{
+	struct outq *q = calloc(1, sizeof *q);
+
+	if (q) {
+		q->packets = packets;
+		q->pending_tail = &q->pending;
+	}
+	return q;
+}
+
+static void
+pending_free(struct pending *pd)
+{
+	free(pd->data);
+	free(pd);
+}
+
+void
+outq_free(struct outq *q)
+{
+	struct chunk *ch;
+	struct pending *pd;
+
+	if (!q)
+		return;
+	while ((ch = q->head)) {
+		q->head = ch->next;
+		free(ch);
+	}
+	while ((pd = q->pending)) {
+		q->pending = pd->next;
+		pending_free(pd);
+	}
+	free(q->table);
+	free(q);
+}
+
+int
+outq_isempty(const struct outq *q)
+{
+	return !q->head;
+}
+
+size_t
+outq_size(const struct outq *q)
+{
+	return q->size;
+}
+
+int
+outq_append(struct outq *q, const struct iovec *iov, int niov,
+	size_t skip)
+{
+	struct chunk *ch = q->tail;
+	size_t len = 0;
+	int i;
+
+	for (i = 0; i < niov; i++)
+		len += iov[i].iov_len;
+	if (skip >= len)
+		return 0;
+	len -= skip;
+
+	/* A stream may add to the last chunk, if it has room */
+	if (q->packets || !ch || ch->max - ch->len < len) {
+		size_t max = len;
+
+		if (!q->packets && max < CHUNK_MINSIZE)
+			max = CHUNK_MINSIZE;
+		/* A long queue is written with fewer, larger iovecs */
+		if (!q->packets && ch && max < ch->max * 2 &&
+		    max < CHUNK_MAXGROW)
+		{
+			max = ch->max * 2;
+			if (max > CHUNK_MAXGROW)
+				max = CHUNK_MAXGROW;
+		}
+		ch = malloc(sizeof *ch + max);
+		if (!ch)
+			return -1;
+		ch->next = NULL;
+		ch->len = ch->off = 0;
+		ch->max = max;
+		if (q->tail)
+			q->tail->next = ch;
+		else
+			q->head = ch;
+		q->tail = ch;
+	}
+
+	for (i = 0; i < niov; i++) {
+		const char *base = iov[i].iov_base;
+		size_t n = iov[i].iov_len;
+
+		if (skip >= n) {
+			skip -= n;
+			continue;
+		}
+		memcpy(ch->data + ch->len, base + skip, n - skip);
+		ch->len += n - skip;
+		skip = 0;
+	}
+	q->size += len;
+	return 0;
+}
+
+/* Ensures the pending table has room for one more */
+static int
+table_ensure(struct outq *q)
+{
+	struct pending **table;
+	struct pending *pd;
+	unsigned int size;
+
+	if (q->npending < q->tablesize)
+		return 0;
+	size = q->tablesize ? q->tablesize * 2 : PENDING_MINSIZE;
+	table = calloc(size, sizeof *table);
+	if (!table)
+		return -1;
+	for (pd = q->pending; pd; pd = pd->next) {
+		struct pending **bucket = &table[pd->hash & (size - 1)];
+
+		pd->hnext = *bucket;
+		*bucket = pd;
+	}
+	free(q->table);
+	q->table = table;
+	q->tablesize = size;
+	return 0;
+}
+
+int
+outq_conflate(struct outq *q, const char *data, unsigned int datalen)
+{
+	const char *nul = memchr(data, '\0', datalen);
+	unsigned int keylen = nul ? nul - data : datalen;
+	uint32_t hash = key_hash(data, keylen);
+	struct pending *pd = NULL;
+	char *copy;
+
+	if (q->npending)
+		for (pd = q->table[hash & (q->tablesize - 1)]; pd;
+		     pd = pd->hnext)
+			if (pd->hash == hash && pd->keylen == keylen &&
+			    memcmp(pd->data, data, keylen) == 0)
+				break;
+
+	copy = malloc(datalen ? datalen : 1);
+	if (!copy)
+		return -1;
+	memcpy(copy, data, datalen);
+
+	if (pd) {
+		/* Replace the older data */
+		q->size -= pd->datalen;
+		free(pd->data);
+	} else {
+		struct pending **bucket;
+
+		pd = malloc(sizeof *pd);
+		if (!pd || table_ensure(q) == -1) {
+			free(pd);
+			free(copy);
+			return -1;
+		}
+		pd->hash = hash;
+		pd->keylen = keylen;
+		pd->next = NULL;
+		*q->pending_tail = pd;
+		q->pending_tail = &pd->next;
+		bucket = &q->table[hash & (q->tablesize - 1)];
+		pd->hnext = *bucket;
+		*bucket = pd;
+		q->npending++;
+	}
+	pd->data = copy;
+	pd->datalen = datalen;
+	q->size += datalen;
+	return 0;
+}
+
+int
+outq_flush_conflated(struct outq *q,
+	int (*emit)(void *arg, const char *data, unsigned int datalen),
+	void *arg)
+{
+	struct pending *pd;
+	int ret = 0;
+
+	if (q->flushing)
+		return 0;
+	q->flushing = 1;
+	while (ret != -1 && (pd = q->pending)) {
+		struct pending **pp = &q->table[pd->hash & (q->tablesize - 1)];
+
+		/* Remove it before emitting it */
+		while (*pp != pd)
+			pp = &(*pp)->hnext;
+		*pp = pd->hnext;
+		q->pending = pd->next;
+		if (!q->pending)
+			q->pending_tail = &q->pending;
+		q->npending--;
+		q->size -= pd->datalen;
+
+		ret = emit(arg, pd->data, pd->datalen);
+		pending_free(pd);
+	}
+	q->flushing = 0;
+	return ret == -1 ? -1 : 0;
+}
+
+/* Frees the chunks at the head that have been completely written */
+static void
+drop_written(struct outq *q)
+{
+	struct chunk *ch;
+
+	while ((ch = q->head) && ch->off == ch->len) {
+		q->head = ch->next;
+		if (!q->head)
+			q->tail = NULL;
+		free(ch);
+	}
+}
+
+#ifdef __linux__
+/* Writes queued packets, many to each sendmmsg() */
+static int
+write_packets(struct outq *q, int fd)
+{
+	while (q->head) {
+		struct mmsghdr msgs[WRITE_MAXMSG];
+		struct iovec iov[WRITE_MAXMSG];
+		struct chunk *ch;
+		int n, nmsg = 0;
+
+		memset(msgs, 0, sizeof msgs);
+		for (ch = q->head; ch && nmsg < WRITE_MAXMSG;
+		     ch = ch->next, nmsg++)
+		{
+			iov[nmsg].iov_base = ch->data;
+			iov[nmsg].iov_len = ch->len;
+			msgs[nmsg].msg_hdr.msg_iov = &iov[nmsg];
+			msgs[nmsg].msg_hdr.msg_iovlen = 1;
+		}
+		n = sendmmsg(fd, msgs, nmsg, 0);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			if (errno != ENOSYS)
+				return -1;
+			break;	/* fall back to writev() */
+		}
+		/* Packets are sent whole or not at all */
+		while (n--) {
+			ch = q->head;
+			q->size -= ch->len;
+			ch->off = ch->len;
+			drop_written(q);
+		}
+	}
+	return 0;
+}
+#endif
+
+int
+outq_write(struct outq *q, int fd)
+{
+#ifdef __linux__
+	if (q->packets) {
+		int ret = write_packets(q, fd);
+
+		if (ret != 0 || !q->head)
+			return ret;
+	}
+#endif
+	while (q->head) {
+		struct iovec iov[WRITE_MAXIOV];
+		struct chunk *ch;
+		ssize_t n;
+		int niov = 0;
+
+		/* Each packet needs its own write; a stream can
+		 * gather several chunks into one */
+		for (ch = q->head; ch && niov < (q->packets ? 1 : WRITE_MAXIOV);
+		     ch = ch->next, niov++)
+		{
+			iov[niov].iov_base = ch->data + ch->off;
+			iov[niov].iov_len = ch->len - ch->off;
+		}
+		n = writev(fd, iov, niov);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return 1;
+			return -1;
+		}
+		q->size -= n;
+		for (ch = q->head; n; ch = ch->next) {
+			size_t take = ch->len - ch->off;
+
+			if (take > (size_t)n)
+				take = n;
+			ch->off += take;
+			n -= take;
+		}
+		drop_written(q);
+	}
+	return 0;
+}
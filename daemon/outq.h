@@ -0,0 +1,61 @@
+#pragma once
+#include <stddef.h>
+
+/*
+ * A client's queue of output that the socket could not yet take,
+ * or that is being gathered to be written together.
+ *
+ * Bytes are queued in order, to be written when the socket is next
+ * writable. On a packet socket, each appended message is kept whole
+ * as one packet; on Linux, many packets are sent by each sendmmsg().
+ *
+ * Notifications of changed keys that arrive while output is queued
+ * are instead conflated: only the latest data for each key is kept,
+ * so the memory they use is bounded by the number of distinct keys
+ * pending rather than by the rate of change. They are sent, in the
+ * order their keys first arrived, after the bytes queued ahead of
+ * them.
+ */
+
+struct iovec;
+struct outq;
+
+/* Returns NULL on allocation failure */
+struct outq *outq_new(int packets);
+void outq_free(struct outq *q);
+
+/* Tests if no bytes are queued. (Notifications are only ever
+ * pending behind queued bytes.) */
+int outq_isempty(const struct outq *q);
+/* Returns the number of bytes held, queued or pending */
+size_t outq_size(const struct outq *q);
+
+/*
+ * Queues a message, less the first skip bytes already written.
+ * Returns -1 on allocation failure.
+ */
+int outq_append(struct outq *q, const struct iovec *iov, int niov,
+	size_t skip);
+
+/*
+ * Holds a notification's data, replacing any pending data for the
+ * same key. The key is the data up to its first NUL, if any.
+ * Returns -1 on allocation failure.
+ */
+int outq_conflate(struct outq *q, const char *data, unsigned int datalen);
+
+/*
+ * Passes each pending notification's data to emit(), in order,
+ * removing it first. Nested calls from within emit() do nothing.
+ * Returns -1 if emit() returns -1.
+ */
+int outq_flush_conflated(struct outq *q,
+	int (*emit)(void *arg, const char *data, unsigned int datalen),
+	void *arg);
+
+/*
+ * Writes as many queued bytes as the fd will take.
+ * Returns 0 when no bytes remain queued, 1 when some do.
+ * Returns -1 on a write error.
+ */
+int outq_write(struct outq *q, int fd);
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE	/* accept4() */
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -10,23 +11,45 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <time.h>
 
 #include "server.h"
 
+#ifdef SERVER_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #define TCP_PORT	26990			/* 'in' */
 #define PATH_SOCKET	"/tmp/infod3.socket"
 #define INCREMENT	16
-
+#define READY_MAX	64			/* events from one epoll_wait() */
+#define ACCEPT_MAX	64			/* accepts per listener per poll */
+
+/*
+ * Each socket has a slot in socket[] and pollfd[], which it keeps
+ * until it is closed. Closed slots are kept on a free list, with
+ * pollfd[].fd set to -1, and are reused by new sockets first.
+ */
 struct server {
 	const struct server_context *context;
 	unsigned int n;				/* active connections */
+	unsigned int nslots;			/* slots ever used */
 	unsigned int nmax;			/* sz of socket[], pollfd[] */
 	struct server_socket {
 		void *data;			/* NULL when listener */
 		struct listener *listener;
 		int is_listener;
+		int next;			/* next free or listener slot */
 	} *socket;
 	struct pollfd *pollfd;			/* parallel to socket[] */
+	int free;				/* first free slot, or -1 */
+	int listeners;				/* first listener slot, or -1 */
+	unsigned int *index;			/* slot, by fd */
+	unsigned int nindex;			/* sz of index[] */
+	struct server_timer *timers;		/* started, soonest first */
+#ifdef SERVER_EPOLL
+	int epfd;
+#endif
 };
 
 /* Log an error. Returns -1. */
@@ -49,6 +72,15 @@ on_error(struct server *server, const char *fmt, ...)
 	return -1;
 }
 
+uint64_t
+server_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000) + ts.tv_nsec / 1000000;
+}
+
 static int
 is_listener(const struct server *server, int i)
 {
@@ -68,94 +100,178 @@ listener_peername(struct listener *listener, int fd, char *buf, size_t sz)
 	return listener->peername(fd, buf, sz);
 }
 
+/* Returns the slot of the socket with the fd, or -1 */
+static int
+find_socket(const struct server *server, int fd)
+{
+	/* The index[] entry of a closed fd may be stale */
+	if (fd >= 0 && (unsigned int)fd < server->nindex) {
+		unsigned int i = server->index[fd];
+
+		if (i < server->nslots && server->pollfd[i].fd == fd)
+			return i;
+	}
+	return -1;
+}
+
+/* Changes the events polled for on slot i */
+static void
+set_events(struct server *server, unsigned int i, short events)
+{
+	struct pollfd *pollfd = &server->pollfd[i];
+
+	if (pollfd->events == events)
+		return;
+	pollfd->events = events;
+#ifdef SERVER_EPOLL
+	{
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof ev);
+		ev.events = (events & POLLIN ? EPOLLIN : 0) |
+			    (events & POLLOUT ? EPOLLOUT : 0);
+		ev.data.u32 = i;
+		if (epoll_ctl(server->epfd, EPOLL_CTL_MOD, pollfd->fd,
+		    &ev) == -1)
+			on_error(server, "epoll_ctl %d: %s", pollfd->fd,
+				strerror(errno));
+	}
+#endif
+}
+
 /* Enable/disable all listening sockets.
  * This is used when we have MAX_SOCKETS open and want
  * to hold off accepting any new connections. */
 static void
 server_listen_enable(struct server *server, int enable)
 {
-	unsigned int i;
-	for (i = 0; i < server->n; i++) {
-		if (is_listener(server, i)) {
-			struct pollfd *pollfd = &server->pollfd[i];
-			if (enable) {
-				pollfd->events = POLLIN;
-			} else {
-				pollfd->revents = 0;
-				pollfd->events = 0;
-			}
-		}
+	int i;
+	for (i = server->listeners; i != -1; i = server->socket[i].next) {
+		if (!enable)
+			server->pollfd[i].revents = 0;
+		set_events(server, i, enable ? POLLIN : 0);
 	}
 }
 
-/* Resize server tables to fit n connections. */
+/* Grows the slot tables to hold at least n slots.
+ * They never shrink, so that slots stay where they are. */
 static int
-server_resize(struct server *server, unsigned int n)
+server_grow(struct server *server, unsigned int n)
 {
 	struct server_socket *new_socket;
 	struct pollfd *new_pollfd;
+	unsigned int nmax = server->nmax ? server->nmax : INCREMENT;
 
-	assert(server->n <= n);
-	/* round n up to the next multiple of INCREMENT */
-	if (n % INCREMENT)
-		n += INCREMENT - (n % INCREMENT);
-	/* Don't resize if same size, or one step smaller (hysteresis) */
-	if ((server->nmax == n) || (server->nmax - 1 == n))
+	if (n <= server->nmax)
 		return 0;
+	while (nmax < n)
+		nmax *= 2;
 
-	/* Assign early in case of realloc failure */
-	if (n < server->nmax)
-		server->nmax = n;
 	new_socket = realloc(server->socket,
-		n * sizeof *new_socket);
-	if (n && !new_socket)
+		nmax * sizeof *new_socket);
+	if (!new_socket)
 		return on_error(server, "realloc %zu: %s",
-			n * sizeof *new_socket, strerror(errno));
+			nmax * sizeof *new_socket, strerror(errno));
 	server->socket = new_socket;
 
 	new_pollfd = realloc(server->pollfd,
-		n * sizeof *new_pollfd);
-	if (n && !new_pollfd)
+		nmax * sizeof *new_pollfd);
+	if (!new_pollfd)
 		return on_error(server, "realloc %zu: %s",
-			n * sizeof *new_pollfd, strerror(errno));
+			nmax * sizeof *new_pollfd, strerror(errno));
 	server->pollfd = new_pollfd;
 
-	server->nmax = n;
+	server->nmax = nmax;
+	return 0;
+}
+
+/* Grows the index to cover fd */
+static int
+index_grow(struct server *server, int fd)
+{
+	unsigned int *new_index;
+	unsigned int n = server->nindex ? server->nindex : INCREMENT;
 
+	if ((unsigned int)fd < server->nindex)
+		return 0;
+	while (n <= (unsigned int)fd)
+		n *= 2;
+	new_index = realloc(server->index, n * sizeof *new_index);
+	if (!new_index)
+		return on_error(server, "realloc %zu: %s",
+			n * sizeof *new_index, strerror(errno));
+	server->index = new_index;
+	server->nindex = n;
 	return 0;
 }
 
-/* adds a new <fd> to the list of sockets.
- * Returns the index on success.
+/* Puts slot i on the free list */
+static void
+free_slot(struct server *server, unsigned int i)
+{
+	server->pollfd[i].fd = -1;	/* poll() ignores it */
+	server->pollfd[i].events = 0;
+	server->pollfd[i].revents = 0;
+	server->socket[i].is_listener = 0;
+	server->socket[i].next = server->free;
+	server->free = i;
+}
+
+/* adds a new <fd> to the table of sockets, making it non-blocking
+ * unless it is known to be already.
+ * Returns the slot on success.
  * Returns -1 on allocation failure. */
 static int
-server_add_socket(struct server *server, int fd)
+server_add_socket(struct server *server, int fd, int nonblocking)
 {
 	struct server_socket *socket;
 	unsigned int i;
 	int val;
 	unsigned int max_sockets = server->context->max_sockets;
 
-	i = server->n;
-	// assert(i < server->context->max_sockets);
-
-	if (server_resize(server, server->n + 1) == -1)
+	if (index_grow(server, fd) == -1)
 		return -1;
+	if (server->free != -1) {
+		i = server->free;
+		server->free = server->socket[i].next;
+	} else {
+		if (server_grow(server, server->nslots + 1) == -1)
+			return -1;
+		i = server->nslots++;
+	}
 
 	/* Set the socket to non-blocking mode.
 	 * The socket will have SO_SNDBUF of buffer space
 	 * (which on Linux defaults to about 100kB)
 	 * A full buffer is announced when write() returns EAGAIN.
 	 * We can call shutdown(SHUT_RD) to trigger a race-free close. */
-	val = fcntl(fd, F_GETFL);
-	if (val != -1 && !(val & O_NONBLOCK))
-		(void) fcntl(fd, F_SETFL, val | O_NONBLOCK);
+	if (!nonblocking) {
+		val = fcntl(fd, F_GETFL);
+		if (val != -1 && !(val & O_NONBLOCK))
+			(void) fcntl(fd, F_SETFL, val | O_NONBLOCK);
+	}
 
 	server->pollfd[i].fd = fd;
 	server->pollfd[i].events = POLLIN;
 	server->pollfd[i].revents = 0;
 	socket = &server->socket[i];
 	memset(socket, 0, sizeof *socket);
+	server->index[fd] = i;
+#ifdef SERVER_EPOLL
+	{
+		struct epoll_event ev;
+
+		memset(&ev, 0, sizeof ev);
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if (epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+			on_error(server, "epoll_ctl %d: %s", fd,
+				strerror(errno));
+			free_slot(server, i);
+			return -1;
+		}
+	}
+#endif
 
 	server->n++;
 	if (max_sockets && server->n >= max_sockets)
@@ -164,17 +280,21 @@ server_add_socket(struct server *server, int fd)
 	return i;
 }
 
-/* closes and frees the <fd,proto> at index i */
+/* closes and frees the <fd,proto> at slot i */
 static void
 close_delete_socket(struct server *server, unsigned int i)
 {
-	unsigned int last = server->n - 1;
 	struct server_socket *socket = &server->socket[i];
 	unsigned int max_sockets = server->context->max_sockets;
 	char namebuf[PEERNAMESZ];
 
 	assert(!is_listener(server, i));
 
+#ifdef SERVER_EPOLL
+	/* The fd may have been dup()ed, which would keep it registered */
+	(void) epoll_ctl(server->epfd, EPOLL_CTL_DEL, server->pollfd[i].fd,
+		NULL);
+#endif
 	if (close(server->pollfd[i].fd) == -1) {
 		int e = errno;
 		on_error(server, "[%s] close: %s",
@@ -187,43 +307,85 @@ close_delete_socket(struct server *server, unsigned int i)
 		server->context->on_close(server, socket->data,
 			socket->listener);
 
-	/* Maintain the list packing */
-	if (i < last) {
-		server->pollfd[i] = server->pollfd[last];
-		server->socket[i] = server->socket[last];
-	}
+	/* Other sockets keep their slots */
+	free_slot(server, i);
 
 	/* Note: this should be the only place that decrements
 	 * server->n otherwise the enable/disable logic will break */
 	server->n--;
 	if (max_sockets && server->n == max_sockets - 1)
 		server_listen_enable(server, 1);
+}
 
-	(void) server_resize(server, server->n);
+/* adds a socket for an established connection */
+static int
+add_fd(struct server *server, int fd, struct listener *listener,
+	int nonblocking)
+{
+	int i;
+	void *data;
+
+	if (fd == -1)
+		return -1;
+
+	i = server_add_socket(server, fd, nonblocking);
+	if (i == -1)
+		return -1;
+
+	if (server->context->on_accept) {
+		data = server->context->on_accept(server, fd, listener);
+		/* Anything may have happened in upcall; find fd again */
+		i = find_socket(server, fd);
+		if (i != -1) {
+			server->socket[i].data = data;
+			server->socket[i].listener = listener;
+		}
+	}
+	return 0;
 }
 
-/* accept a new connection and create a new socket */
+/* accept new connections and create new sockets, until none are
+ * waiting. Accepts at most ACCEPT_MAX, so that a flood of
+ * connections cannot hold up the clients already connected. */
 static void
 server_accept(struct server *server, int listen_fd, struct listener *listener)
 {
+	unsigned int max_sockets = server->context->max_sockets;
+	unsigned int count;
+	int nonblocking = 0;
 	int fd;
 
-	fd = accept(listen_fd, NULL, NULL);
-	if (fd == -1) {
-		on_error(server, "[%s] accept: %s",
-			listener ? listener->name : "(null)",
-			strerror(errno));
-		return;
-	}
+	for (count = 0; count < ACCEPT_MAX; count++) {
+		/* The listeners are disabled at the limit */
+		if (max_sockets && server->n >= max_sockets)
+			break;
+#ifdef SOCK_NONBLOCK
+		fd = accept4(listen_fd, NULL, NULL,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		nonblocking = 1;
+#else
+		fd = accept(listen_fd, NULL, NULL);
+#endif
+		if (fd == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if (errno == ECONNABORTED || errno == EINTR)
+				continue;
+			on_error(server, "[%s] accept: %s",
+				listener ? listener->name : "(null)",
+				strerror(errno));
+			break;
+		}
 
-	if (server_add_fd(server, fd, listener) == -1) {
-		if (close(fd) == -1) {
-			char namebuf[PEERNAMESZ];
-			int e = errno;
-			on_error(server, "[%s] close: %s",
-				listener_peername(listener, fd,
-					namebuf, sizeof namebuf),
-				strerror(e));
+		if (add_fd(server, fd, listener, nonblocking) == -1) {
+			if (close(fd) == -1) {
+				char namebuf[PEERNAMESZ];
+				int e = errno;
+				on_error(server, "[%s] close: %s",
+					listener_peername(listener, fd,
+						namebuf, sizeof namebuf),
+					strerror(e));
+			}
 		}
 	}
 }
@@ -231,34 +393,182 @@ server_accept(struct server *server, int listen_fd, struct listener *listener)
 int
 server_add_fd(struct server *server, int fd, struct listener *listener)
 {
-	int i;
-	void *data;
+	return add_fd(server, fd, listener, 0);
+}
 
-	if (fd == -1)
-		return -1;
+/* Closes client i after a callback returned len <= 0,
+ * logging errno if it was -1 */
+static void
+client_failed(struct server *server, unsigned int i, int len,
+	const char *callback)
+{
+	if (len == -1) {
+		int e = errno;
+		char namebuf[PEERNAMESZ];
+		on_error(server, "[%s] %s: %s",
+			listener_peername(
+				server->socket[i].listener,
+				server->pollfd[i].fd,
+				namebuf, sizeof namebuf),
+			callback, strerror(e));
+	}
+	close_delete_socket(server, i);
+}
 
-	i = server_add_socket(server, fd);
-	if (i == -1)
-		return -1;
+void
+server_timer_start(struct server *server, struct server_timer *t,
+	unsigned int ms)
+{
+	struct server_timer **tp;
+
+	server_timer_stop(t);
+	t->when = server_now() + ms;
+	/* Keep the list in expiry order; timers expiring
+	 * together expire in the order they were started */
+	for (tp = &server->timers; *tp && (*tp)->when <= t->when;
+	     tp = &(*tp)->next)
+		;
+	INSERT(t, tp);
+}
 
-	if (server->context->on_accept) {
-		data = server->context->on_accept(server, fd, listener);
-		/* Anything may have happened in upcall; scan for fd */
-		for (i = 0; i < server->n; i++)
-			if (server->pollfd[i].fd == fd) {
-				server->socket[i].data = data;
-				server->socket[i].listener = listener;
-				break;
-			}
+void
+server_timer_stop(struct server_timer *t)
+{
+	if (t->prevp) {
+		REMOVE(t);
+		t->prevp = NULL;
 	}
-	return 0;
 }
 
+int
+server_timer_pending(const struct server_timer *t)
+{
+	return t->prevp != NULL;
+}
+
+/* Returns the poll() timeout until the first timer expires,
+ * or the caller's timeout if that is sooner */
+static int
+timers_timeout(const struct server *server, int timeout)
+{
+	uint64_t now, wait;
+
+	if (!server->timers)
+		return timeout;
+	now = server_now();
+	wait = server->timers->when > now ? server->timers->when - now : 0;
+	if (timeout >= 0 && wait > (uint64_t)timeout)
+		return timeout;
+	if (wait > INT32_MAX)
+		return INT32_MAX;
+	return wait;
+}
+
+/* Calls on_timeout() for the timers that have expired.
+ * Returns the number expired. */
+static int
+timers_expire(struct server *server)
+{
+	struct server_timer *expired = NULL, *t;
+	uint64_t now = server_now();
+	int count = 0;
+
+	/* Move the expired timers onto a private list first,
+	 * so those restarted by their callbacks wait for the
+	 * next poll */
+	if (!server->timers || server->timers->when > now)
+		return 0;
+	expired = server->timers;
+	expired->prevp = &expired;
+	for (t = expired; t->next && t->next->when <= now; t = t->next)
+		;
+	server->timers = t->next;
+	if (server->timers)
+		server->timers->prevp = &server->timers;
+	t->next = NULL;
+
+	while ((t = expired)) {
+		server_timer_stop(t);
+		t->on_timeout(server, t);
+		count++;
+	}
+	return count;
+}
+
+/* Handles the events on slot i */
+static void
+dispatch(struct server *server, unsigned int i, int revents)
+{
+	int len;
+
+	/* handle connection on a listner socket */
+	if (is_listener(server, i)) {
+		server_accept(server, server->pollfd[i].fd,
+			server->socket[i].listener);
+		return;
+	}
+
+	/* handle room for queued output */
+	if ((revents & POLLOUT) && server->context->on_writable) {
+		len = server->context->on_writable(server,
+			server->socket[i].data, server->pollfd[i].fd);
+		if (len <= 0) {
+			client_failed(server, i, len, "on_writable");
+			return;
+		}
+		revents &= ~POLLOUT;
+		if (!revents)
+			return;
+	}
+
+	/* handle ready data. */
+	len = server->context->on_ready(server,
+		server->socket[i].data, server->pollfd[i].fd);
+	if (len <= 0)
+		client_failed(server, i, len, "on_ready");
+}
+
+#ifdef SERVER_EPOLL
+int
+server_poll(struct server *server, int timeout)
+{
+	struct epoll_event ready[READY_MAX];
+	int ret;
+	int k;
+
+	if (!server->n)
+		return 0;
+
+	ret = epoll_wait(server->epfd, ready, READY_MAX,
+		timers_timeout(server, timeout));
+	if (ret == 0)
+		return timers_expire(server);
+	if (ret < 0)
+		return ret;
+
+	/* Only the socket being dispatched is ever closed, and
+	 * the others keep their slots, so each later event still
+	 * finds its socket */
+	for (k = 0; k < ret; k++) {
+		uint32_t events = ready[k].events;
+		unsigned int i = ready[k].data.u32;
+
+		if (server->pollfd[i].fd == -1)
+			continue;
+		dispatch(server, i,
+			(events & EPOLLIN ? POLLIN : 0) |
+			(events & EPOLLOUT ? POLLOUT : 0) |
+			(events & EPOLLERR ? POLLERR : 0) |
+			(events & EPOLLHUP ? POLLHUP : 0));
+	}
+	(void) timers_expire(server);
+	return ret;
+}
+#else
 int
 server_poll(struct server *server, int timeout)
 {
 	int ret;
-	int len;
 	int revents;
 	unsigned int i;
 
@@ -266,52 +576,45 @@ server_poll(struct server *server, int timeout)
 		return 0;
 
 	/* The revents are kept zero elsewhere */
-	/* for (i = 0; i < server->n; i++) server->pollfd[i].revents = 0; */
+	/* for (i = 0; i < server->nslots; i++) server->pollfd[i].revents = 0; */
 
-	ret = poll(server->pollfd, server->n, timeout);
-	if (ret <= 0)
+	ret = poll(server->pollfd, server->nslots,
+		timers_timeout(server, timeout));
+	if (ret == 0)
+		return timers_expire(server);
+	if (ret < 0)
 		return ret;
 
-	i = 0;
-	while (i < server->n) {
+	for (i = 0; i < server->nslots; i++) {
 		revents = server->pollfd[i].revents;
-		if (!revents) { /* quiet */
-			i++;
+		if (!revents) /* quiet, or free */
 			continue;
-		}
 
 		/* clear revents for next time */
 		server->pollfd[i].revents = 0;
 
-		/* handle connection on a listner socket */
-		if (is_listener(server, i)) {
-			server_accept(server, server->pollfd[i].fd,
-				server->socket[i].listener);
-			i++;
-			continue;
-		}
-
-		/* handle ready data. */
-		len = server->context->on_ready(server,
-			server->socket[i].data, server->pollfd[i].fd);
-		if (len > 0)
-			i++;
-		else if (len == 0)
-			close_delete_socket(server, i);
-		else /* len == -1 */ {
-			int e = errno;
-			char namebuf[PEERNAMESZ];
-			on_error(server, "[%s] on_ready: %s",
-				listener_peername(
-					server->socket[i].listener,
-					server->pollfd[i].fd,
-					namebuf, sizeof namebuf),
-				strerror(e));
-			close_delete_socket(server, i);
-		}
+		dispatch(server, i, revents);
 	}
+	(void) timers_expire(server);
 	return ret;
 }
+#endif
+
+int
+server_want_write(struct server *server, int fd, int want)
+{
+	int i = find_socket(server, fd);
+
+	if (i == -1 || is_listener(server, i)) {
+		errno = EBADF;
+		return -1;
+	}
+	if (want)
+		set_events(server, i, server->pollfd[i].events | POLLOUT);
+	else
+		set_events(server, i, server->pollfd[i].events & ~POLLOUT);
+	return 0;
+}
 
 struct server *
 server_new(const struct server_context *c)
@@ -320,9 +623,22 @@ server_new(const struct server_context *c)
 	if (server) {
 		server->context = c;
 		server->n = 0;
+		server->nslots = 0;
 		server->nmax = 0;
 		server->socket = NULL;
 		server->pollfd = NULL;
+		server->free = -1;
+		server->listeners = -1;
+		server->index = NULL;
+		server->nindex = 0;
+		server->timers = NULL;
+#ifdef SERVER_EPOLL
+		server->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (server->epfd == -1) {
+			free(server);
+			return NULL;
+		}
+#endif
 	}
 	return server;
 }
@@ -336,8 +652,8 @@ server_free(struct server *server)
 		return;
 
 	/* Close all the non-listeners */
-	for (i = 0; i < server->n; i++) {
-		if (!is_listener(server, i)) {
+	for (i = 0; i < server->nslots; i++) {
+		if (server->pollfd[i].fd != -1 && !is_listener(server, i)) {
 			close(server->pollfd[i].fd);
 			if (server->context->on_close)
 				server->context->on_close(server,
@@ -347,7 +663,7 @@ server_free(struct server *server)
 	}
 
 	/* Close all the listeners */
-	for (i = 0; i < server->n; i++) {
+	for (i = 0; i < server->nslots; i++) {
 		if (is_listener(server, i)) {
 			close(server->pollfd[i].fd);
 			if (server->context->on_listener_close)
@@ -356,6 +672,10 @@ server_free(struct server *server)
 		}
 	}
 
+#ifdef SERVER_EPOLL
+	close(server->epfd);
+#endif
+	free(server->index);
 	free(server->socket);
 	free(server->pollfd);
 	free(server);
@@ -366,12 +686,17 @@ server_add_listener(struct server *server, int fd, struct listener *listener)
 {
 	int i;
 
-	i = server_add_socket(server, fd);
+	if (fd == -1)
+		return -1;
+
+	i = server_add_socket(server, fd, 0);
 	if (i < 0)
 		return -1;
 	server->socket[i].is_listener = 1;
 	server->socket[i].data = NULL;
 	server->socket[i].listener = listener;
+	server->socket[i].next = server->listeners;
+	server->listeners = i;
 	return 0;
 }
 
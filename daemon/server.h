@@ -1,15 +1,35 @@
 #pragma once
+#include <stdint.h>
+#include "list.h"
 
 /*
  * poll-based socket server
  * - Only knows how to poll(), accept() and close() file descriptors.
+ * - On Linux, polls with epoll so that the cost of each poll is
+ *   in the number of ready fds, not the number open.
  * - Sets all accepted FDs to non-blocking.
  * - Makes upcalls to handlers, which should read() and write().
  * - Limits the number of active connections by ignoring
  *   listener sockets when socket limit is reached.
+ * - Runs timers between polls.
  */
 struct server;
 
+/* epoll is used where available, unless SERVER_POLL is defined */
+#if defined(__linux__) && !defined(SERVER_POLL)
+# define SERVER_EPOLL
+#endif
+
+/* A one-shot timer, held by the caller.
+ * Zero it before first use, then set on_timeout. */
+struct server_timer {
+	/* Called once the timer expires. It may restart the timer. */
+	void (*on_timeout)(struct server *s, struct server_timer *t);
+	/* private */
+	LINK(struct server_timer);	/* in expiry order */
+	uint64_t when;			/* expiry time, in ms */
+};
+
 struct listener {
 	char name[64];
 	const char * (*peername)(int fd, char *buf, size_t sz);
@@ -31,6 +51,11 @@ struct server_context {
 	 * Callback should return 0 to close the client.
 	 * Callback should return -1 to log errno and close the client.  */
 	int (*on_ready)(struct server *s, void *client, int fd);
+	/* Writable callback [optional].
+	 * Invoked when a client fd that asked with server_want_write()
+	 * becomes ready for write (POLLOUT), before any on_ready().
+	 * Return values are as for on_ready(). */
+	int (*on_writable)(struct server *s, void *client, int fd);
 	/* Client close callback [optional].
 	 * Called after on_ready() or server_free() calls close(fd).
 	 * This callback matches on_accept() and can be used to
@@ -49,7 +74,8 @@ struct server_context {
 	void (*on_error)(struct server *s, const char *msg);
 };
 
-/* Creates a new server instance with no client or listener sockets. */
+/* Creates a new server instance with no client or listener sockets.
+ * Returns NULL on error. */
 struct server *server_new(const struct server_context *c);
 
 /* Adds a listener FD to the server.
@@ -67,9 +93,30 @@ int server_add_fd(struct server *server, int fd, struct listener *l);
 /* Dispatch all pending I/O just once, possibly blocking.
  * Call this multiple times in a loop.
  * A timeout of -1 blocks forever. See poll().
- * Returns 0 if there are no FDs, otherwise what poll() returns. */
+ * The poll ends early when the next timer expires.
+ * Returns 0 if there are no FDs, otherwise what poll() (or
+ * epoll_wait()) returns, or if that is 0, the number of timers
+ * expired. */
 int server_poll(struct server *server, int timeout);
 
+/* Asks for on_writable() upcalls on a client fd (want = 1),
+ * or stops them (want = 0). The client will want to do this
+ * while it has output that the fd could not yet take.
+ * Returns -1 on error (EBADF). */
+int server_want_write(struct server *server, int fd, int want);
+
+/* Returns the time on the timers' monotonic clock, in milliseconds */
+uint64_t server_now(void);
+
+/* Starts a timer to expire after ms milliseconds. If it was already
+ * started, it is restarted. */
+void server_timer_start(struct server *server, struct server_timer *t,
+	unsigned int ms);
+/* Stops a timer, so that it will not expire. */
+void server_timer_stop(struct server_timer *t);
+/* Tests if a timer has been started and has not yet expired */
+int server_timer_pending(const struct server_timer *t);
+
 /* Shut down the read side of a FD.
  * This should be used outside of on_ready() to trigger a future on_ready()
  * callback on the FD. Inside of that on_ready(), a read() will return 0,
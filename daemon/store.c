@@ -1,3 +1,4 @@
+#define _GNU_SOURCE	/* mremap() */
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,22 +6,26 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
 
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
 
 #include "store.h"
+#include "crc32c.h"
 
 /* #define DEBUG 1 */
 #ifdef DEBUG
-# include <stdio.h>
 # define dprintf(...) fprintf(stderr, __VA_ARGS__)
 #else
 # define dprintf(...) /* nothing */
 #endif
 
+#ifndef offsetof
 #define offsetof(T, f) ((size_t)&((T *)0)->f)
+#endif
 
 /*
  * Implements fast, compact storage for <sz,key\0data> elements
@@ -46,6 +51,22 @@
  * a ramdisk and is a multiple of pages. The sorted index is
  * reconstructed on load/recovery.
  *
+ * The sorted index is an AVL tree, so that inserting or deleting
+ * a key costs O(log n) no matter how large the store grows.
+ * Tree nodes are kept in a pool array and refer to each other by
+ * 32-bit pool index rather than by pointer.
+ *
+ * Each node refers to its info by 32-bit file offset, so that nodes
+ * stay valid when the file is remapped. Nodes also carry the key's
+ * length and its first 8 bytes packed big-endian, so that most key
+ * comparisons are settled by one integer compare without touching
+ * the mapped file. Only keys sharing that prefix are compared in full.
+ *
+ * Exact key lookups (get, put and del) avoid the tree walk, and its
+ * string comparisons against keys in the mapped file, by using a
+ * side-index: an open-addressed hash table of the same nodes. The
+ * tree is then only needed for ordered iteration and insertion.
+ *
  * The file contains a sequence of 8-byte-aligned records.
  * The first two bytes of a record determine the record's type:
  * either a data record, or a gap record.
@@ -53,11 +74,38 @@
  *   Data:     uint16 sz            number of bytes following
  *             char   keyvalue[sz]
  *             char   empty[*]      pad to next 8 byte boundary
+ *             uint32 crc           if HEADER_CRC: CRC-32C of sz,keyvalue
  *
  *   Gap:      uint16 sz            0
  *             uint16 count         number of gap records that follow
  *             char   empty[4]      pad to next 8 byte boundary
  *
+ * The file starts with a 32-byte header record. It looks like a gap
+ * whose second field is a magic number, so older readers skip it.
+ * Files without a header have their content shifted up to make room.
+ *
+ *   Header:   uint16 sz            0
+ *             uint16 magic         HEADER_MAGIC
+ *             uint32 size          24
+ *             uint32 generation    of the last checkpoint
+ *             uint32 flags         HEADER_CLEAN, HEADER_CRC
+ *             char   reserved[16]
+ *
+ * A checkpoint writes the sorted index to a sidecar file (the store's
+ * path with ".idx" appended), stamped with a new generation, and only
+ * then marks the header clean with that same generation. The first
+ * change to the store afterwards clears the clean flag. A store that
+ * is opened clean with a sidecar of matching generation is indexed
+ * straight from the sidecar, without scanning the file. Otherwise the
+ * file is scanned, and the index rebuilt, as before.
+ *
+ * A store created with STORE_CRC ends each data record with a checksum,
+ * so that a torn write that left a plausible size is not mistaken
+ * for data. Records that fail their checksum are turned into gaps.
+ * Checksums are verified as the file is scanned on open or, with
+ * STORE_LAZY, when each info is first read. Node flags remember which
+ * infos are yet to be verified. Infos put by this process are trusted.
+ *
  * An expected common case is to reallocate the element at the
  * end of the file.
  *
@@ -77,7 +125,8 @@
  *      | data            :dd|s'|        after allocation 'dd'
  *      +-----------------+--+--+
  *
- * 2. (dd>s) Repack the data, then retry.
+ * 2. (dd>s) Extend the file, as in 2a below. Only if that fails
+ *    do we stop to repack the data, then retry.
  *
  *    NB: If an entry is being reallocated (growing), ensure
  *    that it moves to the end of the (packed) data first, to
@@ -103,6 +152,12 @@
  *      | packed data       :  dd  | s" |  allocation fits
  *      +-------------------+------+----+
  *
+ *    The file is extended by more than dd: a slack of half the
+ *    used size (at most STORE_GROW_MAX) is added, so that a stream
+ *    of inserts grows it geometrically, and the cost of growing
+ *    and remapping is amortised. On Linux, mremap() lets the
+ *    kernel extend the mapping without copying page tables.
+ *
  * 2b. (dd+2p<=s') sufficient space avail after repack; becomes
  *                 same as case 1.
  *
@@ -118,9 +173,9 @@
  *      | packed data :  dd  |s"|        allocation now fits
  *      +-------------+------+--+
  *
- * 2c. If, after packing and allocating there would be
- *    more than 2*pagesize bytes free, release the excess pages.
- *    The 2 pages is a hysteresis gap.
+ * 2c. If, after packing and allocating there would be more
+ *    than twice the growth slack free, release the excess pages,
+ *    keeping one slack. The second slack is a hysteresis gap.
  *
  *      +-------.-------.-------.-------+
  *      | page  : page  : page  : page  |
@@ -135,24 +190,116 @@
  *      +---------+--+----------.-------+
  *      | page  : page  : page  :          truncate file
  *      +-------.-------.-------+
+ *
+ *
+ * Compaction
+ *
+ * Rather than repacking the whole file at once, which would stall
+ * every client, gaps are reclaimed incrementally. Once the gaps
+ * exceed a quarter of the used file, each put or del also moves a
+ * bounded number of bytes. A cursor sweeps from the start of the
+ * file to the space, sliding each data record it finds after a gap
+ * down into that gap. The gaps so collect in front of the cursor,
+ * and when the cursor reaches the space they become part of it.
+ *
+ *      +------+---+------+----+------+-+
+ *      | data |gap| info |gap | data |s|    cursor at first gap
+ *      +------+---+------+----+------+-+
+ *      | data | info |   gap  | data |s|    info slid down
+ *      +------+------+--------+------+-+
+ *
+ * Records behind the cursor may be freed again during a sweep;
+ * those gaps are left for the next sweep.
  */
 
 #define MIN(a,b)  ((a) < (b) ? (a) : (b))
 #define MAX(a,b)  ((a) > (b) ? (a) : (b))
 
-#define STORE_INCREMENT		64	/* store.max's growth rate */
+#define NODE_INCREMENT		64	/* node pool's minimum size */
+#define HASH_MINSIZE		64	/* hash table's minimum size */
+#define COMPACT_BUDGET		16384	/* bytes compacted per step */
+#define COMPACT_MINWASTE	65536	/* gap bytes before compacting */
+#define GAP_EXACTBINS		32	/* free list bins of a single size */
+#define GAP_NBINS		56	/* all free list bins */
+#define GAP_SCAN		8	/* gaps examined per ranged bin */
+#define NOGAP			UINT32_MAX /* the null gap offset */
+#define HEADER_SIZE		32	/* size of the file's header record */
+#define HEADER_MAGIC		0x6e69	/* identifies the header record */
+#define HEADER_CLEAN		0x1	/* header flag: sidecar is current */
+#define HEADER_CRC		0x2	/* header flag: infos have checksums */
+#define NODE_UNVERIFIED		0x1	/* node flag: checksum not yet checked */
+#define SIDECAR_MAGIC		0x78646901 /* identifies a sidecar file */
+#define NIL			0	/* the null node index */
+
+#ifndef STORE_GROW_MAX
+# define STORE_GROW_MAX		(8 * 1024 * 1024) /* most slack per growth */
+#endif
+
+#ifdef STORE_POPULATE
+# define STORE_MAP_FLAGS	(MAP_SHARED | MAP_POPULATE)
+#else
+# define STORE_MAP_FLAGS	MAP_SHARED
+#endif
+
+/* A node of the sorted index. Nodes are linked into an AVL tree
+ * ordered by their info's key. */
+struct node {
+	uint32_t child[2];		/* left and right subtrees */
+	uint32_t parent;
+	uint32_t offset;		/* file offset of the info */
+	uint64_t prefix;		/* first 8 bytes of key, big-endian */
+	uint32_t hash;			/* hash of the key, see key_init() */
+	uint16_t keylen;		/* length of key */
+	int8_t balance;			/* height(right) - height(left) */
+	uint8_t flags;			/* NODE_UNVERIFIED */
+};
+
+/* A key being searched for, summarised the same way as in a node */
+struct key {
+	const char *s;
+	size_t len;
+	uint64_t prefix;
+	uint32_t hash;
+};
+
+/* A slot of the hash index. Collisions are resolved by linear probing */
+struct hashslot {
+	uint32_t hash;			/* hash of the node's key */
+	uint32_t x;			/* node index, or NIL when empty */
+};
+
 struct store {
 	/* Backing file */
 	int fd;				/* fd to backing file */
+	char *idxpath;			/* path to the index sidecar file */
 	char *filebase;			/* mapped backing file */
 	uint32_t filesz;		/* mapped extent */
 	uint32_t pagesize;		/* file increment size */
 	uint32_t space;			/* offset to space at end of file */
-
-	/* Sorted index of pointers into the filestore */
-	unsigned int n;
-	unsigned int max;
-	struct info **index;		/* TODO use an AVL tree */
+	uint32_t live;			/* bytes used by data records */
+	uint32_t trailer;		/* bytes of checksum after each info */
+	int lazy;			/* verify checksums on first read */
+
+	/* Sorted index of the infos in the filestore */
+	unsigned int n;			/* number of indexed infos */
+	uint32_t root;			/* root of the tree, or NIL */
+	uint32_t free;			/* list of free nodes, via child[0] */
+	uint32_t nnodes;		/* high-water mark of node[] use */
+	uint32_t maxnodes;		/* allocated size of node[] */
+	struct node *node;		/* node pool. node[NIL] is unused */
+
+	/* Hash index of the same nodes, for exact key lookup */
+	uint32_t hashsize;		/* size of hash[], a power of 2 */
+	struct hashslot *hash;
+
+	/* Free lists of gaps, by size. See gap_bin() */
+	uint32_t gapbin[GAP_NBINS];	/* first gap offset, or NOGAP */
+	uint64_t gapmap;		/* bit set for each non-empty bin */
+
+	/* Incremental compaction */
+	int compacting;			/* true while a sweep is underway */
+	uint32_t compact;		/* sweep cursor, on a record boundary */
+	struct store_stats stats;
 };
 
 /* Minimum size of an element (info or gap) */
@@ -165,12 +312,48 @@ struct gap {
 	uint32_t size;		/* Size of this gap in bytes */
 };
 
+/* Memory layout of a gap record large enough to be on a free list */
+struct freegap {
+	struct gap gap;
+	uint32_t next;		/* offset of next gap in bin, or NOGAP */
+	uint32_t prev;		/* offset of previous gap in bin, or NOGAP */
+};
+
+/* Memory layout of the header record at the start of the file */
+struct header {
+	struct gap gap;		/* zero2 is HEADER_MAGIC */
+	uint32_t generation;	/* generation of the last checkpoint */
+	uint32_t flags;		/* HEADER_CLEAN */
+	uint32_t reserved[4];
+};
+
 union record {
 	struct info info;
 	struct gap gap;
+	struct freegap freegap;
+	struct header header;
 };
 
-static unsigned int store_find(const struct store *store, const char *key);
+/* Layout of the start of a sidecar file. It is followed by the
+ * index's nodes, in key order. */
+struct sidecar {
+	uint32_t magic;			/* SIDECAR_MAGIC */
+	uint16_t nodesize;		/* sizeof (struct node) */
+	uint16_t nbins;			/* GAP_NBINS */
+	uint32_t generation;		/* stamp shared with the header */
+	uint32_t filesz;
+	uint32_t space;
+	uint32_t live;
+	uint32_t n;
+	uint32_t gapbin[GAP_NBINS];
+	uint64_t gapmap;
+};
+
+static uint32_t store_find(const struct store *store, const struct key *k,
+	uint32_t *parentp, int *dirp);
+static void store_info_insert(struct store *store, uint32_t x,
+	const struct key *k);
+static uint32_t store_verify(struct store *store, uint32_t x);
 
 /* Rounds n up to an alignment boundary, if it isn't on one already.
  * align must be a power of 2. */
@@ -180,70 +363,467 @@ roundup(uint32_t n, uint32_t align)
 	return (n + (align - 1)) & ~(align - 1);
 }
 
-/* Ensure that slot store->index[i] exists,
- * expanding store->max as needed.
+/* Ensure that the node pool has room for count more nodes,
+ * growing it geometrically.
  * Return -1 on allocation error. */
 static int
-store_index_ensure(struct store *store, unsigned int i)
+store_nodes_ensure(struct store *store, uint32_t count)
 {
-	struct info **new_info;
-	unsigned int new_max;
+	struct node *new_node;
+	uint32_t new_max;
 
-	if (i < store->max)
+	if (count > UINT32_MAX / 2 - store->nnodes) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (store->nnodes + count <= store->maxnodes)
 		return 0;
-	new_max = roundup(i + 1, STORE_INCREMENT);
-	new_info = realloc(store->index, new_max * sizeof *new_info);
-	if (!new_info)
+	new_max = MAX(roundup(store->nnodes + count, NODE_INCREMENT),
+		store->maxnodes * 2);
+	new_node = realloc(store->node, new_max * sizeof *new_node);
+	if (!new_node)
 		return -1;
-	store->max = new_max;
-	store->index = new_info;
+	store->maxnodes = new_max;
+	store->node = new_node;
 	return 0;
 }
 
-/* Inserts a new, uninitialized cell at store->index[i],
- * shifting up the higher cells to keep them in sorted order.
- * Return -1 on allocation error */
+/* Returns a pointer to node x's info in the current mapping */
+static struct info *
+node_info(const struct store *store, uint32_t x)
+{
+	return (struct info *)(store->filebase + store->node[x].offset);
+}
+
+/* Allocates an unlinked node for the info. The caller must fill in
+ * the node's key summary.
+ * Returns NIL on allocation error. */
+static uint32_t
+node_alloc(struct store *store, struct info *info)
+{
+	struct node *node;
+	uint32_t x = store->free;
+
+	if (x)
+		store->free = store->node[x].child[0];
+	else {
+		if (store_nodes_ensure(store, 1) == -1)
+			return NIL;
+		x = store->nnodes++;
+	}
+	node = &store->node[x];
+	node->child[0] = node->child[1] = NIL;
+	node->parent = NIL;
+	node->balance = 0;
+	node->flags = 0;
+	node->offset = (char *)info - store->filebase;
+	return x;
+}
+
+/* Returns an unlinked node to the free list */
+static void
+node_free(struct store *store, uint32_t x)
+{
+	store->node[x].child[0] = store->free;
+	store->free = x;
+}
+
+/* Makes x's parent (or the root) refer to y instead of x */
+static void
+node_replace(struct store *store, uint32_t x, uint32_t y)
+{
+	struct node *node = store->node;
+	uint32_t parent = node[x].parent;
+
+	if (!parent)
+		store->root = y;
+	else
+		node[parent].child[node[parent].child[1] == x] = y;
+	if (y)
+		node[y].parent = parent;
+}
+
+/* Rotates the subtree at x so that x descends in direction dir.
+ * Returns the node that took x's place. Balances are not updated. */
+static uint32_t
+node_rotate(struct store *store, uint32_t x, int dir)
+{
+	struct node *node = store->node;
+	uint32_t y = node[x].child[!dir];
+	uint32_t b = node[y].child[dir];
+
+	node_replace(store, x, y);
+	node[x].child[!dir] = b;
+	if (b)
+		node[b].parent = x;
+	node[y].child[dir] = x;
+	node[x].parent = y;
+	return y;
+}
+
+/* Restores the AVL property at x, whose balance has reached +/-2.
+ * Returns the new root of the subtree. */
+static uint32_t
+node_rebalance(struct store *store, uint32_t x)
+{
+	struct node *node = store->node;
+	int s = node[x].balance > 0 ? 1 : -1;
+	int heavy = s > 0;
+	uint32_t c = node[x].child[heavy];
+	uint32_t g;
+
+	if (node[c].balance == -s) {
+		/* Inner grandchild is too tall: double rotation */
+		g = node[c].child[!heavy];
+		node_rotate(store, c, heavy);
+		node_rotate(store, x, !heavy);
+		node[x].balance = node[g].balance == s ? -s : 0;
+		node[c].balance = node[g].balance == -s ? s : 0;
+		node[g].balance = 0;
+		return g;
+	}
+	node_rotate(store, x, !heavy);
+	if (node[c].balance == 0) {
+		/* (only happens after a deletion) */
+		node[x].balance = s;
+		node[c].balance = -s;
+	} else {
+		node[x].balance = 0;
+		node[c].balance = 0;
+	}
+	return c;
+}
+
+/* Links the unlinked node x into the tree as the dir-child of parent,
+ * which was found by store_find(), then rebalances. */
+static void
+node_insert(struct store *store, uint32_t x, uint32_t parent, int dir)
+{
+	struct node *node = store->node;
+
+	node[x].parent = parent;
+	if (!parent) {
+		store->root = x;
+		return;
+	}
+	node[parent].child[dir] = x;
+
+	/* Retrace upwards while the subtree grew taller */
+	while (parent) {
+		node[parent].balance += dir ? 1 : -1;
+		if (node[parent].balance == 0)
+			break;
+		if (node[parent].balance != 1 && node[parent].balance != -1) {
+			node_rebalance(store, parent);
+			break;
+		}
+		x = parent;
+		parent = node[x].parent;
+		if (parent)
+			dir = node[parent].child[1] == x;
+	}
+}
+
+/* Unlinks node z from the tree, and rebalances. */
+static void
+node_delete(struct store *store, uint32_t z)
+{
+	struct node *node = store->node;
+	uint32_t parent;	/* where retracing begins */
+	int dir;		/* which subtree of parent got shorter */
+
+	if (!node[z].child[0] || !node[z].child[1]) {
+		uint32_t child = node[z].child[0] ? node[z].child[0]
+						  : node[z].child[1];
+		parent = node[z].parent;
+		dir = parent && node[parent].child[1] == z;
+		node_replace(store, z, child);
+	} else {
+		/* Replace z with its successor y, which has no left child */
+		uint32_t y = node[z].child[1];
+		while (node[y].child[0])
+			y = node[y].child[0];
+		if (node[y].parent == z) {
+			parent = y;
+			dir = 1;
+		} else {
+			parent = node[y].parent;
+			dir = 0;
+			node[parent].child[0] = node[y].child[1];
+			if (node[y].child[1])
+				node[node[y].child[1]].parent = parent;
+			node[y].child[1] = node[z].child[1];
+			node[node[y].child[1]].parent = y;
+		}
+		node[y].child[0] = node[z].child[0];
+		node[node[y].child[0]].parent = y;
+		node[y].balance = node[z].balance;
+		node_replace(store, z, y);
+	}
+
+	/* Retrace upwards while the subtree got shorter */
+	while (parent) {
+		uint32_t up;
+
+		node[parent].balance += dir ? -1 : 1;
+		if (node[parent].balance == 1 || node[parent].balance == -1)
+			break;
+		if (node[parent].balance != 0) {
+			int heavy = node[parent].balance > 0;
+			int cb = node[node[parent].child[heavy]].balance;
+			parent = node_rebalance(store, parent);
+			if (cb == 0)
+				break;
+		}
+		up = node[parent].parent;
+		if (up)
+			dir = node[up].child[1] == parent;
+		parent = up;
+	}
+}
+
+/* Returns the leftmost node of the subtree x, or NIL if x is NIL */
+static uint32_t
+node_first(const struct store *store, uint32_t x)
+{
+	if (x)
+		while (store->node[x].child[0])
+			x = store->node[x].child[0];
+	return x;
+}
+
+/* Returns the in-order successor of x, or NIL */
+static uint32_t
+node_next(const struct store *store, uint32_t x)
+{
+	const struct node *node = store->node;
+	uint32_t parent;
+
+	if (node[x].child[1])
+		return node_first(store, node[x].child[1]);
+	while ((parent = node[x].parent) && node[parent].child[1] == x)
+		x = parent;
+	return parent;
+}
+
+/* Links the sorted, consecutive nodes [lo,hi) into a balanced tree.
+ * Returns the subtree's root and its height in *heightp. */
+static uint32_t
+node_build(struct store *store, uint32_t lo, uint32_t hi, uint32_t parent,
+	int *heightp)
+{
+	struct node *node = store->node;
+	uint32_t mid;
+	int lh, rh;
+
+	if (lo == hi) {
+		*heightp = 0;
+		return NIL;
+	}
+	mid = lo + (hi - lo) / 2;
+	node[mid].parent = parent;
+	node[mid].child[0] = node_build(store, lo, mid, mid, &lh);
+	node[mid].child[1] = node_build(store, mid + 1, hi, mid, &rh);
+	node[mid].balance = rh - lh;
+	*heightp = MAX(lh, rh) + 1;
+	return mid;
+}
+
+/* Summarises a key: its FNV-1a hash, length and big-endian prefix */
+static void
+key_init(struct key *k, const char *s)
+{
+	uint32_t h = 2166136261u;
+	uint64_t prefix = 0;
+	size_t len;
+
+	for (len = 0; s[len]; len++) {
+		h ^= (unsigned char)s[len];
+		h *= 16777619u;
+		if (len < 8)
+			prefix |= (uint64_t)(unsigned char)s[len] << (56 - 8 * len);
+	}
+	k->s = s;
+	k->len = len;
+	k->prefix = prefix;
+	k->hash = h;
+}
+
+/* Fills in node x's key summary from the key of its info */
+static void
+node_load_key(struct store *store, uint32_t x)
+{
+	struct node *node = &store->node[x];
+	struct key k;
+
+	key_init(&k, node_info(store, x)->keyvalue);
+	node->prefix = k.prefix;
+	node->hash = k.hash;
+	node->keylen = k.len;
+}
+
+/* Compares a key with node x's key, like strcmp() */
 static int
-store_index_insert(struct store *store, unsigned int i)
+node_keycmp(const struct store *store, const struct key *k, uint32_t x)
 {
-	unsigned int n = store->n;
+	const struct node *node = &store->node[x];
+
+	if (k->prefix != node->prefix)
+		return k->prefix < node->prefix ? -1 : 1;
+	/* Equal prefixes of keys no longer than 8 bytes means
+	 * one key is a prefix of the other */
+	if (k->len <= 8 || node->keylen <= 8)
+		return k->len < node->keylen ? -1 : k->len > node->keylen;
+	return strcmp(k->s + 8, node_info(store, x)->keyvalue + 8);
+}
 
-	if (store_index_ensure(store, n) == -1)
-		return -1;
-	if (i != n)
-		memmove(&store->index[i + 1], &store->index[i],
-			sizeof store->index[0] * (store->n - i));
-	++store->n;
-	store->index[i] = NULL; /* unnecessary, but reveals bugs */
-	return i;
+/* Tests if a key is equal to node x's key */
+static int
+node_keyeq(const struct store *store, const struct key *k, uint32_t x)
+{
+	const struct node *node = &store->node[x];
+
+	return k->prefix == node->prefix && k->len == node->keylen &&
+	    (k->len <= 8 ||
+	     memcmp(k->s + 8, node_info(store, x)->keyvalue + 8,
+		k->len - 8) == 0);
 }
 
-/* Removes the cell at store->index[i], shifting higher cells down. */
-void
-store_index_delete(struct store *store, unsigned int i)
+/* Places a slot into the first empty position of its probe sequence */
+static void
+hash_place(struct hashslot *hash, uint32_t mask, struct hashslot slot)
 {
-	--store->n;
-	memmove(&store->index[i], &store->index[i + 1],
-		sizeof store->index[0] * (store->n - i));
+	uint32_t i = slot.hash & mask;
+
+	while (hash[i].x)
+		i = (i + 1) & mask;
+	hash[i] = slot;
 }
 
-/* Compares two index entries. Used to sort the index by key */
+/* Ensure that the hash index can hold count nodes without exceeding
+ * a 3/4 load factor, growing it as needed.
+ * Return -1 on allocation error. */
 static int
-info_compar(const void *av, const void *bv)
+store_hash_ensure(struct store *store, uint32_t count)
+{
+	struct hashslot *new_hash;
+	uint32_t new_size = store->hashsize ? store->hashsize : HASH_MINSIZE;
+	uint32_t i;
+
+	while (count > new_size / 4 * 3) {
+		if (new_size > UINT32_MAX / 4) {
+			errno = ENOMEM;
+			return -1;
+		}
+		new_size *= 2;
+	}
+	if (new_size == store->hashsize)
+		return 0;
+	new_hash = calloc(new_size, sizeof *new_hash);
+	if (!new_hash)
+		return -1;
+	for (i = 0; i < store->hashsize; i++)
+		if (store->hash[i].x)
+			hash_place(new_hash, new_size - 1, store->hash[i]);
+	free(store->hash);
+	store->hash = new_hash;
+	store->hashsize = new_size;
+	return 0;
+}
+
+/* Adds node x to the hash index. There must be room for it. */
+static void
+store_hash_insert(struct store *store, uint32_t x)
 {
-	const struct info * const *a = av;
-	const struct info * const *b = bv;
+	struct hashslot slot;
+
+	slot.hash = store->node[x].hash;
+	slot.x = x;
+	hash_place(store->hash, store->hashsize - 1, slot);
+}
+
+/* Removes node x from the hash index, shifting back any following
+ * slots that would otherwise become unreachable. */
+static void
+store_hash_delete(struct store *store, uint32_t x)
+{
+	struct hashslot *hash = store->hash;
+	uint32_t mask = store->hashsize - 1;
+	uint32_t i, j, k;
+
+	for (i = store->node[x].hash & mask; hash[i].x != x; i = (i + 1) & mask)
+		assert(hash[i].x);
+	for (;;) {
+		j = i;
+		do {
+			j = (j + 1) & mask;
+			if (!hash[j].x) {
+				hash[i].x = NIL;
+				return;
+			}
+			k = hash[j].hash & mask; /* j's home slot */
+		} while (i <= j ? (i < k && k <= j) : (i < k || k <= j));
+		hash[i] = hash[j];
+		i = j;
+	}
+}
+
+/* Returns the node having the key, or NIL */
+static uint32_t
+store_hash_find(const struct store *store, const struct key *k)
+{
+	const struct hashslot *hash = store->hash;
+	uint32_t mask = store->hashsize - 1;
+	uint32_t i, x;
+
+	if (!store->hashsize)
+		return NIL;
+	for (i = k->hash & mask; (x = hash[i].x); i = (i + 1) & mask)
+		if (hash[i].hash == k->hash && node_keyeq(store, k, x))
+			return x;
+	return NIL;
+}
+
+/* Refills the hash index from a node pool without free nodes */
+static void
+store_hash_rebuild(struct store *store)
+{
+	uint32_t x;
+
+	assert(!store->free);
+	memset(store->hash, 0, store->hashsize * sizeof *store->hash);
+	for (x = 1; x < store->nnodes; x++)
+		store_hash_insert(store, x);
+}
+
+/* The mapping used by node_compar(), which qsort() can't pass */
+static const char *compar_filebase;
 
-	return strcmp((*a)->keyvalue, (*b)->keyvalue);
+/* Compares two nodes. Used to sort the node pool by key */
+static int
+node_compar(const void *av, const void *bv)
+{
+	const struct node *a = av;
+	const struct node *b = bv;
+
+	if (a->prefix != b->prefix)
+		return a->prefix < b->prefix ? -1 : 1;
+	if (a->keylen <= 8 || b->keylen <= 8)
+		return a->keylen < b->keylen ? -1 : a->keylen > b->keylen;
+	return strcmp(compar_filebase + a->offset + offsetof(struct info,
+			keyvalue[8]),
+		      compar_filebase + b->offset + offsetof(struct info,
+			keyvalue[8]));
 }
 
 
 
-/* Size of an info given it's .sz field */
+/* Size of an info given it's .sz field, including any checksum */
 static uint32_t
-info_size(uint16_t sz)
+info_size(const struct store *store, uint16_t sz)
 {
-	return roundup(offsetof(struct info, keyvalue[sz]), INFO_ALIGN);
+	return roundup(offsetof(struct info, keyvalue[sz]) + store->trailer,
+		INFO_ALIGN);
 }
 
 static int
@@ -252,6 +832,37 @@ record_is_gap(const union record *record)
 	return record->info.sz == 0;
 }
 
+/* Locates the checksum at the end of a data record */
+static uint32_t *
+info_crc(const struct store *store, const struct info *info)
+{
+	return (uint32_t *)((char *)info + info_size(store, info->sz) -
+		store->trailer);
+}
+
+/* Computes the checksum that belongs with an info */
+static uint32_t
+info_compute_crc(const struct info *info)
+{
+	return crc32c(0, info, offsetof(struct info, keyvalue[info->sz]));
+}
+
+/* Tests if an info matches its checksum, when the store has them */
+static int
+info_crc_ok(const struct store *store, const struct info *info)
+{
+	return !store->trailer ||
+	       *info_crc(store, info) == info_compute_crc(info);
+}
+
+/* Updates an info's checksum after its content has changed */
+static void
+info_set_crc(const struct store *store, struct info *info)
+{
+	if (store->trailer)
+		*info_crc(store, info) = info_compute_crc(info);
+}
+
 static void
 record_init_gap(union record *record, uint32_t nbytes)
 {
@@ -262,11 +873,11 @@ record_init_gap(union record *record, uint32_t nbytes)
 }
 
 static uint32_t
-record_get_size(const union record *record)
+record_get_size(const struct store *store, const union record *record)
 {
 	return record_is_gap(record)
 		? roundup(record->gap.size, INFO_ALIGN) + INFO_ALIGN
-		: info_size(record->info.sz);
+		: info_size(store, record->info.sz);
 }
 
 /* Sets the space pointer, and writes a sentinel gap */
@@ -281,85 +892,321 @@ store_set_space(struct store *store, uint32_t space)
 	}
 }
 
-/* Convert an info into a gap. Might rewind store->space. */
+/* Returns a monotonic time in nanoseconds */
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Records how long an operation made the caller wait */
 static void
-info_make_gap(struct store *store, struct info *info)
+store_note_pause(struct store *store, uint64_t ns)
 {
-	char *filebase = store->filebase;
-	uint32_t filesz = store->filesz;
-	uint32_t offset = (char *)info - filebase;
-	uint32_t next_offset = offset + info_size(info->sz);
-	union record *record = (union record *)info;
-
-	while (next_offset < filesz) {
-		union record *next_record =
-			(union record *)(filebase + next_offset);
-		uint32_t record_sz = record_get_size(next_record);
-		if (!record_is_gap(next_record))
+	if (ns > store->stats.max_pause_ns)
+		store->stats.max_pause_ns = ns;
+}
+
+/* Moves the compaction cursor back to start if a record
+ * boundary it was on is now within [start,end) */
+static void
+store_cursor_fix(struct store *store, uint32_t start, uint32_t end)
+{
+	if (store->compact > start && store->compact < end)
+		store->compact = start;
+}
+
+/* Returns the free list bin for gaps of the given size.
+ * Small sizes each have their own bin; larger sizes share a bin
+ * with the other sizes that have the same highest bit set. */
+static unsigned int
+gap_bin(uint32_t size)
+{
+	unsigned int k;
+
+	if (size < 16 + GAP_EXACTBINS * INFO_ALIGN)
+		return size < 16 ? 0 : size / INFO_ALIGN - 2;
+	for (k = 8; size >> (k + 1); k++)
+		;
+	return GAP_EXACTBINS + k - 8;
+}
+
+static struct freegap *
+store_gap_at(const struct store *store, uint32_t offset)
+{
+	return (struct freegap *)(store->filebase + offset);
+}
+
+/* Adds the gap record at offset to its free list.
+ * Gaps too small to hold the list links are not tracked. */
+static void
+store_gap_link(struct store *store, uint32_t offset)
+{
+	struct freegap *gap = store_gap_at(store, offset);
+	uint32_t size = record_get_size(store, (union record *)gap);
+	unsigned int bin;
+
+	if (size < sizeof *gap)
+		return;
+	bin = gap_bin(size);
+	gap->prev = NOGAP;
+	gap->next = store->gapbin[bin];
+	if (gap->next != NOGAP)
+		store_gap_at(store, gap->next)->prev = offset;
+	store->gapbin[bin] = offset;
+	store->gapmap |= UINT64_C(1) << bin;
+}
+
+/* Removes the gap record at offset from its free list */
+static void
+store_gap_unlink(struct store *store, uint32_t offset)
+{
+	struct freegap *gap = store_gap_at(store, offset);
+	uint32_t size = record_get_size(store, (union record *)gap);
+	unsigned int bin;
+
+	if (size < sizeof *gap)
+		return;
+	bin = gap_bin(size);
+	if (gap->prev != NOGAP)
+		store_gap_at(store, gap->prev)->next = gap->next;
+	else
+		store->gapbin[bin] = gap->next;
+	if (gap->next != NOGAP)
+		store_gap_at(store, gap->next)->prev = gap->prev;
+	if (store->gapbin[bin] == NOGAP)
+		store->gapmap &= ~(UINT64_C(1) << bin);
+}
+
+/* Empties the free lists */
+static void
+store_gaps_clear(struct store *store)
+{
+	unsigned int bin;
+
+	for (bin = 0; bin < GAP_NBINS; bin++)
+		store->gapbin[bin] = NOGAP;
+	store->gapmap = 0;
+}
+
+/*
+ * Finds the smallest free gap of at least size bytes.
+ * Ranged bins are not searched exhaustively; only their first
+ * GAP_SCAN gaps are considered.
+ * Returns NOGAP if no suitable gap was found.
+ */
+static uint32_t
+store_gap_find(const struct store *store, uint32_t size)
+{
+	unsigned int bin = gap_bin(size);
+	uint64_t map = store->gapmap & (~UINT64_C(0) << bin);
+
+	while (map) {
+		uint32_t offset, best = NOGAP, best_size = UINT32_MAX;
+		unsigned int scan;
+
+		bin = __builtin_ctzll(map);
+		offset = store->gapbin[bin];
+		if (bin < GAP_EXACTBINS)
+			return offset;
+		for (scan = 0; offset != NOGAP && scan < GAP_SCAN; scan++) {
+			const struct freegap *gap = store_gap_at(store, offset);
+			uint32_t gap_size = record_get_size(store,
+				(const union record *)gap);
+			if (gap_size >= size && gap_size < best_size) {
+				best = offset;
+				best_size = gap_size;
+			}
+			offset = gap->next;
+		}
+		if (best != NOGAP)
+			return best;
+		map &= map - 1;
+	}
+	return NOGAP;
+}
+
+/*
+ * Turns the bytes [offset,offset+nbytes) into a free gap, merging it
+ * with any gaps that follow. If the gap then reaches the space, it
+ * joins the space instead.
+ */
+static void
+store_gap_make(struct store *store, uint32_t offset, uint32_t nbytes)
+{
+	uint32_t end = offset + nbytes;
+
+	while (end < store->space) {
+		union record *next = (union record *)(store->filebase + end);
+		if (!record_is_gap(next))
 			break;
-		/* Be careful with integer overflow */
-		if (next_offset > filesz - record_sz)
-			next_offset = filesz;
-		else
-			next_offset += record_sz;
-	}
-	if (next_offset > filesz)
-		next_offset = filesz;
-	record_init_gap(record, next_offset - offset);
-	if (next_offset == filesz)
+		store_gap_unlink(store, end);
+		end += record_get_size(store, next);
+	}
+	store_cursor_fix(store, offset, end);
+	if (end >= store->space)
 		store_set_space(store, offset);
+	else {
+		record_init_gap((union record *)(store->filebase + offset),
+			end - offset);
+		store_gap_link(store, offset);
+	}
+}
+
+/* Convert an info into a gap. Might rewind store->space. */
+static void
+info_make_gap(struct store *store, struct info *info)
+{
+	uint32_t size = info_size(store, info->sz);
+
+	store->live -= size;
+	store_gap_make(store, (char *)info - store->filebase, size);
 }
 
-/* Repack the file, and rebuild the sorted index. */
+/*
+ * Repack the file, sliding all the infos down over the gaps.
+ * Infos keep their relative order, so the index stays sorted, and
+ * only the offsets of the moved nodes need to be updated.
+ */
 static void
 store_repack(struct store *store)
 {
 	uint32_t offset;
 	uint32_t w_offset;
 	uint32_t space = store->space;
-	uint32_t filesz = store->filesz;
 	char *filebase = store->filebase;
-	unsigned int i;
 
 	dprintf("repacking: n=%u space=0x%08" PRIx32
 		" filesz=0x%" PRIx32 "\n",
 		store->n, store->space, store->filesz);
 
-	/* Scan 0..space copying down data */
-	offset = 0;
-	w_offset = 0;
-	i = 0;
+	/* Scan the file after the header, copying down data */
+	offset = HEADER_SIZE;
+	w_offset = HEADER_SIZE;
 	while (offset < space) {
 		const union record *record =
 			(const union record *)(filebase + offset);
-		uint32_t recordsz = record_get_size(record);
+		uint32_t recordsz = record_get_size(store, record);
 		if (!record_is_gap(record)) {
-			struct info *w_info =
-				(struct info *)(filebase + w_offset);
 			dprintf(" 0x%08" PRIx32 "<-0x%08" PRIx32
 			        " sz=0x%" PRIx32 " key=\"%.30s\"\n",
-				w_offset, offset, recordsz, w_info->keyvalue);
-			if (w_offset != offset)
-				memmove(w_info, record, recordsz);
-			store_index_ensure(store, i);
-			store->index[i++] = w_info;
+				w_offset, offset, recordsz,
+				record->info.keyvalue);
+			if (w_offset != offset) {
+				struct key k;
+				uint32_t x;
+
+				key_init(&k, record->info.keyvalue);
+				x = store_hash_find(store, &k);
+				assert(x && store->node[x].offset == offset);
+				memmove(filebase + w_offset, record, recordsz);
+				store->node[x].offset = w_offset;
+			}
 			w_offset += recordsz;
 		}
 		offset += recordsz;
 	}
-	space = w_offset;
-	assert(space <= store->space);
-	if (space < store->filesz)
-		record_init_gap((union record *)(filebase + space),
-			filesz - space);
-	store_set_space(store, space);
-	store->n = i;
-	qsort(store->index, store->n, sizeof store->index[0], info_compar);
+	store_set_space(store, w_offset);
+	store->live = w_offset - HEADER_SIZE;
+	store->compacting = 0;
+	store->compact = 0;
+	store_gaps_clear(store);
 
 	dprintf("repacked:  n=%u space=0x%08" PRIx32 " filesz=0x%" PRIx32 "\n",
 		store->n, store->space, store->filesz);
 }
 
+/* Tests if a record is a file header */
+static int
+record_is_header(const union record *record)
+{
+	return record_is_gap(record) &&
+	       record->gap.zero2 == HEADER_MAGIC &&
+	       roundup(record->gap.size, INFO_ALIGN) + INFO_ALIGN ==
+			HEADER_SIZE;
+}
+
+static struct header *
+store_header(const struct store *store)
+{
+	return &((union record *)store->filebase)->header;
+}
+
+/* Clears the header's clean flag, before the store is changed */
+static void
+store_touch(struct store *store)
+{
+	struct header *header = store_header(store);
+
+	if (header->flags & HEADER_CLEAN)
+		header->flags &= ~HEADER_CLEAN;
+}
+
+/*
+ * Loads the index from the sidecar file, if it was written
+ * at the same generation as the store's clean header.
+ * Returns -1 if the sidecar can't be used.
+ */
+static int
+store_sidecar_load(struct store *store)
+{
+	const struct header *header = store_header(store);
+	struct sidecar sc;
+	struct node *node;
+	FILE *f;
+	uint32_t x;
+	unsigned int bin;
+	int height;
+
+	if (!record_is_header((const union record *)header) ||
+	    !(header->flags & HEADER_CLEAN))
+		return -1;
+	f = fopen(store->idxpath, "r");
+	if (!f)
+		return -1;
+	if (fread(&sc, sizeof sc, 1, f) != 1 ||
+	    sc.magic != SIDECAR_MAGIC ||
+	    sc.nodesize != sizeof (struct node) ||
+	    sc.nbins != GAP_NBINS ||
+	    sc.generation != header->generation ||
+	    sc.filesz != store->filesz ||
+	    sc.space < HEADER_SIZE || sc.space > sc.filesz ||
+	    sc.live > sc.space ||
+	    store_nodes_ensure(store, sc.n) == -1 ||
+	    store_hash_ensure(store, sc.n) == -1 ||
+	    fread(&store->node[1], sizeof (struct node), sc.n, f) != sc.n)
+	{
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	/* Sanity check what was loaded */
+	node = store->node;
+	for (x = 1; x <= sc.n; x++)
+		if (node[x].offset < HEADER_SIZE ||
+		    node[x].offset >= sc.space ||
+		    node[x].offset % INFO_ALIGN)
+			return -1;
+	for (bin = 0; bin < GAP_NBINS; bin++)
+		if (sc.gapbin[bin] != NOGAP && sc.gapbin[bin] >= sc.space)
+			return -1;
+
+	store->n = sc.n;
+	store->nnodes = sc.n + 1;
+	store->free = NIL;
+	store->root = node_build(store, 1, store->nnodes, NIL, &height);
+	store_hash_rebuild(store);
+	store_set_space(store, sc.space);
+	store->live = sc.live;
+	memcpy(store->gapbin, sc.gapbin, sizeof store->gapbin);
+	store->gapmap = sc.gapmap;
+	return 0;
+}
+
 /* Load or initialize a backing file */
 static int
 store_file_open(struct store *store, int fd)
@@ -368,8 +1215,12 @@ store_file_open(struct store *store, int fd)
 	uint32_t filesz;
 	char *filebase;
 	uint32_t offset;
+	uint32_t space;
 	unsigned int n;
-	int i;
+	int has_header;
+	struct node *node;
+	uint32_t x, w;
+	int height;
 
 	/* Open the file and find its physical size */
 	if (fstat(fd, &st) == -1)
@@ -390,7 +1241,7 @@ store_file_open(struct store *store, int fd)
 	dprintf("stat sz=0x%lx filesz=0x%" PRIx32 "\n", st.st_size, filesz);
 
 	/* Map the file into the address space */
-	filebase = mmap(NULL, filesz, PROT_READ | PROT_WRITE, MAP_SHARED,
+	filebase = mmap(NULL, filesz, PROT_READ | PROT_WRITE, STORE_MAP_FLAGS,
 		fd, 0);
 	if ((void *)filebase == MAP_FAILED)
 		return -1;
@@ -399,13 +1250,41 @@ store_file_open(struct store *store, int fd)
 	if (filesz > st.st_size)
 		memset(filebase + st.st_size, 0, filesz - st.st_size);
 
-	/* Scan the number of data records in the file.
+	/* (From here, store_file_close() will release the mapping) */
+	store->filebase = filebase;
+	store->filesz = filesz;
+
+	/* The header says whether infos carry checksums */
+	if (record_is_header((union record *)filebase) &&
+	    (store_header(store)->flags & HEADER_CRC))
+		store->trailer = sizeof (uint32_t);
+
+	/* Try the quick way first */
+	if (store_sidecar_load(store) == 0) {
+		dprintf("store_file_open: loaded index from %s\n",
+			store->idxpath);
+		store->fd = fd;
+		store->stats.sidecar = 1;
+		/* Checksums are verified now, or later if lazy */
+		n = store->nnodes;
+		for (x = 1; x < n; x++)
+			store->node[x].flags = store->trailer ?
+				NODE_UNVERIFIED : 0;
+		if (store->trailer && !store->lazy)
+			for (x = 1; x < n; x++)
+				store_verify(store, x);
+		return 0;
+	}
+
+	/* Scan the number of data records in the file, and find
+	 * the end of the last one, which is where the space starts.
 	 * If corrupted entries are found, just truncate. */
 	offset = 0;
+	space = 0;
 	n = 0;
 	while (offset < filesz) {
 		union record *record = (union record *)(filebase + offset);
-		uint32_t record_sz = record_get_size(record);
+		uint32_t record_sz = record_get_size(store, record);
 
 #if 0
 		dprintf("  +0x%08" PRIx32 ": %4s sz=0x%" PRIx32 "\n",
@@ -415,39 +1294,114 @@ store_file_open(struct store *store, int fd)
 
 		if (offset > filesz - record_sz)
 			break; /* Too big */
-		if (!record_is_gap(record))
-			n++;
 		offset += record_sz;
+		if (!record_is_gap(record)) {
+			n++;
+			space = offset;
+		}
 	}
-	if (n && store_index_ensure(store, n - 1) == -1) {
-		(void )munmap(filebase, filesz);
-		return -1;
+
+	has_header = record_is_header((union record *)filebase);
+	if (!has_header && space > filesz - HEADER_SIZE) {
+		/* Grow the file by a page, to make room for a header */
+		uint32_t new_filesz = filesz + store->pagesize;
+
+		if (new_filesz < filesz) {
+			errno = ENOSPC;
+			return -1;
+		}
+		if (ftruncate(fd, new_filesz) == -1)
+			return -1;
+		(void) munmap(filebase, filesz);
+		store->filebase = NULL;
+		filebase = mmap(NULL, new_filesz, PROT_READ | PROT_WRITE,
+			STORE_MAP_FLAGS, fd, 0);
+		if ((void *)filebase == MAP_FAILED)
+			return -1;
+		store->filebase = filebase;
+		store->filesz = filesz = new_filesz;
 	}
 
+	if (store_nodes_ensure(store, n) == -1 ||
+	    store_hash_ensure(store, n) == -1)
+		return -1;
+
 	/* After this point we are committed and can only return 0 */
 
 	store->fd = fd;
-	store->filebase = filebase;
-	store->filesz = filesz;
-	store->space = offset;
-
-	/* Repack the store, creating the index */
-	store_repack(store);
+	if (!has_header) {
+		/* Shift older content up, and insert a header */
+		struct header *header = store_header(store);
+
+		memmove(filebase + HEADER_SIZE, filebase, space);
+		space += HEADER_SIZE;
+		memset(header, 0, sizeof *header);
+		record_init_gap((union record *)header, HEADER_SIZE);
+		header->gap.zero2 = HEADER_MAGIC;
+	}
+	store_touch(store);
+	store_set_space(store, MAX(space, HEADER_SIZE));
+
+	/* Load a node for each info, and put the gaps on free lists */
+	store_gaps_clear(store);
+	node = store->node;
+	x = NIL;
+	for (offset = HEADER_SIZE; offset < space; ) {
+		union record *record = (union record *)(filebase + offset);
 
-	/* De-duplicate */
-	i = 1;
-	while (i < store->n) {
-		struct info *info = store->index[i];
-		if (strcmp(store->index[i-1]->keyvalue, info->keyvalue) != 0) {
-			i++;
-			continue;
+		if (record_is_gap(record))
+			store_gap_link(store, offset);
+		else if (!store->lazy && !info_crc_ok(store, &record->info)) {
+			dprintf("store_file_open: bad checksum at 0x%08"
+				PRIx32 "\n", offset);
+			record_init_gap(record,
+				record_get_size(store, record));
+			store_gap_link(store, offset);
+			store->stats.corrupt++;
+		} else {
+			node[++x].offset = offset;
+			node[x].flags = store->trailer && store->lazy ?
+				NODE_UNVERIFIED : 0;
+			node_load_key(store, x);
+			store->live += info_size(store, record->info.sz);
 		}
-		dprintf("store_file_open: removed duplicate %.100s\n",
-			info->keyvalue);
-		info_make_gap(store, info);
-		store_index_delete(store, i);
+		offset += record_get_size(store, record);
+	}
+	n = x;
+
+	/* Sort the nodes, then drop duplicate keys in a single pass,
+	 * keeping whichever info is later in the file */
+	compar_filebase = filebase;
+	qsort(&node[1], n, sizeof node[0], node_compar);
+	w = NIL;
+	for (x = 1; x <= n; x++) {
+		if (w && node_compar(&node[w], &node[x]) == 0) {
+			uint32_t dup = node[x].offset;
+			union record *record;
+			uint32_t size;
+
+			if (dup > node[w].offset) {
+				dup = node[w].offset;
+				node[w] = node[x];
+			}
+			record = (union record *)(filebase + dup);
+			dprintf("store_file_open: removed duplicate %.100s\n",
+				record->info.keyvalue);
+			size = info_size(store, record->info.sz);
+			store->live -= size;
+			record_init_gap(record, size);
+			store_gap_link(store, dup);
+		} else
+			node[++w] = node[x];
 	}
 
+	/* Build the tree and hash index over the unique nodes */
+	store->n = w;
+	store->nnodes = w + 1;
+	store->free = NIL;
+	store->root = node_build(store, 1, store->nnodes, NIL, &height);
+	store_hash_rebuild(store);
+
 	return 0;
 }
 
@@ -459,64 +1413,111 @@ store_file_close(struct store *store)
 	store->filebase = NULL;
 }
 
-/* Change the size of the backing file. */
+/* Change the size of the backing file.
+ * Only the mapping's address changes; the index holds file offsets. */
 static int
 store_file_setsize(struct store *store, uint32_t new_filesz)
 {
 	char *new_base;
 	char *old_base = store->filebase;
 	uint32_t old_filesz = store->filesz;
-	unsigned int i;
 
 	if (new_filesz > old_filesz) {
 		/* Grow the file first */
-		if (posix_fallocate(store->fd, old_filesz,
-		    new_filesz - old_filesz) == -1)
+		int err = posix_fallocate(store->fd, old_filesz,
+		    new_filesz - old_filesz);
+		if (err) {
+			errno = err;
 			return -1;
+		}
 	}
 
+#ifdef MREMAP_MAYMOVE
+	/* Let the kernel extend or move the mapping in place */
+	new_base = mremap(old_base, old_filesz, new_filesz, MREMAP_MAYMOVE);
+#else
 	/* Create a second mapping before releasing the current one. */
-	new_base = mmap(NULL, new_filesz, PROT_READ | PROT_WRITE, MAP_SHARED,
-		store->fd, 0);
-	if ((void *)new_base == MAP_FAILED)
+	new_base = mmap(NULL, new_filesz, PROT_READ | PROT_WRITE,
+		STORE_MAP_FLAGS, store->fd, 0);
+#endif
+	if ((void *)new_base == MAP_FAILED) {
+		if (new_filesz > old_filesz)
+			(void) ftruncate(store->fd, old_filesz);
 		return -1;
+	}
 
 	/* Switch over to the new mapping */
 	store->filebase = new_base;
 	store->filesz = new_filesz;
+#ifndef MREMAP_MAYMOVE
 	(void) munmap(old_base, old_filesz);
-	/* Adjust the sorted pointers to use the new mapping */
-	for (i = 0; i < store->n; i++)
-		if (store->index[i])
-			store->index[i] = (struct info *)(new_base +
-				((char *)store->index[i] - old_base));
+#endif
 
 	if (new_filesz < old_filesz) {
 		/* Shrink the file */
 		if (ftruncate(store->fd, new_filesz) == -1)
 			new_filesz = old_filesz; /* failed to shrink? */
 	} else if (new_filesz > old_filesz) {
-#if 0
-		/* Zero the end of the file */
-		memset(new_base + old_filesz, 0, new_filesz - old_filesz);
+		store->stats.grows++;
+#if defined STORE_POPULATE && defined MADV_POPULATE_WRITE
+		/* Fault in the new pages now rather than one at a time */
+		(void) madvise(new_base + old_filesz, new_filesz - old_filesz,
+			MADV_POPULATE_WRITE);
+#elif defined STORE_POPULATE
+		(void) madvise(new_base + old_filesz, new_filesz - old_filesz,
+			MADV_WILLNEED);
 #endif
 	}
 	store->filesz = new_filesz;
 	return 0;
 }
 
-/* Trim off excess pages from the mapped file. */
+/* The slack left after the space when the file grows: half the
+ * space, so growth is geometric, but at most STORE_GROW_MAX. */
+static uint32_t
+store_file_slack(const struct store *store)
+{
+	uint32_t slack = MIN(store->space / 2, STORE_GROW_MAX);
+
+	return roundup(MAX(slack, store->pagesize), store->pagesize);
+}
+
+/* Grow the file to hold an allocation of allocsz at the space,
+ * plus some slack to amortise the cost of growing. */
+static int
+store_file_grow(struct store *store, uint32_t allocsz)
+{
+	uint64_t pagemask = store->pagesize - 1;
+	uint64_t limit = UINT32_MAX & ~pagemask;
+	uint64_t need = ((uint64_t)store->space + allocsz + pagemask) &
+		~pagemask;
+	uint64_t want = MIN(need + store_file_slack(store), limit);
+
+	if (need > limit) {
+		errno = ENOSPC;
+		return -1;
+	}
+	if (store_file_setsize(store, want) == 0)
+		return 0;
+
+	/* Perhaps the slack was too ambitious */
+	if (want > need && store_file_setsize(store, need) == 0)
+		return 0;
+	return -1;
+}
+
+/* Trim off excess pages from the mapped file.
+ * Twice the growth slack is kept as hysteresis. */
 static void
 store_file_trim(struct store *store)
 {
 	uint32_t space = store->space;
 	uint32_t filesz = store->filesz;
-	uint32_t maxfilesz = roundup(space + 3 * store->pagesize, store->pagesize);
+	uint32_t slack = store_file_slack(store);
 
-	if (filesz > maxfilesz) {
+	if (filesz - space > 2 * slack + store->pagesize) {
 		union record *rec;
-		uint32_t newfilesz = roundup(space + store->pagesize,
-			store->pagesize);
+		uint32_t newfilesz = roundup(space, store->pagesize) + slack;
 		store_file_setsize(store, newfilesz);
 		rec = (union record *)(store->filebase + space);
 		record_init_gap(rec, store->filesz - space);
@@ -527,25 +1528,46 @@ static struct info *
 store_file_alloc(struct store *s, uint16_t sz)
 {
 	struct info *info;
-	uint32_t allocsz = info_size(sz);
+	uint32_t allocsz = info_size(s, sz);
+	uint32_t offset;
 
-	if (allocsz > s->filesz - s->space)
-		store_repack(s);
-	if (allocsz > s->filesz - s->space) {
-		uint32_t newfilesz;
+	/* Prefer to reuse a gap */
+	offset = store_gap_find(s, allocsz);
+	if (offset != NOGAP) {
+		uint32_t gapsz = record_get_size(s,
+			(union record *)(s->filebase + offset));
+
+		store_gap_unlink(s, offset);
+		if (gapsz > allocsz) {
+			record_init_gap((union record *)(s->filebase +
+			    offset + allocsz), gapsz - allocsz);
+			store_gap_link(s, offset + allocsz);
+		}
+		s->live += allocsz;
+		info = (struct info *)(s->filebase + offset);
+		info->sz = sz;
+		return info;
+	}
 
-		if (s->filesz >= UINT32_MAX - allocsz) {
-			errno = ENOSPC;
-			return NULL;
+	if (allocsz > s->filesz - s->space) {
+		/* Grow the file, and leave the gaps to the compactor */
+		if (store_file_grow(s, allocsz) == -1) {
+			uint64_t t0;
+
+			/* Only repack if it would make enough room */
+			if (allocsz > s->filesz - HEADER_SIZE - s->live)
+				return NULL;
+			t0 = now_ns();
+			store_repack(s);
+			s->stats.repacks++;
+			store_note_pause(s, now_ns() - t0);
 		}
-		newfilesz = roundup(s->space + allocsz, s->pagesize);
-		if (store_file_setsize(s, newfilesz) == -1)
-			return NULL;
 	}
 
 	assert(allocsz <= s->filesz - s->space);
 	info = (struct info *)(s->filebase + s->space);
 	s->space += allocsz;
+	s->live += allocsz;
 	if (s->space < s->filesz) {
 		union record *rec;
 		rec = (union record *)(s->filebase + s->space);
@@ -559,37 +1581,114 @@ store_file_alloc(struct store *s, uint16_t sz)
 static void
 store_file_dealloc(struct store *store, struct info *info)
 {
-	uint32_t offset = (char *)info - store->filebase;
-	uint32_t gapsz = info_size(info->sz);
-	uint32_t after_offset = offset + gapsz;
-	union record *after_record;
+	info_make_gap(store, info);
+	store_file_trim(store);
+}
 
-	if (after_offset == store->space) {
-		store_set_space(store, offset);
+/*
+ * Sweeps the compaction cursor forward over about budget bytes,
+ * sliding data records down into the gaps before them.
+ * Ends the sweep when the gaps reach the space.
+ */
+static void
+store_compact_step(struct store *store, uint32_t budget)
+{
+	char *filebase = store->filebase;
+	uint32_t c = store->compact;
+	uint32_t moved = 0;
+
+	while (moved < budget) {
+		union record *record;
+		uint32_t gapsz, next, infosz;
+		struct info *info;
+		struct key k;
+		uint32_t x;
+
+		if (c >= store->space)
+			break;
+		record = (union record *)(filebase + c);
+		if (!record_is_gap(record)) {
+			infosz = record_get_size(store, record);
+			c += infosz;
+			moved += infosz;
+			continue;
+		}
+
+		/* Take the run of gaps at the cursor off the free lists */
+		gapsz = 0;
+		next = c;
+		while (next < store->space &&
+		       record_is_gap((union record *)(filebase + next)))
+		{
+			uint32_t sz = record_get_size(store,
+				(union record *)(filebase + next));
+			store_gap_unlink(store, next);
+			gapsz += sz;
+			next += sz;
+		}
+		if (next >= store->space)
+			break;
+
+		/* Slide the following info down over the gaps */
+		info = (struct info *)(filebase + next);
+		infosz = info_size(store, info->sz);
+		key_init(&k, info->keyvalue);
+		x = store_hash_find(store, &k);
+		assert(x && store->node[x].offset == next);
+		memmove(filebase + c, info, infosz);
+		store->node[x].offset = c;
+		c += infosz;
+		record_init_gap((union record *)(filebase + c), gapsz);
+		store_gap_link(store, c);
+		moved += infosz;
+	}
+	store->compact = c;
+
+	if (c >= store->space || moved < budget) {
+		/* The gaps at the cursor reach the space: absorb them */
+		if (c < store->space)
+			store_set_space(store, c);
+		store->compacting = 0;
+		store->compact = 0;
+		store->stats.compactions++;
 		store_file_trim(store);
-	} else {
-		after_record =
-			(union record *)(store->filebase + after_offset);
-		if (record_is_gap(after_record))
-			gapsz += record_get_size(after_record);
-		record_init_gap((union record *)info, gapsz);
 	}
 }
 
+/* Starts a compaction sweep when the gaps become too large,
+ * and advances any sweep underway. */
+static void
+store_compact(struct store *store)
+{
+	uint64_t t0;
+
+	if (!store->compacting) {
+		uint32_t waste = store->space - HEADER_SIZE - store->live;
+		if (waste < COMPACT_MINWASTE || waste < store->space / 4)
+			return;
+		store->compacting = 1;
+		store->compact = HEADER_SIZE;
+	}
+	t0 = now_ns();
+	store_compact_step(store, COMPACT_BUDGET);
+	store_note_pause(store, now_ns() - t0);
+}
+
 /*
- * Resize an existing store->index[i], being careful to not lose any data
- * should an allocation fail.
+ * Resize the info of an existing node x, being careful to not lose any data
+ * should an allocation fail. The key k is that of the node's info.
  * The content of the resized info will be undefined.
  * Returns NULL if we can't grow the file mapping.
  */
 static struct info *
-store_info_realloc(struct store *store, unsigned int i, uint16_t new_sz)
+store_info_realloc(struct store *store, uint32_t x, const struct key *k,
+	uint16_t new_sz)
 {
-	struct info *info = store->index[i];
-	uint32_t offset = (char *)info - store->filebase;
+	struct info *info = node_info(store, x);
+	uint32_t offset = store->node[x].offset;
 	uint16_t old_sz = info->sz;
-	uint32_t new_alloc = info_size(new_sz);
-	uint32_t old_alloc = info_size(old_sz);
+	uint32_t new_alloc = info_size(store, new_sz);
+	uint32_t old_alloc = info_size(store, old_sz);
 	uint32_t grow;
 	union record *after_record;
 
@@ -612,22 +1711,16 @@ store_info_realloc(struct store *store, unsigned int i, uint16_t new_sz)
 	if (new_alloc < old_alloc) {
 		/* Shrinking allocation: new_sz < old_sz */
 		info->sz = new_sz;
+		store->live -= old_alloc - new_alloc;
 		if (!after_record) {
 			/* Space grows backwards */
 			store_set_space(store, offset + new_alloc);
 			store_file_trim(store);
-			return store->index[i]; /* (may have remapped) */
+			return node_info(store, x); /* (may have remapped) */
 		} else {
-			/* Create new gap */
-			uint32_t gap_offset = offset + new_alloc;
-			union record *new_gap =
-				(union record *)(store->filebase + gap_offset);
-			uint32_t new_gap_size = old_alloc - new_alloc;
-			if (record_is_gap(after_record)) {
-				/* Merge with gap afterward */
-				new_gap_size += record_get_size(after_record);
-			}
-			record_init_gap(new_gap, old_alloc - new_alloc);
+			/* Create new gap, merged with any gap afterward */
+			store_gap_make(store, offset + new_alloc,
+				old_alloc - new_alloc);
 			return info;
 		}
 	}
@@ -636,60 +1729,58 @@ store_info_realloc(struct store *store, unsigned int i, uint16_t new_sz)
 
 	/* Growing allocation; try to use a following gap to grow into */
 	if (after_record && record_is_gap(after_record)) {
-		uint32_t after_size = record_get_size(after_record);
-		if (after_size == grow) {
-			info->sz = new_sz;
-			return info;
-		}
-		if (after_size > grow) {
-			union record *new_gap =
-				(union record *)(store->filebase +
-				    offset + new_alloc);
-			record_init_gap(new_gap, after_size - grow);
+		uint32_t after_size = record_get_size(store, after_record);
+		if (after_size >= grow) {
+			store_gap_unlink(store, offset + old_alloc);
+			if (after_size > grow)
+				store_gap_make(store, offset + new_alloc,
+					after_size - grow);
 			info->sz = new_sz;
+			store->live += grow;
+			store_cursor_fix(store, offset, offset + new_alloc);
 			return info;
 		}
 	}
 
 	/* At this point it is clear we have to make the old info a gap */
-	if (after_record && record_is_gap(after_record))
-		record_init_gap((union record *)info,
-			old_alloc + record_get_size(after_record));
-	else
-		record_init_gap((union record *)info, old_alloc);
-	/* (store->index[i] is now an invalid pointer) */
-
-	if (new_alloc < store->filesz - store->space) {
-		/* A simple allocation in the space will work */
-		info = store->index[i] = store_file_alloc(store, new_sz);
+	store->live -= old_alloc;
+	store_gap_make(store, offset, old_alloc);
+	/* (node x's offset is now that of a gap, or of the space) */
+
+	if (new_alloc <= store->filesz - store->space ||
+	    store_gap_find(store, new_alloc) != NOGAP)
+	{
+		/* A simple allocation in a gap or the space will work */
+		info = store_file_alloc(store, new_sz);
+		store->node[x].offset = (char *)info - store->filebase;
 		return info;
 	}
 
-	/* delete index[i] properly */
-	store_index_delete(store, i);
+	/* The allocation may repack and rebuild the index,
+	 * so delete node x properly first */
+	store_hash_delete(store, x);
+	node_delete(store, x);
+	node_free(store, x);
+	store->n--;
 	info = store_file_alloc(store, new_sz);
 	if (!info)
 		return NULL;
 
-	/* Because the index will remain sorted, and the info will
-	 * have the same key, we can simply re-insert index[i].
-	 * It cannot return -1 because we'd just deleted an entry */
-
-	(void) store_index_insert(store, i);
-	store->index[i] = info;
+	/* Re-insert the info under the same key.
+	 * The node_alloc cannot fail because we'd just freed a node */
+	x = node_alloc(store, info);
+	store_info_insert(store, x, k);
 	return info;
 }
 
-static void
-store_info_free(struct store *store, unsigned int i)
+struct store *
+store_open(const char *filename)
 {
-	struct info *info = store->index[i];
-	store_file_dealloc(store, info);
-	store->index[i] = NULL;
+	return store_open_flags(filename, 0);
 }
 
 struct store *
-store_open(const char *filename)
+store_open_flags(const char *filename, unsigned int flags)
 {
 	struct store *store;
 	int fd;
@@ -702,10 +1793,29 @@ store_open(const char *filename)
 	if (!store)
 		return NULL;
 	store->n = 0;
-	store->max = 0;
-	store->index = NULL;
+	store->live = 0;
+	store->trailer = 0;
+	store->lazy = !!(flags & STORE_LAZY);
+	store->root = NIL;
+	store->free = NIL;
+	store->nnodes = 1;
+	store->maxnodes = 0;
+	store->node = NULL;
+	store->hashsize = 0;
+	store->hash = NULL;
+	store->compacting = 0;
+	store->compact = 0;
+	memset(&store->stats, 0, sizeof store->stats);
+	store_gaps_clear(store);
 	store->filebase = NULL;
 	store->fd = -1;
+	store->idxpath = malloc(strlen(filename) + sizeof ".idx");
+	if (!store->idxpath) {
+		free(store);
+		return NULL;
+	}
+	strcpy(store->idxpath, filename);
+	strcat(store->idxpath, ".idx");
 
 	fd = open(filename, O_RDWR | O_CREAT, 0666);
 	if (fd == -1)
@@ -716,6 +1826,12 @@ store_open(const char *filename)
 		goto fail;
 	fd = -1;
 
+	/* Checksums can only be turned on while there are no infos */
+	if ((flags & STORE_CRC) && !store->trailer && !store->n) {
+		store_header(store)->flags |= HEADER_CRC;
+		store->trailer = sizeof (uint32_t);
+	}
+
 	return store;
 fail:
 	if (fd != -1)
@@ -727,122 +1843,274 @@ fail:
 void
 store_close(struct store *store)
 {
-#if 0
-	for (unsigned int i = 0; i < store->n; i++)
-		free(store->index[i]);
-#endif
-	free(store->index);
+	free(store->node);
+	free(store->hash);
 	store_file_close(store);
 	if (store->fd != -1)
 		close(store->fd);
+	free(store->idxpath);
 	free(store);
 }
 
-/* Binary search to one more than the largest index into
- * store->index[] that has a key lexicographically
- * smaller than 'key'. In other words, find the slot
- * having the same key, or where the slot would be
- * if the key were in the info[] list. */
-static unsigned int
-store_find(const struct store *store, const char *key)
+int
+store_checkpoint(struct store *store)
 {
-	unsigned int a, b, m;
-	struct info **list = store->index;
+	struct header *header = store_header(store);
+	struct sidecar sc;
+	char *tmppath;
+	FILE *f;
+	uint32_t x;
+	int ok;
+
+	if (header->flags & HEADER_CLEAN)
+		return 0;		/* the sidecar is still current */
+
+	tmppath = malloc(strlen(store->idxpath) + sizeof ".tmp");
+	if (!tmppath)
+		return -1;
+	strcpy(tmppath, store->idxpath);
+	strcat(tmppath, ".tmp");
+
+	memset(&sc, 0, sizeof sc);
+	sc.magic = SIDECAR_MAGIC;
+	sc.nodesize = sizeof (struct node);
+	sc.nbins = GAP_NBINS;
+	sc.generation = header->generation + 1;
+	sc.filesz = store->filesz;
+	sc.space = store->space;
+	sc.live = store->live;
+	sc.n = store->n;
+	memcpy(sc.gapbin, store->gapbin, sizeof sc.gapbin);
+	sc.gapmap = store->gapmap;
+
+	/* Write the sidecar aside, then move it into place */
+	f = fopen(tmppath, "w");
+	if (!f)
+		goto fail;
+	ok = fwrite(&sc, sizeof sc, 1, f) == 1;
+	for (x = node_first(store, store->root); ok && x;
+	     x = node_next(store, x))
+		ok = fwrite(&store->node[x], sizeof store->node[x], 1, f) == 1;
+	if (fclose(f) != 0 || !ok)
+		goto fail_unlink;
+	if (rename(tmppath, store->idxpath) == -1)
+		goto fail_unlink;
+	free(tmppath);
+
+	/* Only now can the header vouch for the sidecar */
+	header->generation = sc.generation;
+	header->flags |= HEADER_CLEAN;
+	return 0;
+
+fail_unlink:
+	unlink(tmppath);
+fail:
+	free(tmppath);
+	return -1;
+}
 
-	a = 0;
-	b = store->n;
-	while ((m = (a + b) / 2) > a) {
-		int cmp = strcmp(key, list[m]->keyvalue);
+/* Searches the tree for the node having the key.
+ * Returns NIL if the key is not in the index, and then sets
+ * the optional *parentp and *dirp to where the key's node
+ * would be attached. */
+static uint32_t
+store_find(const struct store *store, const struct key *k,
+	uint32_t *parentp, int *dirp)
+{
+	const struct node *node = store->node;
+	uint32_t x = store->root;
+	uint32_t parent = NIL;
+	int dir = 0;
+
+	while (x) {
+		int cmp = node_keycmp(store, k, x);
 		if (cmp == 0)
-			break;
-		else if (cmp < 0)
-			b = m;
-		else
-			a = m + 1;
+			return x;
+		parent = x;
+		dir = cmp > 0;
+		x = node[x].child[dir];
+	}
+	if (parentp) {
+		*parentp = parent;
+		*dirp = dir;
 	}
-	if (m < b && strcmp(key, list[m]->keyvalue) > 0)
-		m++;
-	return m;
+	return NIL;
 }
 
-/* test if the i'th slot has the given key */
-static int
-store_eq(const struct store *store, unsigned int i, const char *key)
+/* Links the unlinked node x into the index under the new key.
+ * The hash index must have room for x. */
+static void
+store_info_insert(struct store *store, uint32_t x, const struct key *k)
 {
-	return i < store->n && strcmp(key, store->index[i]->keyvalue) == 0;
+	uint32_t parent;
+	int dir;
+	uint32_t found;
+
+	found = store_find(store, k, &parent, &dir);
+	assert(!found);
+	store->node[x].prefix = k->prefix;
+	store->node[x].hash = k->hash;
+	store->node[x].keylen = k->len;
+	node_insert(store, x, parent, dir);
+	store_hash_insert(store, x);
+	store->n++;
 }
 
 int
 store_put(struct store *store, uint16_t sz, const char *keyvalue)
 {
-	unsigned int i;
+	uint32_t x;
+	struct key k;
 	struct info *info;
 
 	/* See if we are replacing an existing key */
-	i = store_find(store, keyvalue);
-	if (store_eq(store, i, keyvalue)) {
-		if (store->index[i]->sz == sz &&
-		    memcmp(store->index[i]->keyvalue, keyvalue, sz) == 0)
-			return 0;
+	key_init(&k, keyvalue);
+	x = store_verify(store, store_hash_find(store, &k));
+	if (x) {
+		info = node_info(store, x);
+		if (info->sz == sz && memcmp(info->keyvalue, keyvalue, sz) == 0)
+			return 0;	/* unchanged, so still clean */
+	}
+	store_touch(store);
+	if (x) {
 		/* Resize the existing info (it may move) */
-		info = store_info_realloc(store, i, sz);
+		info = store_info_realloc(store, x, &k, sz);
 		if (!info)
 			return -1;
 	} else {
+		if (store_hash_ensure(store, store->n + 1) == -1)
+			return -1;
+		/* (Allocating may repack, which rebuilds the index) */
 		info = store_file_alloc(store, sz);
 		if (!info)
 			return -1;
-		if (store_index_insert(store, i) == -1) {
+		x = node_alloc(store, info);
+		if (!x) {
 			store_file_dealloc(store, info);
 			return -1;
 		}
-		store->index[i] = info;
+		store_info_insert(store, x, &k);
 	}
 
 	dprintf("put \"%.100s\" @ 0x%08zx\n", keyvalue,
 		(char *)info - store->filebase);
 	memcpy(info->keyvalue, keyvalue, sz);
+	info_set_crc(store, info);
+	store->node[x].flags &= ~NODE_UNVERIFIED;
+	store_compact(store);
 	return 1;
 }
 
+/* Removes a node and its info from the store */
+static void
+store_node_del(struct store *store, uint32_t x)
+{
+	store_touch(store);
+	store_file_dealloc(store, node_info(store, x));
+	store_hash_delete(store, x);
+	node_delete(store, x);
+	node_free(store, x);
+	store->n--;
+}
+
+/* Checks a node's info against its checksum, if not done already.
+ * An info that fails is deleted, as if it were never there.
+ * Returns x, or NIL if the info was deleted (or x was NIL). */
+static uint32_t
+store_verify(struct store *store, uint32_t x)
+{
+	if (!x || !(store->node[x].flags & NODE_UNVERIFIED))
+		return x;
+	if (info_crc_ok(store, node_info(store, x))) {
+		store->node[x].flags &= ~NODE_UNVERIFIED;
+		return x;
+	}
+	dprintf("bad checksum @ 0x%08zx\n", (size_t)store->node[x].offset);
+	store->stats.corrupt++;
+	store_node_del(store, x);
+	return NIL;
+}
+
 int
 store_del(struct store *store, const char *key)
 {
-	unsigned int i;
+	uint32_t x;
+	struct key k;
 
 	if (!key)
 		return 0;
-	i = store_find(store, key);
-	if (!store_eq(store, i, key))
+	key_init(&k, key);
+	x = store_hash_find(store, &k);
+	if (!x)
 		return 0;
 	dprintf("del \"%.100s\" @ 0x%08zx\n", key,
-		(char *)store->index[i] - store->filebase);
-	store_info_free(store, i);
-	store_index_delete(store, i);
+		(size_t)store->node[x].offset);
+	store_node_del(store, x);
+	store_compact(store);
 	return 1;
 }
 
 const struct info *
 store_get(struct store *store, const char *key)
 {
-	unsigned int i = store_find(store, key);
-	if (!store_eq(store, i, key))
+	uint32_t x;
+	struct key k;
+
+	key_init(&k, key);
+	x = store_verify(store, store_hash_find(store, &k));
+	if (!x)
 		return NULL;
-	return store->index[i];
+	return node_info(store, x);
 }
 
 const struct info *
 store_get_first(struct store *store, struct store_index *ix)
 {
-	ix->i = 0;
+	ix->i = node_first(store, store->root);
+	return store_get_next(store, ix);
+}
+
+const struct info *
+store_seek(struct store *store, const char *key, struct store_index *ix)
+{
+	uint32_t x = store->root;
+	struct key k;
+
+	/* Find the least node not less than the key */
+	key_init(&k, key);
+	ix->i = NIL;
+	while (x) {
+		if (node_keycmp(store, &k, x) <= 0) {
+			ix->i = x;
+			x = store->node[x].child[0];
+		} else
+			x = store->node[x].child[1];
+	}
 	return store_get_next(store, ix);
 }
 
 const struct info *
 store_get_next(struct store *store, struct store_index *ix)
 {
-	if (ix->i >= store->n)
-		return NULL;
-	return store->index[ix->i++];
+	uint32_t x;
+
+	/* (Deleting an info that fails its checksum leaves its
+	 * successor's node in place) */
+	while ((x = ix->i) != NIL) {
+		ix->i = node_next(store, x);
+		if (store_verify(store, x))
+			return node_info(store, x);
+	}
+	return NULL;
 }
 
+void
+store_get_stats(const struct store *store, struct store_stats *stats)
+{
+	*stats = store->stats;
+	stats->keys = store->n;
+	stats->filesz = store->filesz;
+	stats->used = store->space;
+	stats->live = store->live;
+	stats->checksums = store->trailer != 0;
+}
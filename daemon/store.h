@@ -6,6 +6,21 @@
  */
 struct store;
 
+/* Store statistics, for diagnostics */
+struct store_stats {
+	unsigned int keys;			/* number of infos */
+	uint32_t filesz;			/* size of the backing file */
+	uint32_t used;				/* bytes of file in use */
+	uint32_t live;				/* bytes of used holding infos */
+	unsigned long compactions;		/* completed compaction sweeps */
+	unsigned long repacks;			/* full, blocking repacks */
+	unsigned long grows;			/* times the file was extended */
+	uint64_t max_pause_ns;			/* longest compaction stall */
+	int sidecar;				/* opened from index sidecar */
+	int checksums;				/* infos carry checksums */
+	unsigned long corrupt;			/* infos failing checksum */
+};
+
 /* A <key,value> element */
 struct info {
 	uint16_t sz;				/* total size of key\0value */
@@ -14,8 +29,26 @@ struct info {
 
 /* On error, returns NULL and sets errno */
 struct store *store_open(const char *path);
+
+/* Flags for store_open_flags() */
+#define STORE_CRC	0x1	/* checksum infos, if the store is empty */
+#define STORE_LAZY	0x2	/* verify checksums on first read, not open */
+
+/* Opens a store as store_open() does.
+ * STORE_CRC only takes effect on a store without infos; afterwards
+ * the store keeps checksums, whatever flags it is opened with.
+ * Infos that fail their checksum are dropped. */
+struct store *store_open_flags(const char *path, unsigned int flags);
 void store_close(struct store *store);
 
+/* Saves the index next to the store (in path.idx) so that the next
+ * store_open() can skip rebuilding it, as long as the store is not
+ * changed in between. Call before a clean store_close(), and
+ * periodically if desired; it does nothing if the store is unchanged
+ * since the last checkpoint.
+ * On error, returns -1 and sets errno. */
+int store_checkpoint(struct store *store);
+
 /* Fetchs the last info put for the key, or NULL if not found.
  * A gotten pointer is very short lived, and is invalidated
  * on the next store_put() or store_del(). */
@@ -43,7 +76,19 @@ struct store_index {
  * Returns NULL if the store is empty.
  */
 const struct info *store_get_first(struct store *store, struct store_index *ix);
+/*
+ * Fetches the first info whose key is not less than the given key
+ * (in strcmp() order), so that all keys starting with some prefix
+ * can be visited by seeking to the prefix and then calling
+ * store_get_next() until a key no longer starts with it.
+ * Initialises the store_index as store_get_first() does.
+ * Returns NULL if there is no such info.
+ */
+const struct info *store_seek(struct store *store, const char *key,
+	struct store_index *ix);
 /* Fetches the next info in the store.
  * Returns NULL at the end of the store. */
 const struct info *store_get_next(struct store *store, struct store_index *ix);
 
+/* Fetches statistics about the store */
+void store_get_stats(const struct store *store, struct store_stats *stats);
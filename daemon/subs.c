@@ -0,0 +1,652 @@
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "list.h"
+#include "match.h"
+#include "subs.h"
+
+#define TRIE_MAXDEPTH	255	/* longest literal prefix indexed */
+#define TABLE_MINSIZE	64	/* hash tables' minimum size */
+#define OWN_MINSIZE	8	/* subscriber tables' minimum size */
+#define RESULT_MINSIZE	16	/* result array's minimum size */
+#define CACHE_SETS	128	/* cache size, in sets; a power of 2 */
+#define CACHE_WAYS	2	/* keys with the same hash bits kept */
+
+/* A distinct pattern, shared by all the subscriptions to it */
+struct pattern {
+	LINK(struct pattern);		/* in a trie node, exact or residual */
+	struct pattern *hnext;		/* next in the same intern bucket */
+	struct sub *subs;		/* subscriptions to this pattern */
+	unsigned int refs;		/* number of subs */
+	struct trie *node;		/* trie node holding it, or NULL */
+	uint32_t hash;			/* hash of key */
+	uint32_t texthash;		/* hash of text */
+	const char *key;		/* unescaped pattern, if it is literal */
+	const char *prog;		/* compiled pattern, if not literal */
+	char text[];			/* followed by key or prog */
+};
+
+/* A subscription of one subscriber to one pattern */
+struct sub {
+	LINK(struct sub);		/* in its pattern's subs */
+	struct sub *hnext;		/* next in the subscriber's bucket */
+	struct subscriber *subscriber;
+	struct pattern *pattern;
+	unsigned long udata;		/* the caller's */
+};
+
+/* A node of the prefix trie. The node's prefix is the string of
+ * bytes on the path to it from the root. */
+struct trie {
+	struct trie *parent;
+	struct trie *child;		/* first child */
+	struct trie *sibling;		/* next child of the same parent */
+	struct pattern *patterns;	/* patterns with exactly this prefix */
+	unsigned char c;		/* last byte of the prefix */
+};
+
+/* A remembered result of subs_match() */
+struct cached {
+	unsigned long generation;	/* subs->generation when filled */
+	unsigned long used;		/* subs->mark when last used */
+	uint32_t hash;			/* hash of key */
+	char *key;
+	size_t keysz;			/* allocated size of key */
+	struct subscriber **result;
+	unsigned int n;
+	unsigned int maxresult;
+};
+
+struct subs {
+	struct trie root;		/* prefix trie of non-literal patterns */
+	struct pattern *residual;	/* patterns with an empty prefix */
+
+	/* All patterns, by text, in a chained hash table */
+	struct pattern **intern;
+	unsigned int internsize;	/* a power of 2 */
+	unsigned int npatterns;
+
+	/* Literal patterns, by key, in a chained hash table */
+	struct pattern **exact;
+	unsigned int exactsize;		/* a power of 2 */
+	unsigned int nexact;
+
+	/* Subscribers found by subs_match() */
+	unsigned long mark;		/* incremented on each match */
+	struct subscriber **result;
+	unsigned int maxresult;
+
+	/* Recent results, valid while the generation is unchanged */
+	unsigned long generation;	/* incremented on add and remove */
+	struct cached cache[CACHE_SETS][CACHE_WAYS];
+};
+
+/* FNV-1a hash of a key or pattern */
+static uint32_t
+key_hash(const char *key)
+{
+	uint32_t h = 2166136261u;
+
+	while (*key)
+		h = (h ^ (unsigned char)*key++) * 16777619u;
+	return h;
+}
+
+struct subs *
+subs_new(void)
+{
+	struct subs *subs = calloc(1, sizeof (struct subs));
+
+	if (subs)
+		subs->generation = 1;	/* empty cache entries are stale */
+	return subs;
+}
+
+void
+subs_free(struct subs *subs)
+{
+	unsigned int i, j;
+
+	if (!subs)
+		return;
+	for (i = 0; i < CACHE_SETS; i++)
+		for (j = 0; j < CACHE_WAYS; j++) {
+			free(subs->cache[i][j].key);
+			free(subs->cache[i][j].result);
+		}
+	free(subs->intern);
+	free(subs->exact);
+	free(subs->result);
+	free(subs);
+}
+
+/* Ensures the exact table has room for one more pattern */
+static int
+exact_ensure(struct subs *subs)
+{
+	struct pattern **exact;
+	unsigned int size, i;
+
+	if (subs->nexact < subs->exactsize)
+		return 0;
+	size = subs->exactsize ? subs->exactsize * 2 : TABLE_MINSIZE;
+	exact = calloc(size, sizeof *exact);
+	if (!exact)
+		return -1;
+	for (i = 0; i < subs->exactsize; i++) {
+		struct pattern *pat;
+
+		while ((pat = subs->exact[i])) {
+			REMOVE(pat);
+			INSERT(pat, &exact[pat->hash & (size - 1)]);
+		}
+	}
+	free(subs->exact);
+	subs->exact = exact;
+	subs->exactsize = size;
+	return 0;
+}
+
+/* Ensures the intern table has room for one more pattern */
+static int
+intern_ensure(struct subs *subs)
+{
+	struct pattern **intern;
+	unsigned int size, i;
+
+	if (subs->npatterns < subs->internsize)
+		return 0;
+	size = subs->internsize ? subs->internsize * 2 : TABLE_MINSIZE;
+	intern = calloc(size, sizeof *intern);
+	if (!intern)
+		return -1;
+	for (i = 0; i < subs->internsize; i++) {
+		struct pattern *pat, *next;
+
+		for (pat = subs->intern[i]; pat; pat = next) {
+			struct pattern **bucket =
+				&intern[pat->texthash & (size - 1)];
+
+			next = pat->hnext;
+			pat->hnext = *bucket;
+			*bucket = pat;
+		}
+	}
+	free(subs->intern);
+	subs->intern = intern;
+	subs->internsize = size;
+	return 0;
+}
+
+/* Finds an interned pattern by its text, or returns NULL */
+static struct pattern *
+intern_find(const struct subs *subs, const char *text, uint32_t texthash)
+{
+	struct pattern *pat = NULL;
+
+	if (subs->npatterns)
+		for (pat = subs->intern[texthash & (subs->internsize - 1)];
+		     pat; pat = pat->hnext)
+			if (pat->texthash == texthash &&
+			    strcmp(pat->text, text) == 0)
+				break;
+	return pat;
+}
+
+/* Frees the empty nodes on the path from node up to the root */
+static void
+trie_prune(struct subs *subs, struct trie *node)
+{
+	while (node != &subs->root && !node->patterns && !node->child) {
+		struct trie *parent = node->parent;
+		struct trie **np = &parent->child;
+
+		while (*np != node)
+			np = &(*np)->sibling;
+		*np = node->sibling;
+		free(node);
+		node = parent;
+	}
+}
+
+/* Finds the child of a node for the next byte of a prefix */
+static struct trie *
+trie_child(const struct trie *node, unsigned char c)
+{
+	struct trie *child;
+
+	for (child = node->child; child; child = child->sibling)
+		if (child->c == c)
+			break;
+	return child;
+}
+
+/* Finds or creates the trie node for a prefix.
+ * Returns NULL on allocation failure. */
+static struct trie *
+trie_get(struct subs *subs, const char *prefix, size_t len)
+{
+	struct trie *node = &subs->root;
+
+	while (len--) {
+		unsigned char c = *prefix++;
+		struct trie *child = trie_child(node, c);
+
+		if (!child) {
+			child = calloc(1, sizeof *child);
+			if (!child) {
+				trie_prune(subs, node);
+				return NULL;
+			}
+			child->parent = node;
+			child->c = c;
+			child->sibling = node->child;
+			node->child = child;
+		}
+		node = child;
+	}
+	return node;
+}
+
+/* Creates and indexes a new pattern. Returns NULL on error. */
+static struct pattern *
+pattern_new(struct subs *subs, const char *text, uint32_t texthash)
+{
+	size_t textlen = strlen(text);
+	size_t progsz = 0;
+	int literal;
+	struct pattern *pat;
+	struct pattern **bucket;
+	char *p;
+
+	if (!match_isvalid(text)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	literal = match_isliteral(text);
+	if (!literal)
+		progsz = match_compile(text, NULL, 0);
+	if (intern_ensure(subs) == -1)
+		return NULL;
+	if (literal && exact_ensure(subs) == -1)
+		return NULL;
+
+	pat = malloc(sizeof *pat + textlen + 1 +
+		(literal ? textlen + 1 : progsz));
+	if (!pat)
+		return NULL;
+	pat->subs = NULL;
+	pat->refs = 0;
+	pat->node = NULL;
+	pat->texthash = texthash;
+	pat->key = NULL;
+	pat->prog = NULL;
+	memcpy(pat->text, text, textlen + 1);
+	p = pat->text + textlen + 1;
+
+	if (literal) {
+		match_prefix(text, p, textlen + 1);
+		pat->key = p;
+		pat->hash = key_hash(p);
+		INSERT(pat, &subs->exact[pat->hash & (subs->exactsize - 1)]);
+		subs->nexact++;
+	} else {
+		char prefix[TRIE_MAXDEPTH + 1];
+		size_t len = match_prefix(text, prefix, sizeof prefix);
+
+		match_compile(text, p, progsz);
+		pat->prog = p;
+		if (!len)
+			INSERT(pat, &subs->residual);
+		else {
+			pat->node = trie_get(subs, prefix, len);
+			if (!pat->node) {
+				free(pat);
+				return NULL;
+			}
+			INSERT(pat, &pat->node->patterns);
+		}
+	}
+
+	bucket = &subs->intern[texthash & (subs->internsize - 1)];
+	pat->hnext = *bucket;
+	*bucket = pat;
+	subs->npatterns++;
+	return pat;
+}
+
+/* Unindexes and frees a pattern that has no more subs */
+static void
+pattern_free(struct subs *subs, struct pattern *pat)
+{
+	struct pattern **pp;
+
+	pp = &subs->intern[pat->texthash & (subs->internsize - 1)];
+	while (*pp != pat)
+		pp = &(*pp)->hnext;
+	*pp = pat->hnext;
+	subs->npatterns--;
+
+	REMOVE(pat);
+	if (pat->key)
+		subs->nexact--;
+	if (pat->node)
+		trie_prune(subs, pat->node);
+	free(pat);
+}
+
+/* Ensures a subscriber's own table has room for one more sub */
+static int
+own_ensure(struct subscriber *subscriber)
+{
+	struct sub **table;
+	unsigned int size, i;
+
+	if (subscriber->nsubs < subscriber->tablesize)
+		return 0;
+	size = subscriber->tablesize ? subscriber->tablesize * 2
+				     : OWN_MINSIZE;
+	table = calloc(size, sizeof *table);
+	if (!table)
+		return -1;
+	for (i = 0; i < subscriber->tablesize; i++) {
+		struct sub *sub, *next;
+
+		for (sub = subscriber->table[i]; sub; sub = next) {
+			struct sub **bucket =
+				&table[sub->pattern->texthash & (size - 1)];
+
+			next = sub->hnext;
+			sub->hnext = *bucket;
+			*bucket = sub;
+		}
+	}
+	free(subscriber->table);
+	subscriber->table = table;
+	subscriber->tablesize = size;
+	return 0;
+}
+
+/* Frees a subscriber's own table once it holds no subs */
+static void
+own_release(struct subscriber *subscriber)
+{
+	if (subscriber->nsubs)
+		return;
+	free(subscriber->table);
+	subscriber->table = NULL;
+	subscriber->tablesize = 0;
+}
+
+struct sub *
+subs_add(struct subs *subs, struct subscriber *subscriber,
+	const char *pattern)
+{
+	uint32_t texthash = key_hash(pattern);
+	struct pattern *pat;
+	struct sub *sub, **bucket;
+
+	if (own_ensure(subscriber) == -1)
+		return NULL;
+	sub = malloc(sizeof *sub);
+	if (!sub) {
+		own_release(subscriber);
+		return NULL;
+	}
+	pat = intern_find(subs, pattern, texthash);
+	if (!pat)
+		pat = pattern_new(subs, pattern, texthash);
+	if (!pat) {
+		free(sub);
+		own_release(subscriber);
+		return NULL;
+	}
+	sub->subscriber = subscriber;
+	sub->pattern = pat;
+	sub->udata = 0;
+	INSERT(sub, &pat->subs);
+	pat->refs++;
+
+	bucket = &subscriber->table[texthash & (subscriber->tablesize - 1)];
+	sub->hnext = *bucket;
+	*bucket = sub;
+	subscriber->nsubs++;
+
+	subs->generation++;
+	return sub;
+}
+
+void
+subs_remove(struct subs *subs, struct sub *sub)
+{
+	struct pattern *pat = sub->pattern;
+	struct subscriber *subscriber = sub->subscriber;
+	struct sub **sp;
+
+	sp = &subscriber->table[pat->texthash &
+		(subscriber->tablesize - 1)];
+	while (*sp != sub)
+		sp = &(*sp)->hnext;
+	*sp = sub->hnext;
+	subscriber->nsubs--;
+	own_release(subscriber);
+
+	REMOVE(sub);
+	free(sub);
+	if (--pat->refs == 0)
+		pattern_free(subs, pat);
+	subs->generation++;
+}
+
+void
+subs_remove_all(struct subs *subs, struct subscriber *subscriber)
+{
+	unsigned int i = 0;
+
+	while (subscriber->nsubs) {
+		while (!subscriber->table[i])
+			i++;
+		subs_remove(subs, subscriber->table[i]);
+	}
+}
+
+struct sub *
+subs_find(const struct subscriber *subscriber, const char *pattern)
+{
+	uint32_t texthash;
+	struct sub *sub = NULL;
+
+	if (subscriber->nsubs) {
+		texthash = key_hash(pattern);
+		for (sub = subscriber->table[texthash &
+			(subscriber->tablesize - 1)]; sub; sub = sub->hnext)
+			if (sub->pattern->texthash == texthash &&
+			    strcmp(sub->pattern->text, pattern) == 0)
+				break;
+	}
+	return sub;
+}
+
+struct sub *
+subs_next(const struct subscriber *subscriber, const struct sub *prev)
+{
+	unsigned int i = 0;
+
+	if (prev) {
+		if (prev->hnext)
+			return prev->hnext;
+		i = (prev->pattern->texthash & (subscriber->tablesize - 1)) + 1;
+	}
+	for (; i < subscriber->tablesize; i++)
+		if (subscriber->table[i])
+			return subscriber->table[i];
+	return NULL;
+}
+
+void
+subs_set_udata(struct sub *sub, unsigned long udata)
+{
+	sub->udata = udata;
+}
+
+unsigned long
+subs_get_udata(const struct sub *sub)
+{
+	return sub->udata;
+}
+
+const char *
+subs_pattern(const struct sub *sub)
+{
+	return sub->pattern->text;
+}
+
+int
+subs_test(const struct sub *sub, const char *key)
+{
+	const struct pattern *pat = sub->pattern;
+
+	if (pat->key)
+		return strcmp(pat->key, key) == 0;
+	return match_prog(pat->prog, key);
+}
+
+/* Adds a subscriber to the result, unless it is already there */
+static int
+result_add(struct subs *subs, struct subscriber *subscriber,
+	unsigned int *np)
+{
+	if (subscriber->mark == subs->mark)
+		return 0;
+	if (*np == subs->maxresult) {
+		unsigned int max = subs->maxresult ? subs->maxresult * 2
+						   : RESULT_MINSIZE;
+		struct subscriber **result = realloc(subs->result,
+			max * sizeof *result);
+		if (!result)
+			return -1;
+		subs->result = result;
+		subs->maxresult = max;
+	}
+	subscriber->mark = subs->mark;
+	subs->result[(*np)++] = subscriber;
+	return 0;
+}
+
+/* Adds all the subscribers of a matched pattern */
+static int
+fan_out(struct subs *subs, const struct pattern *pat, unsigned int *np)
+{
+	const struct sub *sub;
+
+	for (sub = pat->subs; sub; sub = NEXT(sub))
+		if (result_add(subs, sub->subscriber, np) == -1)
+			return -1;
+	return 0;
+}
+
+/* Tests a list of patterns against a key, adding their subscribers */
+static int
+match_list(struct subs *subs, const struct pattern *pat, const char *key,
+	unsigned int *np)
+{
+	for (; pat; pat = NEXT(pat))
+		if (match_prog(pat->prog, key) &&
+		    fan_out(subs, pat, np) == -1)
+			return -1;
+	return 0;
+}
+
+/* Remembers the result just found for a key, if memory allows,
+ * in place of a stale or the least recently used entry of its set */
+static void
+cache_fill(struct subs *subs, struct cached *set, uint32_t hash,
+	const char *key, unsigned int n)
+{
+	size_t keysz = strlen(key) + 1;
+	struct cached *c = set;
+	unsigned int i;
+
+	for (i = 1; i < CACHE_WAYS; i++)
+		if (c->generation == subs->generation &&
+		    (set[i].generation != subs->generation ||
+		     set[i].used < c->used))
+			c = &set[i];
+
+	if (keysz > c->keysz) {
+		char *newkey = realloc(c->key, keysz);
+		if (!newkey)
+			return;
+		c->key = newkey;
+		c->keysz = keysz;
+	}
+	if (n > c->maxresult) {
+		struct subscriber **result = realloc(c->result,
+			n * sizeof *result);
+		if (!result)
+			return;
+		c->result = result;
+		c->maxresult = n;
+	}
+	memcpy(c->key, key, keysz);
+	if (n)
+		memcpy(c->result, subs->result, n * sizeof *c->result);
+	c->n = n;
+	c->hash = hash;
+	c->generation = subs->generation;
+	c->used = subs->mark;
+}
+
+int
+subs_match(struct subs *subs, const char *key,
+	struct subscriber *const **result)
+{
+	const struct trie *node = &subs->root;
+	const char *k;
+	unsigned int n = 0;
+	uint32_t hash = key_hash(key);
+	struct cached *set = subs->cache[hash & (CACHE_SETS - 1)];
+	unsigned int i;
+
+	subs->mark++;
+
+	for (i = 0; i < CACHE_WAYS; i++) {
+		struct cached *c = &set[i];
+
+		if (c->generation == subs->generation && c->hash == hash &&
+		    strcmp(c->key, key) == 0)
+		{
+			c->used = subs->mark;
+			*result = c->result;
+			return c->n;
+		}
+	}
+
+	if (subs->nexact) {
+		const struct pattern *pat;
+
+		for (pat = subs->exact[hash & (subs->exactsize - 1)]; pat;
+		     pat = NEXT(pat))
+			if (pat->hash == hash && strcmp(pat->key, key) == 0 &&
+			    fan_out(subs, pat, &n) == -1)
+				return -1;
+	}
+
+	/* Walk down the trie along the key */
+	for (k = key; *k; k++) {
+		node = trie_child(node, *k);
+		if (!node)
+			break;
+		if (match_list(subs, node->patterns, key, &n) == -1)
+			return -1;
+	}
+
+	if (match_list(subs, subs->residual, key, &n) == -1)
+		return -1;
+
+	cache_fill(subs, set, hash, key, n);
+	*result = subs->result;
+	return n;
+}
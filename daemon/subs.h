@@ -0,0 +1,85 @@
+#pragma once
+
+/*
+ * A server-wide index of subscriptions, so that finding the clients
+ * interested in a changed key only tests the patterns that could
+ * match it:
+ *
+ *   - patterns without metacharacters are found by a hash lookup;
+ *   - patterns with a literal prefix hang off a trie of prefixes,
+ *     and only those along the key's path through the trie are
+ *     tested;
+ *   - patterns starting with a metacharacter are always tested.
+ *
+ * Identical patterns are interned: each distinct pattern is held and
+ * tested once, however many clients subscribe to it, and a match fans
+ * out to its list of subscribers.
+ *
+ * The results for recently matched keys are cached until the next
+ * subscription is added or removed, so a hot key is usually found
+ * with one lookup.
+ */
+
+struct subs;
+struct sub;
+
+/* A subscribing client. The caller provides one per client,
+ * with all but udata initially zero. */
+struct subscriber {
+	void *udata;			/* the caller's client */
+	/* private */
+	unsigned long mark;		/* last match seen in */
+	struct sub **table;		/* own subs, hashed by pattern */
+	unsigned int tablesize;		/* a power of 2 */
+	unsigned int nsubs;
+};
+
+/* Returns NULL on allocation failure */
+struct subs *subs_new(void);
+/* Frees the index. All subscriptions must have been removed. */
+void subs_free(struct subs *subs);
+
+/*
+ * Subscribes a client to a valid pattern.
+ * The returned handle stays valid until passed to subs_remove().
+ * On error, returns NULL and sets errno.
+ */
+struct sub *subs_add(struct subs *subs, struct subscriber *subscriber,
+	const char *pattern);
+/* Removes a subscription */
+void subs_remove(struct subs *subs, struct sub *sub);
+/* Removes all of a subscriber's subscriptions */
+void subs_remove_all(struct subs *subs, struct subscriber *subscriber);
+
+/* Finds one of a subscriber's subscriptions to a pattern, or NULL */
+struct sub *subs_find(const struct subscriber *subscriber,
+	const char *pattern);
+
+/* Iterates over a subscriber's subscriptions, in no particular order.
+ * Pass prev as NULL for the first. Returns NULL after the last. */
+struct sub *subs_next(const struct subscriber *subscriber,
+	const struct sub *prev);
+
+/* Sets and gets a value kept for the caller with a subscription.
+ * It is initially 0. */
+void subs_set_udata(struct sub *sub, unsigned long udata);
+unsigned long subs_get_udata(const struct sub *sub);
+
+/* Returns the pattern of a subscription */
+const char *subs_pattern(const struct sub *sub);
+
+/* Tests if a key matches a subscription's pattern */
+int subs_test(const struct sub *sub, const char *key);
+
+/*
+ * Finds the subscribers with a subscription matching the key.
+ * Each subscriber appears once, however many of its subscriptions
+ * match. The returned array is valid until the next call to
+ * subs_match(), subs_add(), subs_remove() or subs_free() on the same
+ * subs; other subs_ functions, such as subs_next() and subs_test(),
+ * leave it alone.
+ * Returns the number of subscribers found. On allocation error,
+ * returns -1 and sets errno.
+ */
+int subs_match(struct subs *subs, const char *key,
+	struct subscriber *const **result);
@@ -0,0 +1,34 @@
+#include <assert.h>
+#include <string.h>
+#include "crc32c.h"
+
+int
+main()
+{
+	static const unsigned char zeros[32];
+	unsigned char buf[300];
+	unsigned int i, len, split;
+
+	/* Known check values */
+	assert(crc32c(0, "", 0) == 0);
+	assert(crc32c(0, "123456789", 9) == 0xe3069283);
+	assert(crc32c_sw(0, "123456789", 9) == 0xe3069283);
+	assert(crc32c(0, zeros, sizeof zeros) == 0x8a9136aa);
+	assert(crc32c_sw(0, zeros, sizeof zeros) == 0x8a9136aa);
+
+	/* Both implementations agree on every length and alignment,
+	 * and a checksum may be continued at any split */
+	for (i = 0; i < sizeof buf; i++)
+		buf[i] = i * 7 + (i >> 3);
+	for (len = 0; len < 40; len++)
+		for (i = 0; i < 8; i++) {
+			uint32_t crc = crc32c_sw(0, buf + i, len);
+
+			assert(crc32c(0, buf + i, len) == crc);
+			for (split = 0; split <= len; split++)
+				assert(crc32c(crc32c(0, buf + i, split),
+				    buf + i + split, len - split) == crc);
+		}
+	assert(crc32c(0, buf, sizeof buf) == crc32c_sw(0, buf, sizeof buf));
+	return 0;
+}
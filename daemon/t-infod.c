@@ -0,0 +1,170 @@
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../lib/proto.h"
+#include "../lib/sockunix.h"
+
+/*
+ * End-to-end tests of a private ./infod, spoken to over its
+ * unix socket in the framed binary protocol.
+ */
+
+#define INTERVAL	"200"	/* SUB interval used, in ms */
+#define PAUSE		400000	/* us for an interval to surely end */
+
+static char db_path[256];
+static char idx_path[256 + 4];
+static char sock_path[256];
+static pid_t infod_pid;
+
+static void
+cleanup(void)
+{
+	if (infod_pid > 0) {
+		kill(infod_pid, SIGTERM);
+		waitpid(infod_pid, NULL, 0);
+	}
+	unlink(db_path);
+	unlink(idx_path);
+	unlink(sock_path);
+}
+
+/* Starts infod, and returns a connection to it */
+static int
+start_infod(void)
+{
+	int fd, i;
+
+	snprintf(db_path, sizeof db_path, "/tmp/t-infod.%d.db", getpid());
+	snprintf(idx_path, sizeof idx_path, "%s.idx", db_path);
+	snprintf(sock_path, sizeof sock_path, "/tmp/t-infod.%d.socket",
+		getpid());
+	setenv("INFOD_SOCKET", sock_path, 1);
+	unlink(db_path);
+	unlink(idx_path);
+	atexit(cleanup);
+
+	infod_pid = fork();
+	assert(infod_pid != -1);
+	if (!infod_pid) {
+		execl("./infod", "infod", "-f", db_path, (char *)NULL);
+		perror("./infod");
+		_exit(1);
+	}
+	for (i = 0; i < 500; i++) {
+		fd = sockunix_connect();
+		if (fd != -1)
+			return fd;
+		usleep(10000);
+	}
+	perror("sockunix_connect");
+	exit(1);
+}
+
+static void
+send_msg(int fd, unsigned char msg, const char *data, unsigned int len)
+{
+	char buf[256];
+
+	assert(len < sizeof buf);
+	buf[0] = msg;
+	memcpy(buf + 1, data, len);
+	assert(send(fd, buf, len + 1, 0) == len + 1);
+}
+#define SEND(fd, msg, s) send_msg(fd, msg, s, sizeof s - 1)
+
+/* Receives the next message, and checks that it is as expected */
+static void
+expect_msg(int fd, unsigned char msg, const char *data, unsigned int len)
+{
+	struct pollfd pfd;
+	char buf[256];
+	ssize_t n;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	assert(poll(&pfd, 1, 2000) == 1);
+	n = recv(fd, buf, sizeof buf, 0);
+	if (n != len + 1 || (unsigned char)buf[0] != msg ||
+	    memcmp(buf + 1, data, len) != 0)
+	{
+		fprintf(stderr, "expected <%02x>%.*s, got <%02x>%.*s\n",
+			msg, (int)len, data, n > 0 ? buf[0] & 0xff : 0,
+			n > 1 ? (int)n - 1 : 0, buf + 1);
+		exit(1);
+	}
+}
+#define EXPECT(fd, msg, s) expect_msg(fd, msg, s, sizeof s - 1)
+
+/* Checks that nothing else is sent before a PONG */
+#define EXPECT_QUIET(fd) do { \
+		SEND(fd, CMD_PING, "quiet"); \
+		EXPECT(fd, MSG_PONG, "quiet"); \
+	} while (0)
+
+int
+main()
+{
+	int fd;
+
+	signal(SIGPIPE, SIG_IGN);
+	fd = start_infod();
+	SEND(fd, CMD_HELLO, "\1");
+	EXPECT(fd, MSG_VERSION, "\1" "infod3");
+
+	/* A change within the interval is held, then sent */
+	SEND(fd, CMD_SUB, "b\0" INTERVAL);
+	SEND(fd, CMD_WRITE, "b\0" "1");
+	EXPECT(fd, MSG_INFO, "b\0" "1");
+	SEND(fd, CMD_WRITE, "b\0" "2");
+	SEND(fd, CMD_WRITE, "b\0" "3");
+	EXPECT_QUIET(fd);
+	usleep(PAUSE);
+	EXPECT(fd, MSG_INFO, "b\0" "3");
+	SEND(fd, CMD_UNSUB, "b");
+
+	/* A held change is dropped by UNSUB */
+	SEND(fd, CMD_SUB, "a\0" INTERVAL);
+	SEND(fd, CMD_WRITE, "a\0" "1");
+	EXPECT(fd, MSG_INFO, "a\0" "1");
+	SEND(fd, CMD_WRITE, "a\0" "2");
+	SEND(fd, CMD_UNSUB, "a");
+	usleep(PAUSE);
+	EXPECT_QUIET(fd);
+
+	/* A held change is dropped once a later one is sent without
+	 * an interval */
+	SEND(fd, CMD_SUB, "a\0" INTERVAL);
+	EXPECT(fd, MSG_INFO, "a\0" "2");
+	SEND(fd, CMD_WRITE, "a\0" "3");
+	EXPECT(fd, MSG_INFO, "a\0" "3");
+	SEND(fd, CMD_WRITE, "a\0" "4");
+	SEND(fd, CMD_SUB, "a*");
+	EXPECT(fd, MSG_INFO, "a\0" "4");
+	SEND(fd, CMD_WRITE, "a\0" "5");
+	EXPECT(fd, MSG_INFO, "a\0" "5");
+	usleep(PAUSE);
+	EXPECT_QUIET(fd);
+
+	/* A held change is dropped once a SUB sends the current value */
+	SEND(fd, CMD_SUB, "c\0" INTERVAL);
+	SEND(fd, CMD_WRITE, "c\0" "1");
+	EXPECT(fd, MSG_INFO, "c\0" "1");
+	SEND(fd, CMD_WRITE, "c\0" "2");
+	SEND(fd, CMD_SUB, "c*\0" INTERVAL);
+	EXPECT(fd, MSG_INFO, "c\0" "2");
+	usleep(PAUSE);
+	EXPECT_QUIET(fd);
+
+	close(fd);
+	return 0;
+}
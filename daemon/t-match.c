@@ -1,18 +1,89 @@
 #include <assert.h>
+#include <stdlib.h>
+#include <string.h>
 #include "match.h"
 
+/* Matches the string with the pattern compiled */
+static int
+match_compiled(const char *pattern, const char *string)
+{
+	size_t progsz = match_compile(pattern, NULL, 0);
+	char *prog;
+	int ret;
+
+	assert(progsz);
+	prog = malloc(progsz);
+	assert(prog);
+	assert(match_compile(pattern, prog, progsz) == progsz);
+	ret = match_prog(prog, string);
+	free(prog);
+	return ret;
+}
+
+/* Builds a random string of up to max pieces */
+static void
+random_string(char *buf, const char *const *pieces, unsigned int npieces,
+	unsigned int max, unsigned long *seed)
+{
+	unsigned int n;
+
+	*buf = '\0';
+	*seed = *seed * 1103515245 + 12345;
+	for (n = (*seed >> 16) % (max + 1); n; n--) {
+		*seed = *seed * 1103515245 + 12345;
+		strcat(buf, pieces[(*seed >> 16) % npieces]);
+	}
+}
+
+/* Compares the compiled matcher with match() on random inputs */
+static void
+fuzz(void)
+{
+	static const char *const pattern_pieces[] = {
+		"a", "b", ".", "*", "?", "(", "|", ")", "\\", "€", "せ",
+		"\xe2", "\x82"
+	};
+	static const char *const string_pieces[] = {
+		"a", "b", ".", "*", "€", "せ", "\xe2", "\x82", "\xac",
+		"\xe2\x82"
+	};
+	char pattern[64], string[64], prog[1024];
+	unsigned long seed = 1;
+	unsigned int i;
+
+	for (i = 0; i < 300000; i++) {
+		random_string(pattern, pattern_pieces,
+			sizeof pattern_pieces / sizeof *pattern_pieces, 8, &seed);
+		random_string(string, string_pieces,
+			sizeof string_pieces / sizeof *string_pieces, 8, &seed);
+		if (!match_isvalid(pattern))
+			continue;
+		assert(match_compile(pattern, prog, sizeof prog) <=
+		    sizeof prog);
+		assert(match_prog(prog, string) == match(pattern, string));
+	}
+}
+
 #define PASS(pattern, string) \
 	assert(match_isvalid(pattern)); \
-	assert(match(pattern, string))
+	assert(match(pattern, string)); \
+	assert(match_compiled(pattern, string))
 #define FAIL(pattern, string) \
 	assert(match_isvalid(pattern)); \
-	assert(!match(pattern, string))
+	assert(!match(pattern, string)); \
+	assert(!match_compiled(pattern, string))
 #define INVALID(pattern) \
-	assert(!match_isvalid(pattern))
+	assert(!match_isvalid(pattern)); \
+	assert(!match_compile(pattern, NULL, 0))
+#define PREFIX(pattern, expected) \
+	assert(match_prefix(pattern, buf, sizeof buf) == strlen(expected)); \
+	assert(strcmp(buf, expected) == 0)
 
 int
 main()
 {
+	char buf[8];
+
 	/* Simple */
 	PASS("", "");
 	PASS("x", "x");
@@ -63,6 +134,9 @@ main()
 	PASS("x??y", "xせんy");
 	PASS("x*y", "xせんy");
 	PASS("x*€", "xせ₫€");
+	PASS("*€.", "₫€.");	/* same lead byte, different char */
+	FAIL("*€", "₫");
+	FAIL("*€x", "₫x");
 
 	/* Parentheses match */
 	PASS("()", "");		FAIL("()", "x");
@@ -77,6 +151,26 @@ main()
 	PASS("(a|b(c|d)e|f)g", "bdeg");
 	FAIL("(a|b(c|d)e|f)g", "beg");
 	FAIL("(a|b(c|d)e|f)g", "bfg");
+	PASS("((a|b)|(c|(d|e)))x", "ex");
+	FAIL("((a|b)|(c|(d|e)))x", "fx");
+
+	/* The first alternative to match is taken, without backtracking */
+	PASS("(a|ab)b", "ab");
+	FAIL("(a|ab)c", "abc");
+	PASS("(x*|y)", "xyz");
+	PASS("a(*|b)", "abc");
+	PASS("(*.|x)y", "a.y");
+
+	/* Escaped character after a wildcard */
+	PASS("*\\.x", "a.x");
+	PASS("*\\*", "ab*");
+	FAIL("*\\.x", "ax");
+
+	/* Dotted keys */
+	PASS("net.eth*.rx", "net.eth0.rx");
+	FAIL("net.eth*.rx", "net.eth0.tx");
+	PASS("net.(eth|wlan)?.*", "net.wlan1.tx_bytes");
+	FAIL("net.(eth|wlan)?.*", "net.lo.tx_bytes");
 
 	/* Malformed */
 	INVALID("(");
@@ -84,4 +178,31 @@ main()
 	INVALID("|");
 	INVALID("\\");
 	INVALID("**");
+
+	/* Long literals */
+	{
+		char pattern[600], string[600];
+
+		memset(pattern, 'a', sizeof pattern - 1);
+		pattern[sizeof pattern - 1] = '\0';
+		strcpy(string, pattern);
+		PASS(pattern, string);
+		string[550] = 'b';
+		FAIL(pattern, string);
+		string[550] = '\0';
+		FAIL(pattern, string);
+	}
+
+	/* Literal prefixes */
+	PREFIX("", "");
+	PREFIX("abc", "abc");
+	PREFIX("a.b*", "a.b");
+	PREFIX("*abc", "");
+	PREFIX("ab?d", "ab");
+	PREFIX("ab(c|d)", "ab");
+	PREFIX("a\\*b*", "a*b");
+	PREFIX("abcdefghij", "abcdefg");	/* cut short to fit buf */
+	assert(match_prefix("abc", buf, 1) == 0 && !*buf);
+
+	fuzz();
 }
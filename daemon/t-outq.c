@@ -0,0 +1,239 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "outq.h"
+
+/* Collects flushed notifications into a buffer, separated by ';' */
+struct collect {
+	char buf[256];
+	unsigned int len;
+	struct outq *q;			/* if set, flushes it again */
+};
+
+static int
+collect(void *arg, const char *data, unsigned int datalen)
+{
+	struct collect *c = arg;
+	unsigned int i;
+
+	assert(c->len + datalen + 1 < sizeof c->buf);
+	for (i = 0; i < datalen; i++)
+		c->buf[c->len++] = data[i] ? data[i] : '=';
+	c->buf[c->len++] = ';';
+	c->buf[c->len] = '\0';
+	if (c->q)
+		assert(outq_flush_conflated(c->q, collect, c) == 0);
+	return 0;
+}
+
+static void
+append(struct outq *q, const char *s, size_t skip)
+{
+	struct iovec iov[2];
+
+	/* Split the message over two iovecs */
+	iov[0].iov_base = (char *)s;
+	iov[0].iov_len = strlen(s) / 2;
+	iov[1].iov_base = (char *)s + iov[0].iov_len;
+	iov[1].iov_len = strlen(s) - iov[0].iov_len;
+	assert(outq_append(q, iov, 2, skip) == 0);
+}
+
+static void
+set_nonblock(int fd)
+{
+	int flags = fcntl(fd, F_GETFL);
+
+	assert(flags != -1);
+	assert(fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0);
+}
+
+/* Reads everything available from a non-blocking fd */
+static size_t
+drain(int fd, char *buf, size_t bufsz)
+{
+	size_t len = 0;
+	ssize_t n;
+
+	while (len < bufsz && (n = read(fd, buf + len, bufsz - len)) > 0)
+		len += n;
+	assert(n != -1 || errno == EAGAIN);
+	return len;
+}
+
+int
+main()
+{
+	struct outq *q;
+	struct collect c;
+	int sv[2];
+	char buf[256];
+	ssize_t n;
+
+	/* Notifications conflate per key, in arrival order */
+	q = outq_new(0);
+	assert(q);
+	assert(outq_isempty(q));
+	assert(outq_size(q) == 0);
+	assert(outq_conflate(q, "a\0" "1", 3) == 0);
+	assert(outq_conflate(q, "b\0" "1", 3) == 0);
+	assert(outq_conflate(q, "a\0" "22", 4) == 0);
+	assert(outq_conflate(q, "c", 1) == 0);		/* deleted */
+	assert(outq_conflate(q, "b\0" "3", 3) == 0);
+	assert(outq_size(q) == 4 + 3 + 1);
+	memset(&c, 0, sizeof c);
+	assert(outq_flush_conflated(q, collect, &c) == 0);
+	assert(strcmp(c.buf, "a=22;b=3;c;") == 0);
+	assert(outq_size(q) == 0);
+
+	/* A nested flush does nothing */
+	assert(outq_conflate(q, "x\0" "1", 3) == 0);
+	assert(outq_conflate(q, "y\0" "2", 3) == 0);
+	memset(&c, 0, sizeof c);
+	c.q = q;
+	assert(outq_flush_conflated(q, collect, &c) == 0);
+	assert(strcmp(c.buf, "x=1;y=2;") == 0);
+
+	/* Many keys grow the table; repeats still conflate */
+	{
+		char key[16];
+		unsigned int i;
+
+		for (i = 0; i < 3000; i++) {
+			snprintf(key, sizeof key, "k%u", i % 1000);
+			assert(outq_conflate(q, key, strlen(key)) == 0);
+		}
+		assert(outq_size(q) == 10 * 2 + 90 * 3 + 900 * 4);
+		outq_free(q);			/* frees what is pending */
+	}
+
+	/* A stream writes what it can and keeps the rest */
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	set_nonblock(sv[0]);
+	set_nonblock(sv[1]);
+	q = outq_new(0);
+	assert(q);
+	assert(outq_write(q, sv[0]) == 0);
+	append(q, "hello", 2);
+	append(q, ", world", 0);
+	assert(!outq_isempty(q));
+	assert(outq_size(q) == 3 + 7);
+	assert(outq_write(q, sv[0]) == 0);
+	assert(outq_isempty(q));
+	n = drain(sv[1], buf, sizeof buf);
+	assert(n == 10 && memcmp(buf, "llo, world", 10) == 0);
+
+	/* Fill the socket, then queue behind it */
+	{
+		static char big[65536];
+		size_t sent = 0, got = 0;
+		int i;
+
+		memset(big, 'z', sizeof big);
+		while ((n = write(sv[0], big, sizeof big)) > 0)
+			sent += n;
+		assert(errno == EAGAIN);
+		for (i = 0; i < 4; i++) {
+			struct iovec iov;
+
+			iov.iov_base = big;
+			iov.iov_len = sizeof big;
+			assert(outq_append(q, &iov, 1, 0) == 0);
+		}
+		append(q, "end", 0);
+		assert(outq_size(q) == 4 * sizeof big + 3);
+		assert(outq_write(q, sv[0]) == 1);
+		sent += 4 * sizeof big + 3;
+		while (outq_write(q, sv[0]) == 1)
+			while ((n = read(sv[1], big, sizeof big)) > 0)
+				got += n;
+		assert(outq_size(q) == 0);
+		while ((n = read(sv[1], big, sizeof big)) > 0)
+			got += n;
+		assert(got == sent);
+	}
+
+	/* Many small messages are written in order */
+	{
+		static char out[20000 * 6];
+		char msg[16];
+		size_t got = 0;
+		int i;
+
+		for (i = 0; i < 20000; i++) {
+			snprintf(msg, sizeof msg, "%05d;", i);
+			append(q, msg, 0);
+		}
+		assert(outq_size(q) == sizeof out);
+		while (outq_write(q, sv[0]) == 1)
+			got += drain(sv[1], out + got, sizeof out - got);
+		got += drain(sv[1], out + got, sizeof out - got);
+		assert(got == sizeof out);
+		for (i = 0; i < 20000; i++) {
+			snprintf(msg, sizeof msg, "%05d;", i);
+			assert(memcmp(out + i * 6, msg, 6) == 0);
+		}
+	}
+	outq_free(q);
+	close(sv[0]);
+	close(sv[1]);
+
+	/* Writing to a closed peer is an error */
+	signal(SIGPIPE, SIG_IGN);
+	q = outq_new(0);
+	assert(q);
+	append(q, "x", 0);
+	assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+	close(sv[1]);
+	assert(shutdown(sv[0], SHUT_WR) == 0);
+	assert(outq_write(q, sv[0]) == -1);
+	outq_free(q);
+	close(sv[0]);
+
+	/* Packets are kept whole, one write each */
+	assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+	set_nonblock(sv[1]);
+	q = outq_new(1);
+	assert(q);
+	append(q, "one", 0);
+	append(q, "two", 0);
+	append(q, "three", 1);
+	assert(outq_size(q) == 3 + 3 + 4);
+	assert(outq_write(q, sv[0]) == 0);
+	assert(read(sv[1], buf, sizeof buf) == 3 && memcmp(buf, "one", 3) == 0);
+	assert(read(sv[1], buf, sizeof buf) == 3 && memcmp(buf, "two", 3) == 0);
+	assert(read(sv[1], buf, sizeof buf) == 4 && memcmp(buf, "hree", 4) == 0);
+	assert(read(sv[1], buf, sizeof buf) == -1 && errno == EAGAIN);
+
+	/* Many packets are written together, in order */
+	{
+		char msg[16];
+		int i;
+
+		for (i = 0; i < 100; i++) {
+			snprintf(msg, sizeof msg, "p%d", i);
+			append(q, msg, 0);
+		}
+		assert(outq_write(q, sv[0]) == 0);
+		assert(outq_size(q) == 0);
+		for (i = 0; i < 100; i++) {
+			snprintf(msg, sizeof msg, "p%d", i);
+			n = read(sv[1], buf, sizeof buf);
+			assert(n == strlen(msg) && memcmp(buf, msg, n) == 0);
+		}
+	}
+	outq_free(q);
+	close(sv[0]);
+	close(sv[1]);
+
+	return 0;
+}
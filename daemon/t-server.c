@@ -156,6 +156,39 @@ mock_on_ready_fn(struct server *s, void *client, int fd)
 	return mock_on_ready.retval;
 }
 
+static struct {
+	unsigned int counter;
+	struct server *s;
+	void *client;
+	int fd;
+	int retval;
+} mock_on_writable;
+static int
+mock_on_writable_fn(struct server *s, void *client, int fd)
+{
+	mock_on_writable.counter++;
+	mock_on_writable.s = s;
+	mock_on_writable.client = client;
+	mock_on_writable.fd = fd;
+	return mock_on_writable.retval;
+}
+
+static struct {
+	unsigned int counter;
+	struct server *s;
+	struct server_timer *t;
+	unsigned int restart;		/* ms to restart, if nonzero */
+} mock_on_timeout;
+static void
+mock_on_timeout_fn(struct server *s, struct server_timer *t)
+{
+	mock_on_timeout.counter++;
+	mock_on_timeout.s = s;
+	mock_on_timeout.t = t;
+	if (mock_on_timeout.restart)
+		server_timer_start(s, t, mock_on_timeout.restart);
+}
+
 static struct mock_on_close {
 	unsigned int counter;
 	struct server *s;
@@ -228,6 +261,7 @@ main()
 	context.max_sockets = 0;
 	context.on_accept = mock_on_accept_fn;
 	context.on_ready = mock_on_ready_fn;
+	context.on_writable = mock_on_writable_fn;
 	context.on_close = mock_on_close_fn;
 	context.on_listener_close = mock_on_listener_close_fn;
 	context.on_error = mock_on_error_fn;
@@ -316,6 +350,148 @@ main()
 	assert(strstr(mock_on_error.msg, strerror(EIO)));
 	CHECK(close(xfd));
 
+	/* A client that wants to write is told when it can */
+	xfd = CHECK(connect_local());
+	mock_on_accept.retval = CLIENT;
+	assert(CHECK(server_poll(server, 0)) == 1);
+	assert(WAS_CALLED(mock_on_accept));
+	client_fd = mock_on_accept.fd;
+	assert(server_want_write(server, listenfd, 1) == -1);
+	assert(errno == EBADF);
+	CHECK(server_want_write(server, client_fd, 1));
+	mock_on_writable.retval = 1;
+	assert(CHECK(server_poll(server, 0)) == 1);
+	assert(WAS_CALLED(mock_on_writable));
+	assert(mock_on_writable.s == server);
+	assert(mock_on_writable.client == CLIENT);
+	assert(mock_on_writable.fd == client_fd);
+	assert(!WAS_CALLED(mock_on_ready));
+	/* it is still told, along with any data to read */
+	WRITE(xfd, "hello");
+	mock_on_ready.retval = 1;
+	assert(CHECK(server_poll(server, 0)) == 1);
+	assert(WAS_CALLED(mock_on_writable));
+	assert(WAS_CALLED(mock_on_ready));
+	ASSERT_READ(client_fd, "hello");
+	/* until it no longer wants to */
+	CHECK(server_want_write(server, client_fd, 0));
+	assert(CHECK(server_poll(server, 0)) == 0);
+	/* returning 0 from on_writable() closes without on_ready() */
+	CHECK(server_want_write(server, client_fd, 1));
+	mock_on_writable.retval = 0;
+	assert(CHECK(server_poll(server, 0)) == 1);
+	assert(WAS_CALLED(mock_on_writable));
+	assert(!WAS_CALLED(mock_on_ready));
+	assert(WAS_CALLED(mock_on_close));
+	CHECK(close(xfd));
+
+	/* One poll accepts all the waiting connections */
+	{
+		int xfds[3];
+		int k;
+
+		for (k = 0; k < 3; k++)
+			xfds[k] = CHECK(connect_local());
+		mock_on_accept.retval = CLIENT;
+		assert(CHECK(server_poll(server, 0)) == 1);
+		assert(mock_on_accept.counter == 3);
+		mock_on_accept.counter = 0;
+		/* accepted fds are non-blocking */
+		assert(CHECK(fcntl(mock_on_accept.fd, F_GETFL)) & O_NONBLOCK);
+		for (k = 0; k < 3; k++)
+			CHECK(close(xfds[k]));
+		mock_on_ready.retval = 0;
+		assert(CHECK(server_poll(server, 0)) == 3);
+		assert(mock_on_close.counter == 3);
+		mock_on_close.counter = 0;
+		mock_on_ready.counter = 0;
+	}
+
+	/* Closing a client leaves the others undisturbed */
+	{
+		int pair[3][2];
+		int k;
+
+		for (k = 0; k < 3; k++) {
+			CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, pair[k]));
+			mock_on_accept.retval = CLIENT;
+			CHECK(server_add_fd(server, pair[k][0], NULL));
+			assert(WAS_CALLED(mock_on_accept));
+		}
+		CHECK(close(pair[0][1]));
+		mock_on_ready.retval = 0;
+		assert(CHECK(server_poll(server, 0)) == 1);
+		assert(WAS_CALLED(mock_on_ready));
+		assert(mock_on_ready.fd == pair[0][0]);
+		assert(WAS_CALLED(mock_on_close));
+		assert(server_want_write(server, pair[0][0], 1) == -1);
+		assert(errno == EBADF);
+		/* the last client is still found by its fd */
+		CHECK(server_want_write(server, pair[2][0], 1));
+		mock_on_writable.retval = 1;
+		assert(CHECK(server_poll(server, 0)) == 1);
+		assert(WAS_CALLED(mock_on_writable));
+		assert(mock_on_writable.fd == pair[2][0]);
+		CHECK(server_want_write(server, pair[2][0], 0));
+		/* a new client may take the closed one's place */
+		CHECK(socketpair(AF_UNIX, SOCK_STREAM, 0, pair[0]));
+		CHECK(server_add_fd(server, pair[0][0], NULL));
+		assert(WAS_CALLED(mock_on_accept));
+		for (k = 0; k < 3; k++)
+			WRITE(pair[k][1], "hi");
+		mock_on_ready.retval = 1;
+		assert(CHECK(server_poll(server, 0)) == 3);
+		assert(mock_on_ready.counter == 3);
+		mock_on_ready.counter = 0;
+		for (k = 0; k < 3; k++) {
+			ASSERT_READ(pair[k][0], "hi");
+			CHECK(close(pair[k][1]));
+		}
+		mock_on_ready.retval = 0;
+		assert(CHECK(server_poll(server, 0)) == 3);
+		assert(mock_on_close.counter == 3);
+		mock_on_close.counter = 0;
+		mock_on_ready.counter = 0;
+	}
+
+	/* Timers end a blocking poll when they expire */
+	{
+		struct server_timer t1, t2;
+		uint64_t start;
+
+		memset(&t1, 0, sizeof t1);
+		memset(&t2, 0, sizeof t2);
+		t1.on_timeout = mock_on_timeout_fn;
+		t2.on_timeout = mock_on_timeout_fn;
+		assert(!server_timer_pending(&t1));
+		start = server_now();
+		server_timer_start(server, &t1, 20);
+		server_timer_start(server, &t2, 10);
+		assert(server_timer_pending(&t1));
+		assert(CHECK(server_poll(server, -1)) == 1);
+		assert(WAS_CALLED(mock_on_timeout));
+		assert(mock_on_timeout.s == server);
+		assert(mock_on_timeout.t == &t2);
+		assert(server_now() - start >= 10);
+		assert(!server_timer_pending(&t2));
+		/* a stopped timer does not expire */
+		server_timer_stop(&t1);
+		assert(!server_timer_pending(&t1));
+		assert(CHECK(server_poll(server, 30)) == 0);
+		assert(!WAS_CALLED(mock_on_timeout));
+		/* a timer may restart itself */
+		mock_on_timeout.restart = 10;
+		server_timer_start(server, &t1, 0);
+		assert(CHECK(server_poll(server, -1)) == 1);
+		assert(WAS_CALLED(mock_on_timeout));
+		assert(server_timer_pending(&t1));
+		mock_on_timeout.restart = 0;
+		assert(CHECK(server_poll(server, -1)) == 1);
+		assert(WAS_CALLED(mock_on_timeout));
+		assert(mock_on_timeout.t == &t1);
+		assert(!server_timer_pending(&t1));
+	}
+
 	/* closing the server closes the listeners */
 	server_free(server);
 	assert(WAS_CALLED(mock_on_listener_close));
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE	/* memmem() */
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -158,10 +159,376 @@ assert_store_lacks_(const char *file, int line, const char *expr,
 		} info_; \
 	}) { .info_.sz = sizeof (kv), .info_.k = kv }).info)
 
+/* A tiny deterministic PRNG, so failures are reproducible */
+static unsigned int
+rnd(unsigned int n)
+{
+	static unsigned long long seed = 1;
+	seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+	return (seed >> 33) % n;
+}
+
+#define NKEYS 3000
+
+/* A model of what the store should contain */
+static struct {
+	char keyvalue[64];
+	unsigned int sz;	/* 0 when absent */
+} model[NKEYS];
+
+/* Check that the store content matches the model exactly */
+static void
+assert_store_is_model(struct store *store)
+{
+	struct store_index ix;
+	const struct info *info;
+	const char *prev = NULL;
+	unsigned int i, count = 0, expected = 0;
+
+	for (i = 0; i < NKEYS; i++) {
+		info = store_get(store, model[i].keyvalue);
+		if (!model[i].sz) {
+			assert(!info);
+			continue;
+		}
+		expected++;
+		assert(info);
+		assert(info->sz == model[i].sz);
+		assert(memcmp(info->keyvalue, model[i].keyvalue,
+			model[i].sz) == 0);
+	}
+	for (info = store_get_first(store, &ix); info;
+	     info = store_get_next(store, &ix))
+	{
+		if (prev)
+			assert(strcmp(prev, info->keyvalue) < 0);
+		prev = info->keyvalue;
+		count++;
+	}
+	assert(count == expected);
+}
+
+/* Puts, replaces and deletes many keys in random order */
+static void
+test_many_keys(const char *storefile)
+{
+	struct store *store;
+	struct store_stats stats;
+	unsigned int round, j;
+
+	unlink(storefile);
+	store = store_open(storefile);
+	assert(store);
+	memset(model, 0, sizeof model);
+	for (j = 0; j < NKEYS; j++)
+		snprintf(model[j].keyvalue, sizeof model[j].keyvalue,
+			"key.%u.%u", rnd(1000), j);
+
+	for (round = 0; round < 20 * NKEYS; round++) {
+		unsigned int i = rnd(NKEYS);
+		char *key = model[i].keyvalue;
+		unsigned int keylen = strlen(key);
+
+		if (rnd(4) == 0) {
+			assert(store_del(store, key) == !!model[i].sz);
+			model[i].sz = 0;
+		} else {
+			/* value of random length, to move infos about */
+			unsigned int vlen = rnd(sizeof model[i].keyvalue -
+				keylen - 1);
+			memset(key + keylen + 1, 'a' + rnd(26), vlen);
+			model[i].sz = keylen + 1 + vlen;
+			assert(store_put(store, model[i].sz, key) != -1);
+		}
+		if (round % NKEYS == 0)
+			assert_store_is_model(store);
+	}
+	assert_store_is_model(store);
+
+	/* Deleting many keys leaves enough gaps to need compacting */
+	for (j = 0; j < NKEYS; j += 2) {
+		if (model[j].sz)
+			assert(store_del(store, model[j].keyvalue) == 1);
+		model[j].sz = 0;
+	}
+	assert_store_is_model(store);
+	store_get_stats(store, &stats);
+	assert(stats.compactions > 0);
+	assert(stats.live <= stats.used);
+	assert(stats.used <= stats.filesz);
+
+	/* The content survives a close and re-open */
+	store_close(store);
+	store = store_open(storefile);
+	assert(store);
+	assert_store_is_model(store);
+	store_close(store);
+}
+
+/* Appends a raw record to a store file under construction */
+static void
+write_record(FILE *f, uint16_t sz, const char *keyvalue)
+{
+	static const char pad[8];
+
+	fwrite(&sz, sizeof sz, 1, f);
+	fwrite(keyvalue, 1, sz, f);
+	fwrite(pad, 1, (8 - (sizeof sz + sz) % 8) % 8, f);
+}
+
+/* Duplicate keys found in a file on open are dropped,
+ * keeping the one stored later in the file */
+static void
+test_duplicates(const char *storefile)
+{
+	struct store *store;
+	FILE *f;
+	static const struct {
+		uint16_t zero1, zero2;
+		uint32_t size;
+		char body[24];
+	} gap = { 0, 0, 24 };
+
+	f = fopen(storefile, "w");
+	assert(f);
+	write_record(f, sizeof "b\0old", "b\0old");
+	write_record(f, sizeof "a\0old", "a\0old");
+	fwrite(&gap, sizeof gap, 1, f);
+	write_record(f, sizeof "c\0only", "c\0only");
+	write_record(f, sizeof "a\0new", "a\0new");
+	write_record(f, sizeof "b\0new", "b\0new");
+	write_record(f, sizeof "a\0newest", "a\0newest");
+	assert(fclose(f) == 0);
+
+	store = store_open(storefile);
+	assert(store);
+	assert_store_is(store,
+		INFO("a\0newest"),
+		INFO("b\0new"),
+		INFO("c\0only"),
+		NULL);
+	/* The freed space is reusable */
+	assert_store_put(store, "d\0value");
+	assert_store_is(store,
+		INFO("a\0newest"),
+		INFO("b\0new"),
+		INFO("c\0only"),
+		INFO("d\0value"),
+		NULL);
+	store_close(store);
+}
+
+/* A checkpointed store re-opens from its sidecar index, but only
+ * while the sidecar is known to be current */
+static void
+test_sidecar(const char *storefile)
+{
+	struct store *store;
+	struct store_stats stats;
+	char idxfile[256];
+	FILE *f;
+
+	snprintf(idxfile, sizeof idxfile, "%s.idx", storefile);
+	unlink(storefile);
+	unlink(idxfile);
+
+	store = store_open(storefile);
+	assert(store);
+	assert_store_put(store, "k1\0v1");
+	assert_store_put(store, "k2\0value2");
+	assert_store_put(store, "k3\0v3");
+	assert(store_del(store, "k2") == 1); /* leaves a gap */
+	assert(store_checkpoint(store) == 0);
+	store_close(store);
+	assert(access(idxfile, F_OK) == 0);
+
+	/* Clean re-open uses the sidecar, gaps and all */
+	store = store_open(storefile);
+	assert(store);
+	store_get_stats(store, &stats);
+	assert(stats.sidecar);
+	assert_store_is(store, INFO("k1\0v1"), INFO("k3\0v3"), NULL);
+	/* Rewriting a value unchanged keeps the sidecar current */
+	assert(store_put(store, sizeof "k1\0v1", "k1\0v1") == 0);
+	store_close(store);
+	store = store_open(storefile);
+	assert(store);
+	store_get_stats(store, &stats);
+	assert(stats.sidecar);
+	/* Checkpointing an unchanged store writes nothing */
+	assert(unlink(idxfile) == 0);
+	assert(store_checkpoint(store) == 0);
+	assert(access(idxfile, F_OK) == -1);
+	assert_store_put(store, "k0\0v0");
+	assert_store_is(store,
+		INFO("k0\0v0"), INFO("k1\0v1"), INFO("k3\0v3"), NULL);
+	store_close(store); /* without a checkpoint */
+
+	/* The store changed, so the sidecar is now stale */
+	store = store_open(storefile);
+	assert(store);
+	store_get_stats(store, &stats);
+	assert(!stats.sidecar);
+	assert_store_is(store,
+		INFO("k0\0v0"), INFO("k1\0v1"), INFO("k3\0v3"), NULL);
+	assert(store_checkpoint(store) == 0);
+	store_close(store);
+
+	/* A damaged sidecar is ignored */
+	f = fopen(idxfile, "r+");
+	assert(f);
+	assert(fputs("junk", f) >= 0);
+	assert(fclose(f) == 0);
+	store = store_open(storefile);
+	assert(store);
+	store_get_stats(store, &stats);
+	assert(!stats.sidecar);
+	assert_store_is(store,
+		INFO("k0\0v0"), INFO("k1\0v1"), INFO("k3\0v3"), NULL);
+	store_close(store);
+	unlink(idxfile);
+}
+
+/* Flips a byte of the first occurrence of a string in a file */
+static void
+corrupt_file(const char *path, const char *str)
+{
+	char buf[4096];
+	size_t len;
+	char *p;
+	FILE *f;
+
+	f = fopen(path, "r+");
+	assert(f);
+	len = fread(buf, 1, sizeof buf, f);
+	p = memmem(buf, len, str, strlen(str));
+	assert(p);
+	assert(fseek(f, p - buf, SEEK_SET) == 0);
+	assert(fputc(*p ^ 0x20, f) != EOF);
+	assert(fclose(f) == 0);
+}
+
+/* Infos with checksums that don't match are dropped, either on
+ * open or when they are first read */
+static void
+test_checksums(const char *storefile)
+{
+	struct store *store;
+	struct store_stats stats;
+	char idxfile[256];
+
+	snprintf(idxfile, sizeof idxfile, "%s.idx", storefile);
+	unlink(storefile);
+	unlink(idxfile);
+
+	/* Checksums can't be turned on for a store holding infos */
+	store = store_open(storefile);
+	assert(store);
+	assert_store_put(store, "k1\0v1");
+	store_close(store);
+	store = store_open_flags(storefile, STORE_CRC);
+	assert(store);
+	store_get_stats(store, &stats);
+	assert(!stats.checksums);
+	store_close(store);
+	unlink(storefile);
+
+	/* A new store keeps its checksums */
+	store = store_open_flags(storefile, STORE_CRC);
+	assert(store);
+	assert_store_put(store, "k1\0v1");
+	assert_store_put(store, "k2\0value2");
+	assert_store_put(store, "k3\0v3");
+	store_close(store);
+	store = store_open(storefile);
+	assert(store);
+	store_get_stats(store, &stats);
+	assert(stats.checksums);
+	assert(stats.corrupt == 0);
+	assert_store_is(store,
+		INFO("k1\0v1"), INFO("k2\0value2"), INFO("k3\0v3"), NULL);
+	store_close(store);
+
+	/* Verifying on open */
+	corrupt_file(storefile, "value2");
+	store = store_open(storefile);
+	assert(store);
+	store_get_stats(store, &stats);
+	assert(stats.corrupt == 1);
+	assert_store_is(store, INFO("k1\0v1"), INFO("k3\0v3"), NULL);
+	assert_store_put(store, "k2\0value2");
+	store_close(store);
+
+	/* Verifying on first read */
+	corrupt_file(storefile, "value2");
+	store = store_open_flags(storefile, STORE_LAZY);
+	assert(store);
+	store_get_stats(store, &stats);
+	assert(stats.corrupt == 0);
+	assert(store_get(store, "k1"));
+	assert(!store_get(store, "k2"));
+	store_get_stats(store, &stats);
+	assert(stats.corrupt == 1);
+	assert_store_is(store, INFO("k1\0v1"), INFO("k3\0v3"), NULL);
+	assert_store_put(store, "k2\0value2");
+	assert(store_checkpoint(store) == 0);
+	store_close(store);
+
+	/* Opening from a sidecar still verifies, and so does iterating */
+	corrupt_file(storefile, "value2");
+	store = store_open(storefile);
+	assert(store);
+	store_get_stats(store, &stats);
+	assert(stats.sidecar);
+	assert(stats.corrupt == 1);
+	assert_store_is(store, INFO("k1\0v1"), INFO("k3\0v3"), NULL);
+	assert_store_put(store, "k2\0value2");
+	assert(store_checkpoint(store) == 0);
+	store_close(store);
+	corrupt_file(storefile, "value2");
+	store = store_open_flags(storefile, STORE_LAZY);
+	assert(store);
+	store_get_stats(store, &stats);
+	assert(stats.sidecar);
+	assert(stats.corrupt == 0);
+	assert_store_is(store, INFO("k1\0v1"), INFO("k3\0v3"), NULL);
+	store_get_stats(store, &stats);
+	assert(stats.corrupt == 1);
+	store_close(store);
+	unlink(idxfile);
+	unlink(storefile);
+}
+
+/* A stream of inserts grows the file geometrically, not page by page */
+static void
+test_growth(const char *storefile)
+{
+	struct store *store;
+	struct store_stats stats;
+	unsigned int i;
+	char kv[64];
+
+	unlink(storefile);
+	store = store_open(storefile);
+	assert(store);
+	for (i = 0; i < 20000; i++) {
+		int keylen = snprintf(kv, sizeof kv, "grow.%u", i);
+		assert(store_put(store, keylen + 1 + 12, kv) != -1);
+	}
+	store_get_stats(store, &stats);
+	assert(stats.keys == 20000);
+	assert(stats.used <= stats.filesz);
+	assert(stats.grows < 30);	/* vs. about 160 pages */
+	assert(stats.filesz - stats.used < 2 * stats.used);
+	store_close(store);
+	unlink(storefile);
+}
+
 int
 main()
 {
 	struct store *store;
+	struct store_index ix;
 	const char *storefile = "/tmp/t-store.dat";
 
     /* -- empty store -- */
@@ -286,4 +653,72 @@ main()
 
     /* -- cleanup -- */
 	store_close(store);
+
+    /* -- keys that differ around the 8th byte sort correctly -- */
+
+	unlink(storefile);
+	store = store_open(storefile);
+	assert(store);
+	assert_store_put(store, "abcdefgh1\0e");
+	assert_store_put(store, "abcdefg\0b");
+	assert_store_put(store, "abcdefgh\0c");
+	assert_store_put(store, "abcdefgh0\0d");
+	assert_store_put(store, "abc\0a");
+	assert_store_put(store, "abcdefgi\0f");
+	assert_store_is(store,
+		INFO("abc\0a"),
+		INFO("abcdefg\0b"),
+		INFO("abcdefgh\0c"),
+		INFO("abcdefgh0\0d"),
+		INFO("abcdefgh1\0e"),
+		INFO("abcdefgi\0f"),
+		NULL);
+	assert_store_lacks(store, "abcd", "abcdefgh2", "abcdefghi", NULL);
+	store_close(store);
+	store = store_open(storefile);
+	assert(store);
+	assert_store_is(store,
+		INFO("abc\0a"),
+		INFO("abcdefg\0b"),
+		INFO("abcdefgh\0c"),
+		INFO("abcdefgh0\0d"),
+		INFO("abcdefgh1\0e"),
+		INFO("abcdefgi\0f"),
+		NULL);
+
+    /* -- seeking finds the first key not less than the given key -- */
+
+	assert(strcmp(store_seek(store, "", &ix)->keyvalue, "abc") == 0);
+	assert(strcmp(store_seek(store, "abcd", &ix)->keyvalue,
+		"abcdefg") == 0);
+	assert(strcmp(store_get_next(store, &ix)->keyvalue, "abcdefgh") == 0);
+	assert(strcmp(store_seek(store, "abcdefgh", &ix)->keyvalue,
+		"abcdefgh") == 0);
+	assert(strcmp(store_seek(store, "abcdefgh00", &ix)->keyvalue,
+		"abcdefgh1") == 0);
+	assert(strcmp(store_seek(store, "abcdefgh2", &ix)->keyvalue,
+		"abcdefgi") == 0);
+	assert(!store_get_next(store, &ix));
+	assert(!store_seek(store, "abd", &ix));
+	store_close(store);
+
+    /* -- duplicate keys are removed on open -- */
+
+	test_duplicates(storefile);
+
+    /* -- a checkpointed index is reused on open -- */
+
+	test_sidecar(storefile);
+
+    /* -- checksums catch corrupted infos -- */
+
+	test_checksums(storefile);
+
+    /* -- the file grows geometrically -- */
+
+	test_growth(storefile);
+
+    /* -- a large store stays sorted under random churn -- */
+
+	test_many_keys(storefile);
 }
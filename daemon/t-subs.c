@@ -0,0 +1,207 @@
+#include <assert.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "subs.h"
+
+static struct subscriber alice = { "alice" };
+static struct subscriber bob = { "bob" };
+static struct subscriber carol = { "carol" };
+
+/* Asserts that exactly the listed subscribers match the key */
+#define assert_match(subs, key, ...) \
+	assert_match_(__FILE__, __LINE__, subs, key, __VA_ARGS__)
+__attribute__((sentinel))
+static void
+assert_match_(const char *file, int line, struct subs *subs,
+	const char *key, ...)
+{
+	struct subscriber *const *result;
+	struct subscriber *s;
+	unsigned int expected = 0, i;
+	int n;
+	va_list ap;
+
+	n = subs_match(subs, key, &result);
+	va_start(ap, key);
+	while ((s = va_arg(ap, struct subscriber *))) {
+		for (i = 0; i < n; i++)
+			if (result[i] == s)
+				break;
+		if (i == n) {
+			fprintf(stderr, "%s:%d: %s did not match %s\n",
+				file, line, (const char *)s->udata, key);
+			abort();
+		}
+		expected++;
+	}
+	va_end(ap);
+	if (n != expected) {
+		fprintf(stderr, "%s:%d: %s matched %d, expected %u\n",
+			file, line, key, n, expected);
+		abort();
+	}
+}
+
+int
+main()
+{
+	struct subs *subs;
+	struct sub *a1, *a2, *a3, *b1, *b2, *c1;
+
+	subs = subs_new();
+	assert(subs);
+	assert_match(subs, "a.b", NULL);
+
+	/* Each kind of pattern */
+	a1 = subs_add(subs, &alice, "net.eth0.rx");	/* exact */
+	b1 = subs_add(subs, &bob, "net.eth*");		/* prefix */
+	c1 = subs_add(subs, &carol, "*rx");		/* residual */
+	assert(a1 && b1 && c1);
+	assert(!subs_add(subs, &alice, "(("));		/* invalid */
+
+	assert(subs_test(a1, "net.eth0.rx"));
+	assert(!subs_test(a1, "net.eth0.rxx"));
+	assert(subs_test(b1, "net.eth0.tx"));
+	assert(!subs_test(b1, "net.lo"));
+
+	assert_match(subs, "net.eth0.rx", &alice, &bob, &carol, NULL);
+	assert_match(subs, "net.eth0.tx", &bob, NULL);
+	assert_match(subs, "net.eth", &bob, NULL);
+	assert_match(subs, "net.et", NULL);
+	assert_match(subs, "net.lo.rx", &carol, NULL);
+	assert_match(subs, "", NULL);
+
+	/* A subscriber is found once, however many patterns match */
+	a2 = subs_add(subs, &alice, "net.*");
+	a3 = subs_add(subs, &alice, "net.eth0.rx");
+	assert(a2 && a3);
+	assert_match(subs, "net.eth0.rx", &alice, &bob, &carol, NULL);
+	assert_match(subs, "net.lo", &alice, NULL);
+
+	/* Patterns sharing a prefix, and escapes in literals */
+	b2 = subs_add(subs, &bob, "net.eth0.\\*");
+	assert(b2);
+	assert_match(subs, "net.eth0.*", &alice, &bob, NULL);
+	subs_remove(subs, b1);
+	assert_match(subs, "net.eth0.*", &alice, &bob, NULL);
+	assert_match(subs, "net.eth0.tx", &alice, NULL);
+	subs_remove(subs, b2);
+	assert_match(subs, "net.eth0.*", &alice, NULL);
+
+	/* Removing one of two identical subscriptions keeps the other */
+	subs_remove(subs, a1);
+	assert_match(subs, "net.eth0.rx", &alice, &carol, NULL);
+	subs_remove(subs, a3);
+	subs_remove(subs, a2);
+	assert_match(subs, "net.eth0.rx", &carol, NULL);
+	subs_remove(subs, c1);
+	assert_match(subs, "net.eth0.rx", NULL);
+
+	/* Clients sharing a pattern are all found by the one pattern */
+	a1 = subs_add(subs, &alice, "alarm.*");
+	b1 = subs_add(subs, &bob, "alarm.*");
+	c1 = subs_add(subs, &carol, "alarm.*");
+	assert(a1 && b1 && c1);
+	assert(strcmp(subs_pattern(b1), "alarm.*") == 0);
+	assert(subs_pattern(a1) == subs_pattern(c1));
+	assert_match(subs, "alarm.fire", &alice, &bob, &carol, NULL);
+	subs_remove(subs, b1);
+	assert_match(subs, "alarm.fire", &alice, &carol, NULL);
+	subs_remove(subs, a1);
+	subs_remove(subs, c1);
+	assert_match(subs, "alarm.fire", NULL);
+
+	/* Repeated matches of a key see added and removed subs */
+	a1 = subs_add(subs, &alice, "hot.*");
+	assert(a1);
+	assert_match(subs, "hot.key", &alice, NULL);
+	assert_match(subs, "hot.key", &alice, NULL);
+	b1 = subs_add(subs, &bob, "hot.key");
+	assert(b1);
+	assert_match(subs, "hot.key", &alice, &bob, NULL);
+	assert_match(subs, "hot.key", &alice, &bob, NULL);
+	subs_remove(subs, a1);
+	assert_match(subs, "hot.key", &bob, NULL);
+	subs_remove(subs, b1);
+	assert_match(subs, "hot.key", NULL);
+
+	/* A subscriber's subs are found by pattern, and removed */
+	a1 = subs_add(subs, &alice, "x.*");
+	a2 = subs_add(subs, &alice, "x.y");
+	b1 = subs_add(subs, &bob, "x.y");
+	assert(a1 && a2 && b1);
+	assert(subs_find(&alice, "x.*") == a1);
+	assert(subs_find(&alice, "x.y") == a2);
+	assert(subs_find(&bob, "x.y") == b1);
+	assert(!subs_find(&bob, "x.*"));
+	assert(!subs_find(&carol, "x.y"));
+	assert(subs_get_udata(a2) == 0);
+	subs_set_udata(a2, 42);
+	assert(subs_get_udata(a2) == 42);
+	assert(subs_get_udata(b1) == 0);
+	{
+		/* A subscriber's subs are each visited once */
+		const struct sub *s;
+		int seen1 = 0, seen2 = 0, n = 0;
+
+		for (s = subs_next(&alice, NULL); s;
+		     s = subs_next(&alice, s))
+		{
+			seen1 += s == a1;
+			seen2 += s == a2;
+			n++;
+		}
+		assert(seen1 == 1 && seen2 == 1 && n == 2);
+		assert(!subs_next(&carol, NULL));
+	}
+	subs_remove_all(subs, &alice);
+	assert(!subs_find(&alice, "x.y"));
+	assert_match(subs, "x.y", &bob, NULL);
+	subs_remove(subs, b1);
+	assert_match(subs, "x.y", NULL);
+
+	/* Many distinct patterns grow the hash tables */
+	{
+		static struct sub *many[1000];
+		char key[32];
+		unsigned int i;
+
+		for (i = 0; i < 1000; i++) {
+			snprintf(key, sizeof key, i % 3 ? "key.%u" : "key.%u*",
+				i);
+			many[i] = subs_add(subs, i % 2 ? &alice : &bob, key);
+			assert(many[i]);
+		}
+		assert_match(subs, "key.7", &alice, NULL);
+		assert_match(subs, "key.8", &bob, NULL);
+		assert_match(subs, "key.9", &alice, NULL);
+		assert_match(subs, "key.99", &alice, NULL);
+		assert_match(subs, "key.10", &bob, NULL);
+		assert_match(subs, "key.1000", NULL);
+		snprintf(key, sizeof key, "key.%u*", 999);
+		assert(subs_find(&alice, key) == many[999]);
+		assert(subs_find(&alice, "key.997") == many[997]);
+		assert(!subs_find(&bob, "key.997"));
+		{
+			const struct sub *s;
+			unsigned int n = 0;
+
+			for (s = subs_next(&bob, NULL); s;
+			     s = subs_next(&bob, s))
+				n++;
+			assert(n == 500);
+		}
+		for (i = 0; i < 1000; i += 2)
+			subs_remove(subs, many[i]);
+		assert_match(subs, "key.8", NULL);
+		assert(subs_find(&alice, "key.997") == many[997]);
+		subs_remove_all(subs, &alice);
+		assert_match(subs, "key.7", NULL);
+	}
+
+	subs_free(subs);
+	return 0;
+}
@@ -0,0 +1,133 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "throttle.h"
+
+/* Collects emitted changes into a buffer, separated by ';' */
+static char out[256];
+static unsigned int outlen;
+
+static int
+collect(void *arg, const char *data, unsigned int datalen)
+{
+	unsigned int i;
+
+	assert(outlen + datalen + 1 < sizeof out);
+	for (i = 0; i < datalen; i++)
+		out[outlen++] = data[i] ? data[i] : '=';
+	out[outlen++] = ';';
+	out[outlen] = '\0';
+	return 0;
+}
+
+/* Expires at time now, and returns what was emitted */
+static const char *
+expire(struct throttle *t, uint64_t now)
+{
+	outlen = 0;
+	out[0] = '\0';
+	assert(throttle_expire(t, now, collect, NULL) == 0);
+	return out;
+}
+
+static int
+keep_x(void *arg, const char *key)
+{
+	return key[0] == 'x';
+}
+
+static int
+keep_none(void *arg, const char *key)
+{
+	return 0;
+}
+
+int
+main()
+{
+	struct throttle *t;
+
+	t = throttle_new();
+	assert(t);
+	assert(throttle_next(t) == 0);
+	assert(strcmp(expire(t, 1000), "") == 0);
+
+	/* The first change is sent, later ones are held */
+	assert(throttle_check(t, "a\0" "1", 3, 100, 1000) == 1);
+	assert(throttle_next(t) == 1100);
+	assert(throttle_check(t, "a\0" "2", 3, 100, 1010) == 0);
+	assert(throttle_check(t, "a\0" "3", 3, 100, 1020) == 0);
+	assert(throttle_check(t, "a", 1, 100, 1030) == 0);	/* deleted */
+	assert(throttle_check(t, "a\0" "4", 3, 100, 1040) == 0);
+	/* Other keys are independent */
+	assert(throttle_check(t, "b\0" "1", 3, 50, 1050) == 1);
+	assert(throttle_check(t, "b\0" "2", 3, 50, 1060) == 0);
+	assert(throttle_next(t) == 1100);
+
+	/* Nothing ends early */
+	assert(strcmp(expire(t, 1099), "") == 0);
+	/* Only the latest is sent, starting another interval */
+	assert(strcmp(expire(t, 1100), "a=4;b=2;") == 0);
+	assert(throttle_next(t) == 1150);
+	assert(throttle_check(t, "a\0" "5", 3, 100, 1120) == 0);
+	assert(strcmp(expire(t, 1150), "") == 0);	/* b forgotten */
+	assert(throttle_check(t, "b\0" "3", 3, 50, 1160) == 1);
+	assert(strcmp(expire(t, 1200), "a=5;") == 0);
+	assert(throttle_next(t) == 1210);
+	assert(strcmp(expire(t, 1210), "") == 0);	/* b forgotten */
+	assert(throttle_next(t) == 1300);
+	assert(strcmp(expire(t, 1300), "") == 0);	/* a forgotten */
+	assert(throttle_next(t) == 0);
+	assert(throttle_check(t, "a\0" "6", 3, 100, 1400) == 1);
+
+	/* Many keys, with intervals ending out of order */
+	{
+		char key[16];
+		unsigned int i;
+
+		for (i = 0; i < 1000; i++) {
+			snprintf(key, sizeof key, "k%u", i);
+			assert(throttle_check(t, key, strlen(key),
+				1000 - i, 2000) == 1);
+			assert(throttle_check(t, key, strlen(key),
+				1000 - i, 2000) == 0);
+		}
+		assert(throttle_next(t) == 1500);
+		assert(strcmp(expire(t, 2001), "k999;") == 0);
+		assert(strcmp(expire(t, 2002), "k998;") == 0);
+	}
+	throttle_free(t);			/* frees what is held */
+
+	/* A forgotten key's kept change is dropped */
+	t = throttle_new();
+	assert(t);
+	assert(throttle_check(t, "a\0" "1", 3, 100, 1000) == 1);
+	assert(throttle_check(t, "a\0" "2", 3, 100, 1010) == 0);
+	assert(throttle_check(t, "b\0" "1", 3, 100, 1020) == 1);
+	assert(throttle_check(t, "b\0" "2", 3, 100, 1030) == 0);
+	throttle_forget(t, "a\0" "3", 3);
+	throttle_forget(t, "c", 1);			/* not held */
+	assert(throttle_next(t) == 1120);
+	assert(strcmp(expire(t, 1120), "b=2;") == 0);
+	/* and it is sent at once next time */
+	assert(throttle_check(t, "a\0" "4", 3, 100, 1130) == 1);
+	throttle_forget(t, "a", 1);
+	throttle_forget(t, "b", 1);
+	assert(throttle_next(t) == 0);
+
+	/* Keys can be forgotten selectively */
+	assert(throttle_check(t, "x1\0" "1", 4, 100, 2000) == 1);
+	assert(throttle_check(t, "y1\0" "1", 4, 100, 2000) == 1);
+	assert(throttle_check(t, "x2\0" "1", 4, 100, 2000) == 1);
+	assert(throttle_check(t, "x1\0" "2", 4, 100, 2010) == 0);
+	assert(throttle_check(t, "y1\0" "2", 4, 100, 2010) == 0);
+	throttle_keep_if(t, keep_x, NULL);
+	assert(strcmp(expire(t, 2100), "x1=2;") == 0);
+	assert(throttle_check(t, "y1\0" "3", 4, 100, 2110) == 1);
+	throttle_keep_if(t, keep_none, NULL);
+	assert(throttle_next(t) == 0);
+	assert(strcmp(expire(t, 3000), "") == 0);
+	throttle_free(t);
+	return 0;
+}
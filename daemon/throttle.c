@@ -0,0 +1,278 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "throttle.h"
+
+#define TABLE_MINSIZE	16	/* held table's minimum size */
+
+/* A key being held back */
+struct held {
+	struct held *next, *prev;	/* in order of end */
+	struct held *hnext;		/* next in the same bucket */
+	uint32_t hash;			/* hash of key */
+	uint64_t end;			/* when the interval ends */
+	unsigned int interval;
+	unsigned int datalen;
+	char *data;			/* the kept change, or NULL */
+	unsigned int keylen;
+	char key[];			/* NUL terminated */
+};
+
+struct throttle {
+	struct held *head, *tail;	/* soonest end first */
+	struct held **table;		/* held, by key */
+	unsigned int tablesize;		/* a power of 2 */
+	unsigned int nheld;
+};
+
+/* FNV-1a hash of a key */
+static uint32_t
+key_hash(const char *key, unsigned int len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len--)
+		h = (h ^ (unsigned char)*key++) * 16777619u;
+	return h;
+}
+
+struct throttle *
+throttle_new(void)
+{
+	return calloc(1, sizeof (struct throttle));
+}
+
+static void
+held_free(struct held *h)
+{
+	free(h->data);
+	free(h);
+}
+
+void
+throttle_free(struct throttle *t)
+{
+	struct held *h;
+
+	if (!t)
+		return;
+	while ((h = t->head)) {
+		t->head = h->next;
+		held_free(h);
+	}
+	free(t->table);
+	free(t);
+}
+
+/* Ensures the held table has room for one more */
+static int
+table_ensure(struct throttle *t)
+{
+	struct held **table;
+	struct held *h;
+	unsigned int size;
+
+	if (t->nheld < t->tablesize)
+		return 0;
+	size = t->tablesize ? t->tablesize * 2 : TABLE_MINSIZE;
+	table = calloc(size, sizeof *table);
+	if (!table)
+		return -1;
+	for (h = t->head; h; h = h->next) {
+		struct held **bucket = &table[h->hash & (size - 1)];
+
+		h->hnext = *bucket;
+		*bucket = h;
+	}
+	free(t->table);
+	t->table = table;
+	t->tablesize = size;
+	return 0;
+}
+
+/* Releases the held table once nothing is held */
+static void
+table_release(struct throttle *t)
+{
+	if (!t->nheld) {
+		free(t->table);
+		t->table = NULL;
+		t->tablesize = 0;
+	}
+}
+
+/* Finds the held record of a key, or returns NULL */
+static struct held *
+table_find(const struct throttle *t, const char *key, unsigned int keylen,
+	uint32_t hash)
+{
+	struct held *h;
+
+	if (!t->nheld)
+		return NULL;
+	for (h = t->table[hash & (t->tablesize - 1)]; h; h = h->hnext)
+		if (h->hash == hash && h->keylen == keylen &&
+		    memcmp(h->key, key, keylen) == 0)
+			break;
+	return h;
+}
+
+/* Removes h from the held table */
+static void
+table_remove(struct throttle *t, struct held *h)
+{
+	struct held **hp = &t->table[h->hash & (t->tablesize - 1)];
+
+	while (*hp != h)
+		hp = &(*hp)->hnext;
+	*hp = h->hnext;
+	t->nheld--;
+}
+
+/* Inserts h into the end-ordered list. Most intervals are alike,
+ * so the place is usually found at the tail. */
+static void
+order_insert(struct throttle *t, struct held *h)
+{
+	struct held *after = t->tail;
+
+	while (after && after->end > h->end)
+		after = after->prev;
+	h->prev = after;
+	h->next = after ? after->next : t->head;
+	if (h->next)
+		h->next->prev = h;
+	else
+		t->tail = h;
+	if (after)
+		after->next = h;
+	else
+		t->head = h;
+}
+
+static void
+order_remove(struct throttle *t, struct held *h)
+{
+	if (h->prev)
+		h->prev->next = h->next;
+	else
+		t->head = h->next;
+	if (h->next)
+		h->next->prev = h->prev;
+	else
+		t->tail = h->prev;
+}
+
+int
+throttle_check(struct throttle *t, const char *data,
+	unsigned int datalen, unsigned int interval, uint64_t now)
+{
+	const char *nul = memchr(data, '\0', datalen);
+	unsigned int keylen = nul ? nul - data : datalen;
+	uint32_t hash = key_hash(data, keylen);
+	struct held *h, **bucket;
+	char *copy;
+
+	h = table_find(t, data, keylen, hash);
+	if (h) {
+		/* Keep only the latest change */
+		copy = malloc(datalen ? datalen : 1);
+		if (!copy)
+			return -1;
+		memcpy(copy, data, datalen);
+		free(h->data);
+		h->data = copy;
+		h->datalen = datalen;
+		return 0;
+	}
+
+	/* Send it, and hold the key back from now on */
+	if (table_ensure(t) == -1)
+		return -1;
+	h = malloc(sizeof *h + keylen + 1);
+	if (!h)
+		return -1;
+	h->hash = hash;
+	h->end = now + interval;
+	h->interval = interval;
+	h->data = NULL;
+	h->datalen = 0;
+	h->keylen = keylen;
+	memcpy(h->key, data, keylen);
+	h->key[keylen] = '\0';
+	bucket = &t->table[hash & (t->tablesize - 1)];
+	h->hnext = *bucket;
+	*bucket = h;
+	t->nheld++;
+	order_insert(t, h);
+	return 1;
+}
+
+uint64_t
+throttle_next(const struct throttle *t)
+{
+	return t->head ? t->head->end : 0;
+}
+
+int
+throttle_expire(struct throttle *t, uint64_t now,
+	int (*emit)(void *arg, const char *data, unsigned int datalen),
+	void *arg)
+{
+	struct held *h;
+
+	while ((h = t->head) && h->end <= now) {
+		order_remove(t, h);
+		if (h->data) {
+			/* Send the kept change, starting another interval */
+			char *data = h->data;
+
+			h->data = NULL;
+			h->end = now + h->interval;
+			order_insert(t, h);
+			if (emit(arg, data, h->datalen) == -1) {
+				free(data);
+				return -1;
+			}
+			free(data);
+		} else {
+			table_remove(t, h);
+			held_free(h);
+		}
+	}
+	table_release(t);
+	return 0;
+}
+
+void
+throttle_forget(struct throttle *t, const char *data, unsigned int datalen)
+{
+	const char *nul = memchr(data, '\0', datalen);
+	unsigned int keylen = nul ? nul - data : datalen;
+	struct held *h;
+
+	h = table_find(t, data, keylen, key_hash(data, keylen));
+	if (!h)
+		return;
+	order_remove(t, h);
+	table_remove(t, h);
+	held_free(h);
+	table_release(t);
+}
+
+void
+throttle_keep_if(struct throttle *t,
+	int (*keep)(void *arg, const char *key), void *arg)
+{
+	struct held *h, *next;
+
+	for (h = t->head; h; h = next) {
+		next = h->next;
+		if (!keep(arg, h->key)) {
+			order_remove(t, h);
+			table_remove(t, h);
+			held_free(h);
+		}
+	}
+	table_release(t);
+}
@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Limits a client's notifications to one per key per interval.
+ *
+ * A key whose change was just sent is held back until its interval
+ * ends. Changes to it meanwhile replace each other, and only the
+ * latest is sent when the interval ends; that starts another interval.
+ * A key with no change by the end of its interval is forgotten.
+ *
+ * Times are in milliseconds, from any monotonic clock.
+ */
+
+struct throttle;
+
+/* Returns NULL on allocation failure */
+struct throttle *throttle_new(void);
+void throttle_free(struct throttle *t);
+
+/*
+ * Decides if a change may be sent now. The key is the data up to its
+ * first NUL, if any.
+ * Returns 1 if it may; the key is then held back for interval ms.
+ * Returns 0 if the key is being held back; the data is kept in place
+ * of any kept earlier.
+ * Returns -1 on allocation failure.
+ */
+int throttle_check(struct throttle *t, const char *data,
+	unsigned int datalen, unsigned int interval, uint64_t now);
+
+/* Stops holding back a key, as when its change has been sent some other
+ * way. Any change kept for the key is dropped. The key is the data up
+ * to its first NUL, if any. */
+void throttle_forget(struct throttle *t, const char *data,
+	unsigned int datalen);
+
+/* Stops holding back each key for which keep() returns 0, dropping
+ * any change kept for it. keep() is given the key as a C string. */
+void throttle_keep_if(struct throttle *t,
+	int (*keep)(void *arg, const char *key), void *arg);
+
+/* Returns when the next interval ends, or 0 if no key is held back */
+uint64_t throttle_next(const struct throttle *t);
+
+/*
+ * Ends the intervals that have ended by now, passing each key's
+ * kept change to emit().
+ * Returns -1 if emit() returns -1, and 0 otherwise.
+ */
+int throttle_expire(struct throttle *t, uint64_t now,
+	int (*emit)(void *arg, const char *data, unsigned int datalen),
+	void *arg);
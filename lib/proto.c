@@ -39,6 +39,7 @@ proto_new()
 	if (!p)
 		return NULL;
 	p->mode = PROTO_MODE_UNKNOWN;
+	p->version = 0;
 	p->udata = NULL;
 	p->udata_free = NULL;
 	p->on_input = NULL;
@@ -112,6 +113,12 @@ proto_get_mode(struct proto *p)
 	return p->mode;
 }
 
+void
+proto_set_version(struct proto *p, unsigned char version)
+{
+	p->version = version;
+}
+
 /* -- error handling -- */
 
 /*
@@ -239,3 +246,159 @@ proto_output(struct proto *p, unsigned char msg, const char *fmt, ...)
 
 	return ret;
 }
+
+/* -- shared messages -- */
+
+void
+proto_msg_init(struct proto_msg *m, unsigned char msg,
+	const char *data, unsigned int datalen)
+{
+	m->msg = msg;
+	m->data = data;
+	m->datalen = datalen;
+	m->encoded = 0;
+	m->text = NULL;
+	m->textlen = 0;
+}
+
+void
+proto_msg_fini(struct proto_msg *m)
+{
+	free(m->text);
+	m->text = NULL;
+}
+
+#ifndef SMALL
+/* The text encoder's output, gathered by a stand-in proto */
+struct text_collect {
+	struct proto_msg *m;
+	char error[256];		/* the encoder's error, if any */
+};
+
+/* Collects the text encoder's output into the message */
+static int
+collect_text(struct proto *tp, const struct iovec *iov, int niov)
+{
+	struct text_collect *c = tp->udata;
+	struct proto_msg *m = c->m;
+	int i;
+
+	for (i = 0; i < niov; i++) {
+		char *text = realloc(m->text, m->textlen + iov[i].iov_len);
+		if (!text)
+			return -1;
+		memcpy(text + m->textlen, iov[i].iov_base, iov[i].iov_len);
+		m->text = text;
+		m->textlen += iov[i].iov_len;
+	}
+	return 0;
+}
+
+/* Keeps the text encoder's error, to report through the real proto */
+static void
+collect_error(struct proto *tp, const char *msg)
+{
+	struct text_collect *c = tp->udata;
+
+	snprintf(c->error, sizeof c->error, "%s", msg);
+}
+
+static int
+encode_text(struct proto *tp, unsigned char msg, const char *fmt, ...)
+{
+	va_list ap;
+	int ret;
+
+	va_start(ap, fmt);
+	ret = output_text(tp, msg, fmt, ap);
+	va_end(ap);
+	return ret;
+}
+#endif
+
+/* Encodes the message for the mode, unless it already has been */
+static int
+msg_encode(struct proto *p, struct proto_msg *m, int mode)
+{
+	if (m->encoded & (1 << mode))
+		return 0;
+	switch (mode) {
+#ifndef SMALL
+	case PROTO_MODE_BINARY:
+		if (m->datalen > 0xffff)
+			return output_binary_error(p, ENOMEM,
+				"packet too large, %u", m->datalen);
+		m->header[0] = m->msg;
+		m->header[1] = (m->datalen >> 8) & 0xff;
+		m->header[2] = (m->datalen >> 0) & 0xff;
+		break;
+	case PROTO_MODE_TEXT: {
+		/* Run the text encoder once, into m->text */
+		struct proto tp;
+		struct text_collect c;
+
+		memset(&tp, 0, sizeof tp);
+		tp.mode = PROTO_MODE_TEXT;
+		tp.udata = &c;
+		tp.on_sendv = collect_text;
+		tp.on_error = collect_error;
+		c.m = m;
+		c.error[0] = '\0';
+		m->textlen = 0;
+		if (encode_text(&tp, m->msg, "%*s", m->datalen,
+		    m->data) == -1)
+		{
+			if (c.error[0])
+				return output_error(p, errno, "%s", c.error);
+			return -1;
+		}
+		break;
+	}
+#endif
+	case PROTO_MODE_FRAMED:
+		break;
+	default:
+		return output_error(p, EINVAL, "bad mode %d", mode);
+	}
+	m->encoded |= 1 << mode;
+	return 0;
+}
+
+int
+proto_output_msg(struct proto *p, struct proto_msg *m)
+{
+	struct iovec iov[2];
+	int niov = 0;
+
+	if (p->mode == PROTO_MODE_UNKNOWN)
+		p->mode = PROTO_MODE_BINARY; /* prefer binary */
+	if (msg_encode(p, m, p->mode) == -1)
+		return -1;
+
+	switch (p->mode) {
+#ifndef SMALL
+	case PROTO_MODE_BINARY:
+		iov[0].iov_base = m->header;
+		iov[0].iov_len = sizeof m->header;
+		iov[1].iov_base = (void *)m->data;
+		iov[1].iov_len = m->datalen;
+		niov = 2;
+		break;
+	case PROTO_MODE_TEXT:
+		iov[0].iov_base = m->text;
+		iov[0].iov_len = m->textlen;
+		niov = 1;
+		break;
+#endif
+	case PROTO_MODE_FRAMED:
+		iov[0].iov_base = &m->msg;
+		iov[0].iov_len = 1;
+		iov[1].iov_base = (void *)m->data;
+		iov[1].iov_len = m->datalen;
+		niov = 2;
+		break;
+	}
+	if (p->on_sendv)
+		return p->on_sendv(p, iov, niov);
+	return 0;
+}
@@ -147,6 +147,33 @@ int proto_output(struct proto *p, unsigned char msg, const char *fmt, ...);
 int proto_outputv(struct proto *p, unsigned char msg, const char *fmt,
 	va_list ap);
 
+/*
+ * A message to be sent to many peers, encoded at most once for each
+ * network mode instead of once for each peer.
+ * proto_msg_init() only records the message, which has the form of
+ * proto_output(p, msg, "%*s", datalen, data). The data must remain
+ * valid until proto_msg_fini().
+ */
+struct proto_msg {
+	unsigned char msg;
+	const char *data;
+	unsigned int datalen;
+	unsigned char encoded;		/* modes encoded, 1 << mode */
+	char header[3];			/* binary mode's message header */
+	char *text;			/* text mode's encoded line */
+	unsigned int textlen;
+};
+void proto_msg_init(struct proto_msg *m, unsigned char msg,
+	const char *data, unsigned int datalen);
+void proto_msg_fini(struct proto_msg *m);
+
+/* proto_output_msg():
+ *  Sends a shared message, like proto_output().
+ *  Returns 0+ on success.
+ *  Returns -1 on error (EINVAL, ENOMEM).
+ */
+int proto_output_msg(struct proto *p, struct proto_msg *m);
+
 /* Sends a MSG_ERROR to the peer, fmt is human text */
 __attribute__((format(printf, 3, 4)))
 int proto_output_error(struct proto *p, unsigned char code,
@@ -187,6 +214,11 @@ void proto_set_on_error(struct proto *p,
 int proto_set_mode(struct proto *p, int mode);
 int proto_get_mode(struct proto *p);
 
+/* Sets the protocol version agreed by HELLO, initially 0.
+ * The text variant only parses a SUB <interval> from version 1;
+ * before then, the rest of a SUB line is all pattern. */
+void proto_set_version(struct proto *p, unsigned char version);
+
 /*
  * Note: PROTO_MODE_FRAMED is an efficient mode that can be used
  * when the transport stream provides its own framing. (For example
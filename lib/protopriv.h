@@ -10,6 +10,7 @@
 
 struct proto {
 	int mode;
+	unsigned char version;		/* negotiated by HELLO */
 	void *udata;
 	void (*udata_free)(void *udata);
 	int (*on_input)(struct proto *p, unsigned char msg,
@@ -18,10 +18,11 @@ static struct {
 	const char *word;
 	unsigned char id;
 	const char *fmt;
+	const char *fmt1;	/* fmt from version 1, if different */
 } cmdtab[] = {
 	{ "HELLO",	CMD_HELLO, "i|t" },
-	{ "SUB",	CMD_SUB, "t" },
-	{ "S",		CMD_SUB, "t" },
+	{ "SUB",	CMD_SUB, "t", "t|0t" },
+	{ "S",		CMD_SUB, "t", "t|0t" },
 	{ "UNSUB",	CMD_UNSUB, "t" },
 	{ "U",		CMD_UNSUB, "t" },
 	{ "READ",	CMD_READ, "t" },
@@ -43,10 +44,18 @@ static struct {
 	{ NULL }
 };
 
+/* Returns the argument format of cmdtab[i] in the proto's version */
+static const char *
+cmd_fmt(const struct proto *p, unsigned int i)
+{
+	return p->version >= 1 && cmdtab[i].fmt1 ? cmdtab[i].fmt1
+						 : cmdtab[i].fmt;
+}
+
 static const char help_text[] =
 	"Commands:\r\n"
 	" hello <int> [<clientid>]   - negotiate protocol\r\n"
-	" sub <pattern>              - subscribe to pattern\r\n"
+	" sub <pattern> [<ms>]       - subscribe to pattern\r\n"
 	" unsub <pattern>            - remove previous subscription\r\n"
 	" read <key>                 - read from store, request INFO\r\n"
 	" write <key> [<value>]      - write to store\r\n"
@@ -154,7 +163,7 @@ again:
 			return -1;
 		if (rxbuf_addc(&p->rx, cmdtab[i].id) == -1)
 			return -1;
-		t->fmt = cmdtab[i].fmt;
+		t->fmt = cmd_fmt(p, i);
 		t->optional = 0;
 		t->state = T_ARGSP; /* fallthru */
 	case T_ARGSP:
@@ -332,7 +341,7 @@ outbuf_flush(struct proto *p)
 static int
 proto_outbuf(struct proto *p, const char *data, unsigned int datasz)
 {
-	unsigned int space = sizeof sizeof outbuf - outbuf_len;
+	unsigned int space = sizeof outbuf - outbuf_len;
 	if (datasz <= space) {
 		/* Small writes: append to buffer */
 		memcpy(&outbuf[outbuf_len], data, datasz);
@@ -453,7 +462,7 @@ output_text(struct proto *p, unsigned char msg, const char *fmt, va_list ap)
 	if (proto_outbuf(p, word, strlen(word)) == -1)
 		return -1;
 
-	tfmt = cmdtab[j].fmt;
+	tfmt = cmd_fmt(p, j);
 	optional = 0;
 	while (*fmt) {
 		char f, t;
@@ -482,12 +491,12 @@ output_text(struct proto *p, unsigned char msg, const char *fmt, va_list ap)
 		case '\0':
 			return output_text_error(p, EINVAL,
 				"%s/%s: can't match %%%c against tfmt '%s'",
-				word, ofmt, f, cmdtab[j].fmt);
+				word, ofmt, f, cmd_fmt(p, j));
 		case 'i':
 			if (f != 'c')
 				return output_text_error(p, EINVAL,
 					"%s/%s: expected %%c not %%%c for '%s'",
-					word, ofmt, f, cmdtab[j].fmt);
+					word, ofmt, f, cmd_fmt(p, j));
 			ch = va_arg(ap, int);
 			len = snprintf(ibuf, sizeof ibuf, "%u", ch & 0xff);
 			if (proto_outbuf(p, ibuf, len) == -1)
@@ -497,7 +506,7 @@ output_text(struct proto *p, unsigned char msg, const char *fmt, va_list ap)
 			if (f != 'c')
 				return output_text_error(p, EINVAL,
 					"%s/%s: expected %%c not %%%c for '%s'",
-					word, ofmt, f, cmdtab[j].fmt);
+					word, ofmt, f, cmd_fmt(p, j));
 			ch = va_arg(ap, int);
 			if (ch != 0)
 				return output_text_error(p, EINVAL,
@@ -511,7 +520,7 @@ output_text(struct proto *p, unsigned char msg, const char *fmt, va_list ap)
 			if (f != 's')
 				return output_text_error(p, EINVAL,
 					"%s/%s: expected %%s not %%%c for '%s'",
-					word, ofmt, f, cmdtab[j].fmt);
+					word, ofmt, f, cmd_fmt(p, j));
 
 			if (star) {
 				len = va_arg(ap, int);
@@ -551,7 +560,7 @@ output_text(struct proto *p, unsigned char msg, const char *fmt, va_list ap)
 	if (!optional && *tfmt && *tfmt != '|')
 		return output_text_error(p, EINVAL,
 			"%s/%s: missing arguments for '%s'",
-			word, ofmt, cmdtab[j].fmt);
+			word, ofmt, cmd_fmt(p, j));
 	if (proto_outbuf(p, "\r\n", 2) == -1)
 		return -1;
 	return outbuf_flush(p);
@@ -35,7 +35,7 @@ init_address(struct sockaddr_un *sun, socklen_t *len_return)
 }
 
 int
-sockunix_listen()
+sockunix_listen(int backlog)
 {
 	int s;
 	struct sockaddr_un sun;
@@ -49,7 +49,7 @@ sockunix_listen()
 		close(s);
 		return -1;
 	}
-	if (listen(s, 5) == -1) {
+	if (listen(s, backlog) == -1) {
 		close(s);
 		return -1;
 	}
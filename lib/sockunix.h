@@ -3,7 +3,7 @@
 /* Environment variable used for socket path */
 #define INFOD_SOCKET "\0INFOD"
 
-int sockunix_listen(void);
+int sockunix_listen(int backlog);
 int sockunix_connect(void);
 const char *sockunix_peername(int fd, char *buf, size_t sz);
 
@@ -617,6 +617,18 @@ test_text_proto()
 	/* Exercise recv other messages [from net] */
 	assert_proto_recv(p, "sub *\n");
 	assert_mock_on_input(p, CMD_SUB, "*");
+	/* Before version 1, the rest of the line is the pattern */
+	assert_proto_recv(p, "sub a b\n");
+	assert_mock_on_input(p, CMD_SUB, "a b");
+	assert_proto_recv(p, "s * 100\n");
+	assert_mock_on_input(p, CMD_SUB, "* 100");
+	/* From version 1, a last word is the interval */
+	proto_set_version(p, 1);
+	assert_proto_recv(p, "s * 100\n");
+	assert_mock_on_input(p, CMD_SUB, "*\0" "100");
+	assert_proto_recv(p, "sub *\n");
+	assert_mock_on_input(p, CMD_SUB, "*");
+	proto_set_version(p, 0);
 	assert_proto_recv(p, "unSUB *\n");
 	assert_mock_on_input(p, CMD_UNSUB, "*");
 	assert_proto_recv(p, "READ key\n");
@@ -826,6 +838,107 @@ test_framed_proto()
 	proto_free(p);
 }
 
+/* Checks that a shared message is sent as proto_output() would */
+static void
+check_shared_msg(int mode, const char *data, unsigned int datalen)
+{
+	static char expected[sizeof mock_on_sendv.data];
+	unsigned int expectedlen;
+	struct proto_msg m;
+	struct proto *p, *q;
+
+	p = proto_new();
+	q = proto_new();
+	mock_clear();
+	proto_set_on_sendv(p, mock_on_sendv_fn);
+	proto_set_on_sendv(q, mock_on_sendv_fn);
+	proto_set_on_error(p, mock_on_error_fn);
+	proto_set_on_error(q, mock_on_error_fn);
+	assert(proto_set_mode(p, mode) != -1);
+	assert(proto_set_mode(q, mode) != -1);
+
+	assert(proto_output(p, MSG_INFO, "%*s", datalen, data) != -1);
+	expectedlen = mock_on_sendv.datalen;
+	memcpy(expected, mock_on_sendv.data, expectedlen);
+	mock_on_sendv_clear();
+
+	/* Two peers in the same mode get the same, single encoding */
+	proto_msg_init(&m, MSG_INFO, data, datalen);
+	assert(proto_output_msg(p, &m) != -1);
+	assert(mock_on_sendv.counter == 1);
+	assert(mock_on_sendv.datalen == expectedlen);
+	assert(memcmp(mock_on_sendv.data, expected, expectedlen) == 0);
+	mock_on_sendv_clear();
+	assert(m.encoded == 1 << mode);
+	assert(proto_output_msg(q, &m) != -1);
+	assert(mock_on_sendv.datalen == expectedlen);
+	assert(memcmp(mock_on_sendv.data, expected, expectedlen) == 0);
+	mock_on_sendv_clear();
+	assert(m.encoded == 1 << mode);
+	proto_msg_fini(&m);
+
+	assert(!mock_on_error.counter);
+	proto_free(p);
+	proto_free(q);
+}
+
+static void
+test_shared_msg()
+{
+	static const int modes[] = {
+#ifndef SMALL
+		PROTO_MODE_BINARY, PROTO_MODE_TEXT,
+#endif
+		PROTO_MODE_FRAMED
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof modes / sizeof modes[0]; i++) {
+		check_shared_msg(modes[i], "key", 3);
+		check_shared_msg(modes[i], "key\0value", 9);
+		check_shared_msg(modes[i], "k\"y\0v\r\n", 7);
+		check_shared_msg(modes[i], Mega, 5000);
+		check_shared_msg(modes[i], Mega, 0xffff);
+	}
+
+#ifndef SMALL
+	/* A message too large for binary mode is refused */
+	{
+		struct proto_msg m;
+		struct proto *p = proto_new();
+
+		mock_clear();
+		proto_set_on_sendv(p, mock_on_sendv_fn);
+		proto_set_on_error(p, mock_on_error_fn);
+		assert(proto_set_mode(p, PROTO_MODE_BINARY) != -1);
+		proto_msg_init(&m, MSG_INFO, Mega, 0x10000);
+		assert(proto_output_msg(p, &m) == -1);
+		assert_no_mock_on_sendv();
+		assert_mock_on_error_called(p);
+		proto_msg_fini(&m);
+		proto_free(p);
+	}
+
+	/* A text encoding error is reported by the real proto */
+	{
+		struct proto_msg m;
+		struct proto *p = proto_new();
+
+		mock_clear();
+		proto_set_on_sendv(p, mock_on_sendv_fn);
+		proto_set_on_error(p, mock_on_error_fn);
+		assert(proto_set_mode(p, PROTO_MODE_TEXT) != -1);
+		proto_msg_init(&m, 0x7f, "key", 3);	/* unknown msg */
+		assert(proto_output_msg(p, &m) == -1);
+		assert(errno == EINVAL);
+		assert_no_mock_on_sendv();
+		assert_mock_on_error_called(p);
+		proto_msg_fini(&m);
+		proto_free(p);
+	}
+#endif
+}
+
 int
 main()
 {
@@ -863,6 +976,7 @@ main()
 	test_text_proto();
 #endif
 	test_framed_proto();
+	test_shared_msg();
 
 	dprintf("%s:%d: %s\n", __FILE__, __LINE__, PASSED);
 }
@@ -20,7 +20,7 @@ rm -f $INFOD_SOCKET
 # Start a private server running
 $infod -f $TMP.db &
 INFOD_PID=$!
-trap "kill $INFOD_PID; rm -f $TMP.db $INFOD_SOCKET; exit" 0 1 2
+trap "kill $INFOD_PID; wait $INFOD_PID; rm -f $TMP.db $TMP.db.idx $INFOD_SOCKET; exit" 0 1 2
 while nice test ! -e $INFOD_SOCKET; do : ;done # busy wait
 
 print_last () {
@@ -133,3 +133,20 @@ run $info -w key=e=e=e=e=e
 run $info -r key
   expect 0 "e=e=e=e=e"
 
+
+# subscribing dumps only the keys matching the pattern
+run $info -w net.eth0.rx=1 -w net.eth0.tx=2 -w net.eth1.rx=3 \
+	-w net.eth=4 -w net.eth0=5 -w nes=6
+  expect 0
+run $info -k= -t0 -s 'net.eth0.*'
+  sort_stdout
+  expect 0 "net.eth0.rx=1${nl}net.eth0.tx=2"
+run $info -k= -t0 -s 'net\.eth(0|1).rx'
+  sort_stdout
+  expect 0 "net.eth0.rx=1${nl}net.eth1.rx=3"
+run $info -k= -t0 -s '*rx'
+  sort_stdout
+  expect 0 "net.eth0.rx=1${nl}net.eth1.rx=3"
+run $info -k= -t0 -s 'net.eth0' -s 'net\.eth' -s 'net.eth2'
+  sort_stdout
+  expect 0 "net.eth0=5${nl}net.eth=4"